@@ -13,10 +13,10 @@ FDGridSegment::FDGridSegment (int N, MPIInstance& mpi)
 
 	// Create the data matrix plus ghost point (2 rows and columns)
 	// for communication with neighbour processes.
-	mRow0 = int (double(N)/double(q)*mProcessorGrid.row(id)+0.0001);
-	mRow1 = int (double(N)/double(q)*(mProcessorGrid.row(id)+1)+0.0001)-1;
-	mCol0 = int (double(N)/double(q)*mProcessorGrid.column(id)+0.0001);
-	mCol1 = int (double(N)/double(q)*(mProcessorGrid.column(id)+1)+0.0001)-1;
+	segmentOf (id, mRow0, mRow1, mCol0, mCol1);
+	mDiagnostics.maxDelta = 0.0;
+	mDiagnostics.sum = 0.0;
+	mpCheck = mrMPI.world().allReduceInit (&mLocalDiagnostics, &mDiagnostics, 1, FDGridDiagnosticsOp());
 	mMatrix.make (mRow1-mRow0+1+2, mCol1-mCol0+1+2);
 	printf ("Processor %d handles matrix segment from (%d,%d) to (%d,%d)\n",
 			id, mRow0, mCol0, mRow1, mCol1);
@@ -24,6 +24,53 @@ FDGridSegment::FDGridSegment (int N, MPIInstance& mpi)
 
 	// Create communication data types
 	mColumnVectorType.make (mRow1-mRow0+1, 1, mMatrix.cols, MPI_DOUBLE);
+
+#if MPI_VERSION >= 2
+	// Expose the matrix to the neighbours. The puts need the shapes
+	// of the neighbours' matrices, which differ from this one when N
+	// is not divisible by q. A single process has no neighbours.
+	mpHalo = NULL;
+	mpNeighbours = NULL;
+	if (mpis == 1)
+		return;
+	mpHalo = new MPIWindow (mrMPI.world(), &mMatrix.get(0,0),
+							mMatrix.rows*mMatrix.cols*sizeof(double), sizeof(double));
+	int neighbours[4], count=0;
+	int r0, r1, c0, c1;
+	if (mProcessorGrid.upPid(id) != MPI_PROC_NULL) {
+		segmentOf (neighbours[count++] = mProcessorGrid.upPid(id), r0, r1, c0, c1);
+		mUpRows = r1-r0+1+2;
+	}
+	if (mProcessorGrid.downPid(id) != MPI_PROC_NULL)
+		neighbours[count++] = mProcessorGrid.downPid(id);
+	if (mProcessorGrid.leftPid(id) != MPI_PROC_NULL) {
+		segmentOf (neighbours[count++] = mProcessorGrid.leftPid(id), r0, r1, c0, c1);
+		mLeftCols = c1-c0+1+2;
+		mLeftColumnType.make (mRow1-mRow0+1, 1, mLeftCols, MPI_DOUBLE);
+	}
+	if (mProcessorGrid.rightPid(id) != MPI_PROC_NULL) {
+		segmentOf (neighbours[count++] = mProcessorGrid.rightPid(id), r0, r1, c0, c1);
+		mRightCols = c1-c0+1+2;
+		mRightColumnType.make (mRow1-mRow0+1, 1, mRightCols, MPI_DOUBLE);
+	}
+	mpNeighbours = new MPIGroup (mrMPI.world(), neighbours, count);
+#endif
+}
+
+FDGridSegment::~FDGridSegment () {
+	delete mpCheck;
+#if MPI_VERSION >= 2
+	delete mpHalo;
+	delete mpNeighbours;
+#endif
+}
+
+void FDGridSegment::segmentOf (int id, int& row0, int& row1, int& col0, int& col1) const {
+	int q = int (sqrt(double(mrMPI.world().size()))+.0001);
+	row0 = int (double(mN)/double(q)*mProcessorGrid.row(id)+0.0001);
+	row1 = int (double(mN)/double(q)*(mProcessorGrid.row(id)+1)+0.0001)-1;
+	col0 = int (double(mN)/double(q)*mProcessorGrid.column(id)+0.0001);
+	col1 = int (double(mN)/double(q)*(mProcessorGrid.column(id)+1)+0.0001)-1;
 }
 
 void FDGridSegment::init () {
@@ -40,8 +87,11 @@ void FDGridSegment::execute (int maxcycles, double epsilon) {
 	init ();
 	
 	for (mCycle=0; mCycle<maxcycles; mCycle++) {
-		// We may terminate unless there is a delta larger than the epsilon
-		int mayTerminate = true;
+		// We may terminate unless there is a delta larger than the
+		// epsilon anywhere in the grid
+		FDGridDiagnostics& local = mLocalDiagnostics;
+		local.maxDelta = 0.0;
+		local.sum = 0.0;
 
 		startOfCycle ();
 		
@@ -53,9 +103,10 @@ void FDGridSegment::execute (int maxcycles, double epsilon) {
 				// Compute the new value by the absolute coordinates
 				double newvalue = compute (r+mRow0-1, c+mCol0-1);
 
-				// We do not want to terminate if the delta > epsilon
-				if (fabs(mMatrix.get(r,c) - newvalue) > epsilon)
-					mayTerminate = false;
+				double delta = fabs(mMatrix.get(r,c) - newvalue);
+				if (delta > local.maxDelta)
+					local.maxDelta = delta;
+				local.sum += newvalue;
 
 				// Update the new value
 				mMatrix.get(r,c) = newvalue;
@@ -63,34 +114,73 @@ void FDGridSegment::execute (int maxcycles, double epsilon) {
 
 		endOfCycle ();
 
-		////////////////////////////////////////
+		// Check for termination every 10th cycle. All the
+		// diagnostics are reduced together, in the background of the
+		// exchange.
+		bool check = !(cycle()%10);
+		if (check)
+			mpCheck->start ();
+
 		// Exchange data with neighbouring matrices
+		exchange ();
 
-		MPIComm& comm = mrMPI.world();
-		int id = comm.getRank();
-
-		// Send to up and receive from down
-		comm.send (&mMatrix.get(1,1), mMatrix.cols-2, MPI_DOUBLE, mProcessorGrid.upPid(id));
-		comm.recv (&mMatrix.get(mMatrix.rows-1,1), mMatrix.cols-2, MPI_DOUBLE, mProcessorGrid.downPid(id));
-		// Send to down and receive from up
-		comm.send (&mMatrix.get(mMatrix.rows-2,1), mMatrix.cols-2, MPI_DOUBLE, mProcessorGrid.downPid(id));
-		comm.recv (&mMatrix.get(0,1), mMatrix.cols-2, MPI_DOUBLE, mProcessorGrid.upPid(id));
-		// Send to left and receive from right
-		comm.send (&mMatrix.get(1,1), 1, mColumnVectorType.getType(), mProcessorGrid.leftPid(id));
-		comm.recv (&mMatrix.get(1,mMatrix.cols-1), 1, mColumnVectorType.getType(), mProcessorGrid.rightPid(id));
-		// Send to right and receive from left
-		comm.send (&mMatrix.get(1,mMatrix.cols-2), 1, mColumnVectorType.getType(), mProcessorGrid.rightPid(id));
-		comm.recv (&mMatrix.get(1,0), 1, mColumnVectorType.getType(), mProcessorGrid.leftPid(id));
-
-		// Check for termination every 10th cycle, 
-		if (!(cycle()%10)) {
-			int mayAllTerminate;
-			comm.allReduce (&mayTerminate, &mayAllTerminate, 1, MPI_INT, MPI_LAND);
-			if (mayAllTerminate) {
-				if (id==0)
-					printf ("Converged after %d iterations.\n", cycle());
+		if (check) {
+			mpCheck->wait ();
+			if (mDiagnostics.maxDelta <= epsilon) {
+				if (mrMPI.world().getRank()==0)
+					printf ("Converged after %d iterations, mean value %g.\n",
+							cycle(), mDiagnostics.sum/(double(mN)*mN));
 				break;
 			}
 		}
 	}
 }
+
+void FDGridSegment::exchange () {
+	MPIComm& comm = mrMPI.world();
+	int id = comm.getRank();
+
+#if MPI_VERSION >= 2
+	// Expose the ghost points to the neighbours, and write the
+	// boundaries into theirs. The epoch synchronizes only the
+	// neighbours, and the ghost points are not written while this
+	// process is computing with them.
+	if (!mpHalo)
+		return;
+	mpHalo->post (*mpNeighbours);
+	mpHalo->start (*mpNeighbours);
+
+	// Up into the last row of the upper neighbour, down into the
+	// first row of the lower one
+	if (mProcessorGrid.upPid(id) != MPI_PROC_NULL)
+		mpHalo->put (&mMatrix.get(1,1), mMatrix.cols-2, MPI_DOUBLE, mProcessorGrid.upPid(id),
+					 (mUpRows-1)*mMatrix.cols+1);
+	if (mProcessorGrid.downPid(id) != MPI_PROC_NULL)
+		mpHalo->put (&mMatrix.get(mMatrix.rows-2,1), mMatrix.cols-2, MPI_DOUBLE, mProcessorGrid.downPid(id),
+					 1);
+	// Left into the last column of the left neighbour, right into
+	// the first column of the right one
+	if (mProcessorGrid.leftPid(id) != MPI_PROC_NULL)
+		mpHalo->put (&mMatrix.get(1,1), 1, mColumnVectorType.getType(), mProcessorGrid.leftPid(id),
+					 mLeftCols+mLeftCols-1, mLeftColumnType.getType());
+	if (mProcessorGrid.rightPid(id) != MPI_PROC_NULL)
+		mpHalo->put (&mMatrix.get(1,mMatrix.cols-2), 1, mColumnVectorType.getType(), mProcessorGrid.rightPid(id),
+					 mRightCols, mRightColumnType.getType());
+
+	mpHalo->complete ();
+	mpHalo->wait ();
+#else
+	// Send to up and receive from down
+	comm.send (&mMatrix.get(1,1), mMatrix.cols-2, MPI_DOUBLE, mProcessorGrid.upPid(id));
+	comm.recv (&mMatrix.get(mMatrix.rows-1,1), mMatrix.cols-2, MPI_DOUBLE, mProcessorGrid.downPid(id));
+	// Send to down and receive from up
+	comm.send (&mMatrix.get(mMatrix.rows-2,1), mMatrix.cols-2, MPI_DOUBLE, mProcessorGrid.downPid(id));
+	comm.recv (&mMatrix.get(0,1), mMatrix.cols-2, MPI_DOUBLE, mProcessorGrid.upPid(id));
+	// Send to left and receive from right
+	comm.send (&mMatrix.get(1,1), 1, mColumnVectorType.getType(), mProcessorGrid.leftPid(id));
+	comm.recv (&mMatrix.get(1,mMatrix.cols-1), 1, mColumnVectorType.getType(), mProcessorGrid.rightPid(id));
+	// Send to right and receive from left
+	comm.send (&mMatrix.get(1,mMatrix.cols-2), 1, mColumnVectorType.getType(), mProcessorGrid.rightPid(id));
+	comm.recv (&mMatrix.get(1,0), 1, mColumnVectorType.getType(), mProcessorGrid.leftPid(id));
+#endif
+}
@@ -4,6 +4,7 @@
 #define NODEBUG
 
 #include <mpi++.h>
+#include <mpiwindow.h>
 #include <magic/object.h>
 #include <magic/Matrix.h>
 
@@ -27,6 +28,23 @@ class ProcessorGrid {
 	int		mQ;
 };
 
+/** Global diagnostics of a cycle of the finite difference grid. */
+struct FDGridDiagnostics {
+	/** Largest absolute change of a value during the cycle. */
+	double	maxDelta;
+	/** Sum of all values. */
+	double	sum;
+};
+
+/** Combines the diagnostics of two grid segments. */
+struct FDGridDiagnosticsOp {
+	void	operator()	(const FDGridDiagnostics& in, FDGridDiagnostics& inout) const {
+		if (in.maxDelta > inout.maxDelta)
+			inout.maxDelta = in.maxDelta;
+		inout.sum += in.sum;
+	}
+};
+
 /** Two-dimensional finite difference grid segment, globally acting.
  *
  *  This is a globalized solution to finite difference calculation,
@@ -35,6 +53,10 @@ class ProcessorGrid {
  *  using a globalized solution comes from the MPI_Type_vector
  *  datatype, which can be used to easily transmit values of matrices,
  *  but not of objects.
+ *
+ *  The processes write their boundary values directly into the ghost
+ *  points of their neighbours with one-sided puts, when the MPI
+ *  implementation supports them.
  **/
 class FDGridSegment : public Object {
   public:
@@ -45,6 +67,7 @@ class FDGridSegment : public Object {
 	 *  @param mpi The global MPI instance for communication.
 	 **/
 					FDGridSegment	(int N, MPIInstance& mpi);
+					~FDGridSegment	();
 
 	/** Executes the finite difference calculation until termination
 	 *  criteria is met.
@@ -93,6 +116,12 @@ class FDGridSegment : public Object {
 	/** Returns the size of the N*N matrix. */
 	int				N				() const {return mN;}
 
+	/** Returns the area (inclusive) computed by this process. */
+	int				firstRow		() const {return mRow0;}
+	int				lastRow			() const {return mRow1;}
+	int				firstColumn		() const {return mCol0;}
+	int				lastColumn		() const {return mCol1;}
+
 	MPIInstance&	mpi				() {return mrMPI;}
 	
   private:
@@ -102,6 +131,12 @@ class FDGridSegment : public Object {
 	/** Initializes the grid segment. */
 	void			init			();
 
+	/** Returns the area (inclusive) computed by the given process. */
+	void			segmentOf		(int id, int& row0, int& row1, int& col0, int& col1) const;
+
+	/** Exchanges the boundary values with the neighbour processes. */
+	void			exchange		();
+
 	/** The data matrix plus ghost points for communication with
 	 *  neighbour processes.
 	 **/
@@ -109,6 +144,11 @@ class FDGridSegment : public Object {
 
 	/** Current iteration cycle. */
 	int				mCycle;
+	FDGridDiagnostics	mDiagnostics;
+	/** Diagnostics of this segment in the current cycle. */
+	FDGridDiagnostics	mLocalDiagnostics;
+	/** Reduces the diagnostics for the termination check. */
+	MPICollective*	mpCheck;
 	MPIInstance&	mrMPI;
 	ProcessorGrid	mProcessorGrid;
 	int				mRow0;
@@ -116,6 +156,21 @@ class FDGridSegment : public Object {
 	int				mCol0;
 	int				mCol1;
 	MPIVector		mColumnVectorType;
+#if MPI_VERSION >= 2
+	/** The matrix exposed to the neighbours for writing their
+	 *  boundaries into the ghost points.
+	 **/
+	MPIWindow*		mpHalo;
+	MPIGroup*		mpNeighbours;
+	/** Matrix rows of the upper neighbour. */
+	int				mUpRows;
+	/** Matrix columns of the left and right neighbours. */
+	int				mLeftCols;
+	int				mRightCols;
+	/** Ghost columns of the left and right neighbours. */
+	MPIVector		mLeftColumnType;
+	MPIVector		mRightColumnType;
+#endif
 };
 
 #endif
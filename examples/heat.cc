@@ -4,23 +4,41 @@
 
 #include <mpi++.h>
 #include <mpe++.h>
+#include <mpiimage.h>
 
 #include "fdgrid.h"
 
 class HeatGridSegment : public FDGridSegment {
   public:
-	HeatGridSegment (int N, MPIInstance& mpi, double omega, int updatefreq)
-			: FDGridSegment (N, mpi), mMPE (mpi.world(), 0, 0, N, N, NULL) {
-		MPE_Color tmpColor[64];
-		mMPE.makeColorArray (tmpColor, 64);
-		// Reverse the color order (we want blue to be cold and red to be hot).
-		for (int i=0; i<64; i++)
-			mColors[i] = tmpColor[63-i];
+	/** Constructor.
+	 *
+	 *  @param headless If true, no window is opened and the picture
+	 *  is written to heat.ppm instead.
+	 **/
+	HeatGridSegment (int N, MPIInstance& mpi, double omega, int updatefreq, bool headless)
+			: FDGridSegment (N, mpi), mpMPE (NULL), mImage (mpi.world(), N, N) {
+		if (!headless) {
+			mpMPE = new MPEWindow (mpi.world(), 0, 0, N, N, NULL);
+			MPE_Color tmpColor[64];
+			mpMPE->makeColorArray (tmpColor, 64);
+			// Reverse the color order (we want blue to be cold and red to be hot).
+			for (int i=0; i<64; i++)
+				mColors[i] = tmpColor[63-i];
+		}
+
+		// Same ramp from blue to red for the picture file
+		for (int i=0; i<64; i++) {
+			mRGB[3*i]	= 4*i;
+			mRGB[3*i+1]	= 0;
+			mRGB[3*i+2]	= 255-4*i;
+		}
 		
 		mOmega = omega;
 		mUpdateFreq = updatefreq;
 	}
 
+					~HeatGridSegment	() {delete mpMPE;}
+
 	virtual double	initPoint		(int row, int col) const {
 		// Left, upper, and right edges have temperature 100 degrees
 		if (row<0 || col<0 || col>=N())
@@ -30,40 +48,50 @@ class HeatGridSegment : public FDGridSegment {
 	}
 
 	virtual double	compute			(int r, int c) const {
-		double result = mOmega/4*(value(r-1,c)+value(r+1,c)+value(r,c-1)+value(r,c+1))
+		return mOmega/4*(value(r-1,c)+value(r+1,c)+value(r,c-1)+value(r,c+1))
 			+ (1-mOmega)*value(r,c);
-
-		// Plot the point to the picture every 10th cycle
-		if (!(cycle()%mUpdateFreq))
-			mMPE.drawPoint (c, r, mColors[int(63.0*fabs(result)/100.0)%64]);
-		return result;
  	}
 
 	virtual void	endOfCycle		() {
 		// Draw the picture every 10th cycle
 		if (!(cycle()%mUpdateFreq)) {
-			mMPE.update (); // Finalize drawing
+			// Plot our own area to the picture and collect the
+			// areas of all processes to process 0
+			for (int r=firstRow(); r<=lastRow(); r++)
+				for (int c=firstColumn(); c<=lastColumn(); c++)
+					mImage.set (c, r, int(63.0*fabs(value(r,c))/100.0)%64);
+			mImage.gather ();
+
+			if (mpi().world().getRank()==0) {
+				if (mpMPE) {
+					mpMPE->drawImage (mImage, mColors);
+					mpMPE->update (); // Finalize drawing
+				} else
+					mImage.writePPM ("heat.ppm", mRGB);
+			}
 
 			// Check if the mouse has been pressed every 10th
 			// cycle. We do this only with process 0, because the MPE
 			// doesn't seem to like the others to call the mouse
 			// routines.
-			if (mpi().world().getRank()==0) {
+			if (mpi().world().getRank()==0 && mpMPE) {
 				int button;
 				int x, y;
 
 				// Check for left mouse button
-				if (mMPE.getMousePressed (MPE_BUTTON1, &x, &y))
+				if (mpMPE->getMousePressed (MPE_BUTTON1, &x, &y))
 					try { printf ("Temperature at point (%d,%d) is %g degrees.\n",
 								  x, y, value (y,x)); } catch (...) {}
 
 				// Check for middle mouse button. This doesn't work
 				// for some reason. The MPE seems to be able to take
 				// all mouse presses as BUTTON1.
-				if (mMPE.getMousePressed (MPE_BUTTON2))
+				if (mpMPE->getMousePressed (MPE_BUTTON2))
 					printf ("Iteration %d.\n", cycle());
+			}
 
-				// Thus we print the cycle here.
+			// Thus we print the cycle here.
+			if (mpi().world().getRank()==0) {
 				printf ("Iteration %d.\n", cycle());
 				fflush (stdout);
 			}
@@ -71,15 +99,20 @@ class HeatGridSegment : public FDGridSegment {
 	}
 
   private:
-	mutable MPEWindow	mMPE;
-	MPE_Color			mColors[64];
-	double				mOmega;
-	int					mUpdateFreq;
+	MPEWindow*		mpMPE;
+	MPE_Color		mColors[64];
+	unsigned char	mRGB[3*64];
+
+	/** The picture, with indices to mColors. */
+	MPIImage		mImage;
+	double			mOmega;
+	int				mUpdateFreq;
 };
 
 Main () {
 	MPIInstance mpi (mArgc, mArgv);
 
-	HeatGridSegment segment (150, mpi, 1.2, 10);
+	int headless = mParamMap["headless"];
+	HeatGridSegment segment (150, mpi, 1.2, 10, headless);
 	segment.execute (100000, 0.001);
 }
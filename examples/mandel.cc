@@ -1,44 +1,414 @@
 #include "mpi++.h"
 #include "mpe++.h"
-#include "mpistream.h"
+#include "mpitaskfarm.h"
+#include "mpiimage.h"
+#include "mandelkernel.h"
+#include "mandelcache.h"
 
 #include <stdio.h>
 #include <applic.h>
 #include <unistd.h>
 #include <Math.h>
 #include <complex.h>
+#include <magic/packarray.h>
 
 // We use the standard C++ complex value implementation
 typedef complex<double> Complex;
 
-int mandel (const Complex& c) {
-	Complex z (0.0, 0.0);
-	int count	= 0,
-		max		= 255; // Max nr of iterations
-	double len2;
-	
-	/* Mandelbrot function */
-	do {
-		z = z*z + c;
-		len2 = sqr(z.real()) + sqr(z.imag());
-	} while ( len2<4.0 && ++count<max );
-
-	return count;
+// Max nr of iterations
+const int cMaxIter = 255;
+
+// We use only the default colors (strange, there didn't seem to
+// exist a method to query the color handles in the MPE...)
+MPE_Color defcolors[] = {MPE_WHITE, MPE_RED, MPE_YELLOW, MPE_GREEN,
+		 MPE_CYAN, MPE_BLUE, MPE_MAGENTA, MPE_AQUAMARINE, MPE_FORESTGREEN, MPE_ORANGE,
+		 MPE_MAROON, MPE_BROWN, MPE_PINK, MPE_CORAL, MPE_GRAY, MPE_BLACK};
+
+// Scheduling of the tasks: tasks per chunk, chunks prefetched per
+// slave, and whether the slaves steal tasks from each other instead of
+// getting them from the master.
+const int	cChunk		= 4;
+const int	cPrefetch	= 2;
+const bool	cStealing	= false;
+
+// Progressive rendering: the coarse pass computes every cCoarse'th
+// point of every cCoarse'th row with cCoarseIter iterations. The
+// refinement pass then computes the frame in tiles of cTile*cTile
+// points, cTileBatch tiles at a time, starting from the center.
+const int	cCoarse		= 4;
+const int	cCoarseIter	= 64;
+const int	cTile		= 25;
+const int	cTileBatch	= 32;
+
+// Interval of polling for a mouse click during the rendering (us)
+const int	cPollInterval	= 2000;
+
+// Refined tiles cached in each slave
+const int	cCacheTiles		= 1024;
+
+// The point spacing of a frame is rounded to one of this many steps
+// per halving, so that the views of about the same zoom share tiles
+const int	cStepsPerOctave	= 8;
+
+// Number of earlier views remembered for zooming back
+const int	cHistory		= 64;
+
+/** Parameters of a frame. */
+struct MandelFrame {
+	double	reStart;
+	double	imStart;
+	double	reStep;
+	double	imStep;
+};
+
+/** Parameters of a job; delivered to the slaves as such. */
+struct MandelJob {
+	MandelFrame	frame;
+	int			pass;		// cCoarsePass or cTilePass
+	int			firstTile;	// First tile of a batch, in rendering order
+};
+
+enum {cCoarsePass, cTilePass};
+
+/** Computes Mandelbrot frames as farmed tasks. The results are
+ *  collected to the master, which draws them after each job.
+ *
+ *  A frame is rendered progressively: first a coarse pass with the
+ *  rows of coarse points as tasks, then batches of refined tiles in
+ *  the order of their distance from the center of the view. A mouse
+ *  click cancels the rendering.
+ *
+ *  The refined tiles are cells of a fixed grid of the complex plane,
+ *  so the views that overlap share them. Each tile has an owner
+ *  slave chosen by the hash of its key, which keeps the tile in its
+ *  TileCache. At the beginning of a batch, the owners report which
+ *  tiles they have, decode them to the image, and only the rest are
+ *  farmed out. At the end of the batch, the new tiles are sent to
+ *  their owners.
+ **/
+class MandelFarm : public MPITaskFarm {
+  public:
+					MandelFarm	(MPIComm& comm, MPEWindow& win, int resX, int resY);
+
+	/** Renders a frame. Called by the master. Returns false if the
+	 *  rendering was interrupted.
+	 *
+	 *  The point spacing of the frame is first rounded to the
+	 *  nearest spacing of the tile grids, and the upper left point
+	 *  moved to the grid.
+	 **/
+	bool			render		(MandelFrame& frame);
+
+  protected:
+	/** Takes the cached tiles of a batch from the cache, and returns
+	 *  the number of the remaining tiles.
+	 **/
+	virtual int		beginJob	(const void* params, int paramlen, int ntasks);
+
+	/** Computes the given coarse rows or tiles to the local image. */
+	virtual void	process		(int first, int count);
+
+	/** Sends the new tiles to the caches of their owners, and collects
+	 *  the results to the master and draws them.
+	 **/
+	virtual void	endJob		();
+
+	/** A mouse click interrupts the rendering. */
+	virtual bool	cancelled	() {
+		if (mWin.getMousePressed (MPE_BUTTON1))
+			mInterrupted = true;
+		return mInterrupted;
+	}
+
+  private:
+	/** Returns the palette index for an escape count. The points
+	 *  that did not escape have the same color in all passes.
+	 **/
+	static int		color		(int count, int maxIter) {
+		return (count<maxIter)? count%16 : cMaxIter%16;
+	}
+
+	/** Computes the tile with the given index in the rendering
+	 *  order, and stages it for its owner.
+	 **/
+	void			computeTile	(int index);
+
+	/** Draws the counts of a tile to the local image. */
+	void			drawTile	(int index, const int* counts);
+
+	/** Returns the cache key of the tile with the given index in the
+	 *  rendering order.
+	 **/
+	TileKey			tileKey		(int index) const;
+
+	/** Returns the rank of the process caching the tile. */
+	int				owner		(const TileKey& key) const;
+
+	/** Finds the grid cells covering the frame, and sorts them in
+	 *  the rendering order.
+	 **/
+	void			layout		(const MandelFrame& frame);
+
+	MPEWindow&		mWin;
+	int				mResX;
+	int				mResY;
+	int				mSlaves;
+	MandelJob		mJob;
+	bool			mInterrupted;
+
+	/** Number of tiles horizontally and in total. */
+	int				mTilesX;
+	int				mTiles;
+
+	/** The grid cell of the first tile, and the offset of the view
+	 *  in it in points.
+	 **/
+	double			mCellRe;
+	double			mCellIm;
+	int				mOffsetX;
+	int				mOffsetY;
+
+	/** The frame of the layout. */
+	MandelFrame		mLayoutFrame;
+
+	/** The tiles in the rendering order. */
+	PackArray<int>	mTileOrder;
+
+	/** The frame, with palette indices to defcolors. */
+	MPIImage		mImage;
+
+	/** Escape counts of a row or a tile. */
+	PackArray<int>	mCounts;
+
+	/** Tiles owned by this process. */
+	TileCache		mCache;
+
+	/** The tiles of the current batch that were not in the cache,
+	 *  as offsets from the first tile of the batch.
+	 **/
+	PackArray<int>	mMisses;
+
+	/** Tiles computed in the current batch, as records of (index,
+	 *  length, encoded counts).
+	 **/
+	PackArray<unsigned short>	mStaged;
+	int							mStagedLen;
+};
+
+MandelFarm::MandelFarm (MPIComm& comm, MPEWindow& win, int resX, int resY)
+		: MPITaskFarm (comm, cChunk, cPrefetch, cStealing),
+		  mWin (win), mResX (resX), mResY (resY), mSlaves (comm.size()-1), mInterrupted (false), mImage (comm, resX, resY),
+		  mCounts (resX>cTile*cTile? resX : cTile*cTile), mCache (cCacheTiles),
+		  mMisses (cTileBatch), mStaged (cTileBatch*(2+2*cTile*cTile)), mStagedLen (0) {
+	if (isMaster())
+		pollCancel (cPollInterval);
+	memset (&mLayoutFrame, 0, sizeof(mLayoutFrame));
+}
+
+/** Rounds the magnitude of a point spacing to the nearest of the
+ *  fixed spacings.
+ **/
+static double snapStep (double step) {
+	double octaves = floor (log (fabs (step))/log (2.0)*cStepsPerOctave + 0.5)/cStepsPerOctave;
+	return (step<0)? -pow (2.0, octaves) : pow (2.0, octaves);
+}
+
+void MandelFarm::layout (const MandelFrame& frame) {
+	if (!memcmp (&frame, &mLayoutFrame, sizeof(frame)))
+		return;
+	mLayoutFrame = frame;
+
+	// The upper left point is on the grid of points
+	double pointRe = floor (frame.reStart/frame.reStep + 0.5);
+	double pointIm = floor (frame.imStart/frame.imStep + 0.5);
+	mCellRe = floor (pointRe/cTile);
+	mCellIm = floor (pointIm/cTile);
+	mOffsetX = int (pointRe - mCellRe*cTile);
+	mOffsetY = int (pointIm - mCellIm*cTile);
+	mTilesX = (mResX+mOffsetX+cTile-1)/cTile;
+	mTiles = mTilesX*((mResY+mOffsetY+cTile-1)/cTile);
+
+	// Sort the tiles by their distance from the center
+	mTileOrder.make (mTiles);
+	PackArray<double> dist (mTiles);
+	for (int t=0; t<mTiles; t++) {
+		double dx = (t%mTilesX+0.5)*cTile - mOffsetX - mResX/2.0;
+		double dy = (t/mTilesX+0.5)*cTile - mOffsetY - mResY/2.0;
+		dist[t] = dx*dx+dy*dy;
+
+		// Insertion sort
+		int i = t;
+		for (; i>0 && dist[mTileOrder[i-1]]>dist[t]; i--)
+			mTileOrder[i] = mTileOrder[i-1];
+		mTileOrder[i] = t;
+	}
+}
+
+bool MandelFarm::render (MandelFrame& frame) {
+	frame.reStep = snapStep (frame.reStep);
+	frame.imStep = snapStep (frame.imStep);
+	frame.reStart = floor (frame.reStart/frame.reStep + 0.5)*frame.reStep;
+	frame.imStart = floor (frame.imStart/frame.imStep + 0.5)*frame.imStep;
+	layout (frame);
+
+	mInterrupted = false;
+	MandelJob job = {frame, cCoarsePass, 0};
+	farm ((mResY+cCoarse-1)/cCoarse, &job, sizeof(job));
+
+	job.pass = cTilePass;
+	for (job.firstTile=0; job.firstTile<mTiles && !mInterrupted; job.firstTile+=cTileBatch) {
+		int ntiles = (mTiles-job.firstTile<cTileBatch)? mTiles-job.firstTile : cTileBatch;
+		farm (ntiles, &job, sizeof(job));
+	}
+	return !mInterrupted;
+}
+
+void MandelFarm::process (int first, int count) {
+	const MandelFrame& f = mJob.frame;
+	if (mJob.pass == cTilePass) {
+		for (int t=first; t<first+count; t++)
+			computeTile (mJob.firstTile+mMisses[t]);
+		return;
+	}
+
+	// Coarse rows; each point fills a block of cCoarse*cCoarse pixels
+	int cols = (mResX+cCoarse-1)/cCoarse;
+	for (int row=first; row<first+count; row++) {
+		int y0 = row*cCoarse;
+		mandelRow (f.reStart, f.reStep*cCoarse, f.imStart+y0*f.imStep,
+				   cols, cCoarseIter, mCounts.data);
+		for (int y=y0; y<y0+cCoarse && y<mResY; y++)
+			for (int x=0; x<mResX; x++)
+				mImage.set (x, y, color (mCounts[x/cCoarse], cCoarseIter));
+	}
+}
+
+int MandelFarm::beginJob (const void* params, int paramlen, int ntasks) {
+	mJob = *(const MandelJob*) params;
+	mStagedLen = 0;
+	if (mJob.pass != cTilePass)
+		return ntasks;
+	layout (mJob.frame);
+
+	// Take the tiles we own from the cache, and find out which tiles
+	// are cached anywhere
+	int rank = comm().getRank ();
+	int cached[cTileBatch];
+	for (int t=0; t<ntasks; t++) {
+		TileKey key = tileKey (mJob.firstTile+t);
+		cached[t] = owner(key)==rank && mCache.get (key, mCounts.data);
+		if (cached[t])
+			drawTile (mJob.firstTile+t, mCounts.data);
+	}
+	int anyCached[cTileBatch];
+	comm().allReduce (cached, anyCached, ntasks, MPI_INT, MPI_MAX);
+
+	// Farm out the rest
+	int misses = 0;
+	for (int t=0; t<ntasks; t++)
+		if (!anyCached[t])
+			mMisses[misses++] = t;
+	return misses;
+}
+
+void MandelFarm::endJob () {
+	if (mJob.pass == cTilePass) {
+		// Sort the staged tiles by their owners
+		int size = comm().size ();
+		PackArray<int> sendCounts (size), sendDispls (size), recvCounts (size), recvDispls (size);
+		for (int p=0; p<size; p++)
+			sendCounts[p] = 0;
+		for (int i=0; i<mStagedLen; i+=2+mStaged[i+1])
+			sendCounts[owner (tileKey (mStaged[i]))] += 2+mStaged[i+1];
+		for (int p=0, displ=0; p<size; p++) {
+			sendDispls[p] = displ;
+			displ += sendCounts[p];
+		}
+		PackArray<unsigned short> sendBuffer (mStagedLen);
+		PackArray<int> pos (size);
+		for (int p=0; p<size; p++)
+			pos[p] = sendDispls[p];
+		for (int i=0; i<mStagedLen; i+=2+mStaged[i+1]) {
+			int p = owner (tileKey (mStaged[i]));
+			memcpy (sendBuffer.data+pos[p], mStaged.data+i, (2+mStaged[i+1])*sizeof(unsigned short));
+			pos[p] += 2+mStaged[i+1];
+		}
+
+		// Exchange them
+		comm().allToAll (sendCounts.data, recvCounts.data, 1);
+		int recvLen = 0;
+		for (int p=0; p<size; p++) {
+			recvDispls[p] = recvLen;
+			recvLen += recvCounts[p];
+		}
+		PackArray<unsigned short> recvBuffer (recvLen);
+		comm().allToAllv (sendBuffer.data, sendCounts.data, sendDispls.data,
+						  recvBuffer.data, recvCounts.data, recvDispls.data);
+
+		// Cache the tiles we own
+		for (int i=0; i<recvLen; i+=2+recvBuffer[i+1])
+			mCache.put (tileKey (recvBuffer[i]), recvBuffer.data+i+2, recvBuffer[i+1]);
+	}
+
+	mImage.gather ();
+	if (isMaster()) {
+		mWin.drawImage (mImage, defcolors);
+		mWin.update (); // Actually draw it
+	}
+}
+
+void MandelFarm::computeTile (int index) {
+	// The whole cell is computed, also the points outside the view,
+	// as the points depend only on the key
+	TileKey key = tileKey (index);
+	for (int y=0; y<cTile; y++)
+		mandelRow (key.cellRe*cTile*key.reStep, key.reStep, (key.cellIm*cTile+y)*key.imStep,
+				   cTile, cMaxIter, mCounts.data+y*cTile);
+	drawTile (index, mCounts.data);
+
+	// Stage the tile for its owner
+	unsigned short* record = mStaged.data+mStagedLen;
+	record[0] = index;
+	record[1] = TileCache::encode (mCounts.data, cTile*cTile, record+2);
+	mStagedLen += 2+record[1];
+}
+
+void MandelFarm::drawTile (int index, const int* counts) {
+	int tile = mTileOrder[index];
+	int x0 = (tile%mTilesX)*cTile - mOffsetX;
+	int y0 = (tile/mTilesX)*cTile - mOffsetY;
+	for (int y=0; y<cTile; y++) {
+		if (y0+y < 0 || y0+y >= mResY)
+			continue;
+		for (int x=0; x<cTile; x++)
+			if (x0+x >= 0 && x0+x < mResX)
+				mImage.set (x0+x, y0+y, color (counts[y*cTile+x], cMaxIter));
+	}
+}
+
+TileKey MandelFarm::tileKey (int index) const {
+	const MandelFrame& f = mJob.frame;
+	int tile = mTileOrder.data[index];
+	TileKey key;
+	key.cellRe	= mCellRe + tile%mTilesX;
+	key.cellIm	= mCellIm + tile/mTilesX;
+	key.reStep	= f.reStep;
+	key.imStep	= f.imStep;
+	key.maxIter	= cMaxIter;
+	return key;
+}
+
+int MandelFarm::owner (const TileKey& key) const {
+	// The tiles are cached in the slaves only, unless there are none
+	return mSlaves? 1+key.hash()%mSlaves : 0;
 }
 
 Main () {
 	MPIInstance mpi (mArgc, mArgv);
-	MPIIOStream mpis (mpi);
 
 	int resX = 400,
 		resY = 400;
 
-	// We use only the default colors (strange, there didn't seem to
-	// exist a method to query the color handles in the MPE...)
-	MPE_Color defcolors[] = {MPE_WHITE, MPE_RED, MPE_YELLOW, MPE_GREEN,
-			 MPE_CYAN, MPE_BLUE, MPE_MAGENTA, MPE_AQUAMARINE, MPE_FORESTGREEN, MPE_ORANGE,
-			 MPE_MAROON, MPE_BROWN, MPE_PINK, MPE_CORAL, MPE_GRAY, MPE_BLACK};
-
 	try {
 		if (mpi.world().getRank() == 0) {
 			//
@@ -47,6 +417,7 @@ Main () {
 			
 			// Open graphics
 			MPEWindow win (mpi.world(), 0,0, resX,resY, NULL);
+			MandelFarm farm (mpi.world(), win, resX, resY);
 			fprintf (stderr, "Colors=%d\n", win.colors ());
 
 			// This update() is a bug workaround.
@@ -64,6 +435,10 @@ Main () {
 			// The main loop draws fractals, gets input from the user, and
 			// then draws fractals according to the input
 			Complex upperleft (-2, -2), lowerright (2,2);
+
+			// Earlier views, for zooming back
+			Complex historyUL [cHistory], historyLR [cHistory];
+			int history = 0;
 			while (true) {
 				// Measure drawing time
 				double time1 = mpi.time ();
@@ -71,49 +446,51 @@ Main () {
 				double imStep = (lowerright.imag()-upperleft.imag())/resY;
 				double reStep = (lowerright.real()-upperleft.real())/resX;
 				
-				// Draw the fractal
-				for (int imrow=0; imrow<resY; imrow++) {
-					// Determine who processes this row
-					int slave;
-					if (imrow < mpi.world().size()-1) {
-						// Send the first rows to slaves
-						slave = imrow+1;
-					} else {
-						// Then send more stuff to the slave that
-						// first finishes calculating its previous row
-						// (The slaves send their rank when they finish)
-						slave = int (mpi.world().recv (100, MPI_ANY_SOURCE));
-					}
-
-					// Send the data to the child as a string. A bit
-					// inefficient, yes, but I haven't had time yet to
-					// make the sends accept other types than Strings.
-					mpis.sendTo(slave) << upperleft.real()
-									   << upperleft.imag()+imStep*imrow
-									   << imrow
-									   << reStep;
-					mpis.flush ();
-					mpi.world().nbSend(format("%.30g %.30g %d %.30g", upperleft.real(),
-											  upperleft.imag()+imStep*imrow, imrow,
-											  reStep), slave);
-				}
-
-				// Wait for the children to finish drawing...
-				// (They should all be busy calculating right now)
-				for (int i=0; i<mpi.world().size()-1; i++)
-					mpi.world().recv (100, MPI_ANY_SOURCE);
+				// Draw the fractal. The slaves compute the tasks as
+				// they get them, and the results are drawn after each
+				// job. The frame is moved to the tile grid.
+				MandelFrame frame = {upperleft.real(), upperleft.imag(), reStep, imStep};
+				bool complete = farm.render (frame);
+				upperleft = Complex (frame.reStart, frame.imStart);
+				lowerright = Complex (frame.reStart+resX*frame.reStep, frame.imStart+resY*frame.imStep);
+				reStep = frame.reStep;
+				imStep = frame.imStep;
 
 				// Print drawing time
 				double time2 = mpi.time ();
-				printf ("Time for drawing the frame: %g s\n", time2-time1);
+				if (complete)
+					printf ("Time for drawing the frame: %g s\n", time2-time1);
+				else
+					printf ("Drawing interrupted after %g s; select a new region.\n", time2-time1);
 				fflush (stdout);
 
 				// Select new area
 				Rectangle<int> rect = win.getDragRegion (MPE_BUTTON1, MPE_DRAG_RECT);
 
-				// If the area was very small, terminate execution
-				if (abs(rect.y1-rect.y2)<10 && abs(rect.x2-rect.x1)<10)
-					break;
+				// If the area was very small, go back to the previous
+				// view, which is mostly cached. Terminate execution if
+				// there is none.
+				if (abs(rect.y1-rect.y2)<10 && abs(rect.x2-rect.x1)<10) {
+					if (!history)
+						break;
+					history--;
+					upperleft = historyUL[history];
+					lowerright = historyLR[history];
+					continue;
+				}
+
+				// Remember the current view, forgetting the oldest one
+				// if necessary
+				if (history == cHistory) {
+					for (int i=1; i<cHistory; i++) {
+						historyUL[i-1] = historyUL[i];
+						historyLR[i-1] = historyLR[i];
+					}
+					history--;
+				}
+				historyUL[history] = upperleft;
+				historyLR[history] = lowerright;
+				history++;
 				
 				// Find the complex coordinates for the selected region
 				Complex newUL (upperleft.real()+rect.x1*reStep,
@@ -126,8 +503,7 @@ Main () {
 			printf ("Exiting...\n");
 
 			// Tell slaves to terminate nicely
-			for (int i=1; i<mpi.world().size(); i++)
-				mpi.world().send ("end", i);
+			farm.finish ();
 			
 			// For some strange reason, my libmpe doesn't have the
 			// MPE_Close function linked in, although it exists in the
@@ -138,34 +514,13 @@ Main () {
 			//  Slave
 			//
 			
+			// The window is opened collectively, although only the
+			// master draws to it.
 			MPEWindow win (mpi.world(), 0,0, resX,resY, NULL);
 
-			// Loop until ordered to terminate
-			while (true) {
-				// Wait row-drawing command from the master
-				String buffer = mpi.world().recv (200, 0);
-
-				if (buffer == "end")
-					break;
-
-				// Read parameters from the message (they are in string format)
-				Array<String> pars;
-				buffer.split (pars, ' '); // Split the string to an array
-				double reStart	= pars[0];
-				double imStart	= pars[1];
-				int imRow		= int (pars[2]);
-				double reStep	= double (pars[3]);
-
-				// Draw the row
-				for (int recol=0; recol<resX; recol++) {
-					int color = mandel (Complex (reStart+recol*reStep, imStart));
-					win.drawPoint (recol, imRow, defcolors[color%16]);
-				}
-				win.update (); // Actually draw it
-
-				// Tell master that we have finished with the row
-				mpi.world().nbSend (String(mpi.world().getRank()), 0);
-			}
+			// Compute tasks until ordered to terminate
+			MandelFarm farm (mpi.world(), win, resX, resY);
+			farm.serve ();
 		}
 	} catch (exception& e) {
 		// Perhaps the exception control should be done somehow
@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "mandelkernel.h"
+
+// Standalone benchmark of the Mandelbrot kernels.
+//
+// Usage: mandelbench [resolution [maxiter [repeats]]]
+
+static double now () {
+	struct timeval tv;
+	gettimeofday (&tv, NULL);
+	return tv.tv_sec + tv.tv_usec*1E-6;
+}
+
+int main (int argc, char** argv) {
+	int res		= (argc>1)? atoi(argv[1]) : 400;
+	int maxIter	= (argc>2)? atoi(argv[2]) : 255;
+	int repeats	= (argc>3)? atoi(argv[3]) : 5;
+
+	// The full view of the mandel example
+	double re0 = -2.0, im0 = -2.0, step = 4.0/res;
+
+	int* scalar = new int [res*res];
+	int* vector = new int [res*res];
+
+	double best[2] = {1E30, 1E30};
+	for (int r=0; r<repeats; r++) {
+		double t1 = now ();
+		for (int y=0; y<res; y++)
+			for (int x=0; x<res; x++)
+				scalar[y*res+x] = mandelPoint (re0+x*step, im0+y*step, maxIter);
+		double t2 = now ();
+		for (int y=0; y<res; y++)
+			mandelRow (re0, step, im0+y*step, res, maxIter, vector+y*res);
+		double t3 = now ();
+
+		if (t2-t1 < best[0])
+			best[0] = t2-t1;
+		if (t3-t2 < best[1])
+			best[1] = t3-t2;
+	}
+
+	// Periodicity checking may only turn non-escaping points into
+	// non-escaping ones earlier, so the results should be identical.
+	int differences = 0;
+	for (int i=0; i<res*res; i++)
+		if (scalar[i] != vector[i])
+			differences++;
+
+	printf ("%dx%d points, max %d iterations, %d lanes\n", res, res, maxIter, cMandelLanes);
+	printf ("scalar:     %8.4f s  %8.2f Mpoints/s\n", best[0], res*res/best[0]*1E-6);
+	printf ("vectorized: %8.4f s  %8.2f Mpoints/s  (%.2fx)\n", best[1], res*res/best[1]*1E-6,
+			best[0]/best[1]);
+	printf ("differing points: %d\n", differences);
+
+	delete [] scalar;
+	delete [] vector;
+	return differences? 1 : 0;
+}
@@ -0,0 +1,89 @@
+#include "mandelcache.h"
+#include <string.h>
+
+unsigned int TileKey::hash () const {
+	// FNV-1a over the fields (not the whole struct, which may have
+	// padding)
+	unsigned int result = 2166136261u;
+	const void* fields[] = {&cellRe, &cellIm, &reStep, &imStep, &maxIter};
+	const int sizes[] = {sizeof(cellRe), sizeof(cellIm), sizeof(reStep), sizeof(imStep),
+						 sizeof(maxIter)};
+	for (int f=0; f<5; f++) {
+		const unsigned char* p = (const unsigned char*) fields[f];
+		for (int i=0; i<sizes[f]; i++)
+			result = (result^p[i]) * 16777619u;
+	}
+	return result;
+}
+
+bool TileKey::operator== (const TileKey& other) const {
+	return cellRe==other.cellRe && cellIm==other.cellIm && reStep==other.reStep
+		&& imStep==other.imStep && maxIter==other.maxIter;
+}
+
+TileCache::TileCache (int maxTiles) : mEntries (maxTiles), mUsed (0), mClock (0) {
+	for (int i=0; i<maxTiles; i++)
+		mEntries[i].data = NULL;
+}
+
+TileCache::~TileCache () {
+	for (int i=0; i<mUsed; i++)
+		delete [] mEntries[i].data;
+}
+
+bool TileCache::get (const TileKey& key, int* counts) {
+	int i = find (key);
+	if (i<0)
+		return false;
+	mEntries[i].lastUse = ++mClock;
+	decode (mEntries[i].data, mEntries[i].len, counts);
+	return true;
+}
+
+void TileCache::put (const TileKey& key, const unsigned short* encoded, int len) {
+	int i = find (key);
+	if (i<0) {
+		if (mUsed < mEntries.size)
+			i = mUsed++;
+		else {
+			// Evict the least recently used tile
+			i = 0;
+			for (int j=1; j<mUsed; j++)
+				if (mEntries[j].lastUse < mEntries[i].lastUse)
+					i = j;
+		}
+		mEntries[i].key = key;
+	}
+
+	delete [] mEntries[i].data;
+	mEntries[i].data = new unsigned short [len];
+	memcpy (mEntries[i].data, encoded, len*sizeof(unsigned short));
+	mEntries[i].len = len;
+	mEntries[i].lastUse = ++mClock;
+}
+
+int TileCache::encode (const int* counts, int n, unsigned short* encoded) {
+	int len = 0;
+	for (int i=0; i<n; ) {
+		int run = 1;
+		while (i+run<n && counts[i+run]==counts[i] && run<65535)
+			run++;
+		encoded[len++] = run;
+		encoded[len++] = counts[i];
+		i += run;
+	}
+	return len;
+}
+
+void TileCache::decode (const unsigned short* encoded, int len, int* counts) {
+	for (int i=0; i<len; i+=2)
+		for (int j=0; j<encoded[i]; j++)
+			*counts++ = encoded[i+1];
+}
+
+int TileCache::find (const TileKey& key) const {
+	for (int i=0; i<mUsed; i++)
+		if (mEntries[i].key == key)
+			return i;
+	return -1;
+}
@@ -0,0 +1,75 @@
+#ifndef __MANDELCACHE_H__
+#define __MANDELCACHE_H__
+
+#include <magic/packarray.h>
+
+/** Identifies a tile of escape counts: a cell of a fixed grid of
+ *  the complex plane, the point spacing, and the iteration limit.
+ *  The points of a cell depend only on the key, so every view with
+ *  the same spacing that overlaps the cell can use it.
+ *
+ *  The cell indices are integers; cell (i,j) of a tile of n*n points
+ *  has its upper left point at (i*n*reStep, j*n*imStep).
+ **/
+struct TileKey {
+	double	cellRe;
+	double	cellIm;
+	double	reStep;
+	double	imStep;
+	int		maxIter;
+
+	/** Returns a hash value of the key. */
+	unsigned int	hash		() const;
+
+	bool			operator==	(const TileKey& other) const;
+};
+
+/** A least recently used cache of the escape counts of tiles.
+ *
+ *  The counts are stored run-length encoded, as pairs of 16-bit run
+ *  length and count. The cache holds at most the given number of
+ *  tiles; when it is full, the least recently used tile is evicted.
+ **/
+class TileCache {
+  public:
+					TileCache	(int maxTiles);
+					~TileCache	();
+
+	/** Decodes the counts of the tile into counts, if the tile is in
+	 *  the cache. Returns false if it is not.
+	 **/
+	bool			get			(const TileKey& key, int* counts);
+
+	/** Stores the encoded counts of a tile. */
+	void			put			(const TileKey& key, const unsigned short* encoded, int len);
+
+	/** Number of tiles in the cache. */
+	int				tiles		() const {return mUsed;}
+
+	/** Encodes n counts into encoded, which must have room for 2*n
+	 *  values. Returns the encoded length.
+	 **/
+	static int		encode		(const int* counts, int n, unsigned short* encoded);
+
+	/** Decodes len encoded values into counts. */
+	static void		decode		(const unsigned short* encoded, int len, int* counts);
+
+  private:
+	/** Returns the index of the key, or -1 if it is not cached. */
+	int				find		(const TileKey& key) const;
+
+	struct Entry {
+		TileKey			key;
+		unsigned short*	data;
+		int				len;
+		int				lastUse;
+	};
+
+	PackArray<Entry>	mEntries;
+	int					mUsed;
+
+	/** Use counter for the LRU order. */
+	int					mClock;
+};
+
+#endif
@@ -0,0 +1,105 @@
+#include "mandelkernel.h"
+
+int mandelPoint (double re, double im, int maxIter) {
+	double zr = 0.0, zi = 0.0;
+	int count = 0;
+	double len2;
+	do {
+		double t = zr*zr - zi*zi + re;
+		zi = 2*zr*zi + im;
+		zr = t;
+		len2 = zr*zr + zi*zi;
+	} while (len2<4.0 && ++count<maxIter);
+	return count;
+}
+
+/** Returns true if the point is in the main cardioid or in the
+ *  period-2 bulb, and so never escapes.
+ **/
+static inline bool inMainBulbs (double re, double im) {
+	double im2 = im*im;
+	double q = (re-0.25)*(re-0.25) + im2;
+	if (q*(q+(re-0.25)) <= 0.25*im2)
+		return true;
+	return (re+1.0)*(re+1.0) + im2 <= 1.0/16.0;
+}
+
+/** Iterates a group of cMandelLanes points. */
+static void mandelGroup (const double* cr, const double* ci, double* count, double* active, int maxIter) {
+	double zr[cMandelLanes], zi[cMandelLanes];
+	double savedR[cMandelLanes], savedI[cMandelLanes];
+	for (int l=0; l<cMandelLanes; l++)
+		zr[l] = zi[l] = savedR[l] = savedI[l] = 0.0;
+
+	// Next iteration at which z is saved for the periodicity check;
+	// the interval doubles each time (Brent's method).
+	int saveAt = 8;
+
+	for (int k=0; k<maxIter; k+=cMandelBatch) {
+		int steps = (maxIter-k<cMandelBatch)? maxIter-k : cMandelBatch;
+		for (int s=0; s<steps; s++) {
+			// One iteration for all lanes. Escaped lanes keep
+			// iterating, but their count no longer changes.
+			for (int l=0; l<cMandelLanes; l++) {
+				double r2 = zr[l]*zr[l];
+				double i2 = zi[l]*zi[l];
+				zi[l] = 2*zr[l]*zi[l] + ci[l];
+				zr[l] = r2 - i2 + cr[l];
+				double inside = (zr[l]*zr[l] + zi[l]*zi[l] < 4.0)? 1.0 : 0.0;
+				active[l] *= inside;
+				count[l] += active[l];
+			}
+
+			// Periodicity check: if z returns exactly to a previous
+			// value, the point never escapes.
+			for (int l=0; l<cMandelLanes; l++) {
+				double periodic = (zr[l]==savedR[l] && zi[l]==savedI[l])? active[l] : 0.0;
+				count[l] += periodic*(maxIter-count[l]);
+				active[l] -= periodic;
+			}
+			if (k+s+1 == saveAt) {
+				for (int l=0; l<cMandelLanes; l++) {
+					savedR[l] = zr[l];
+					savedI[l] = zi[l];
+				}
+				saveAt *= 2;
+			}
+		}
+
+		// Stop when all lanes have escaped
+		double any = 0.0;
+		for (int l=0; l<cMandelLanes; l++)
+			any += active[l];
+		if (any == 0.0)
+			break;
+	}
+}
+
+void mandelRow (double re0, double reStep, double im, int n, int maxIter, int* counts) {
+	double cr[cMandelLanes], ci[cMandelLanes], count[cMandelLanes], active[cMandelLanes];
+	for (int i=0; i<n; i+=cMandelLanes) {
+		for (int l=0; l<cMandelLanes; l++) {
+			ci[l] = im;
+			count[l] = 0.0;
+			active[l] = 1.0;
+			if (i+l < n) {
+				cr[l] = re0 + (i+l)*reStep;
+
+				// Known non-escaping points need no iteration
+				if (inMainBulbs (cr[l], im)) {
+					count[l] = maxIter;
+					active[l] = 0.0;
+				}
+			} else {
+				// Padding lane past the end of the row
+				cr[l] = 0.0;
+				active[l] = 0.0;
+			}
+		}
+
+		mandelGroup (cr, ci, count, active, maxIter);
+
+		for (int l=0; l<cMandelLanes && i+l<n; l++)
+			counts[i+l] = int (count[l]);
+	}
+}
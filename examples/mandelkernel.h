@@ -0,0 +1,35 @@
+#ifndef __MANDELKERNEL_H__
+#define __MANDELKERNEL_H__
+
+/** Number of points iterated together. The lane loops of the kernel
+ *  are written so that the compiler can map them to SIMD
+ *  instructions; 8 doubles fill two AVX or one AVX-512 register.
+ **/
+const int cMandelLanes = 8;
+
+/** Iterations run between the checks for all lanes having
+ *  escaped.
+ **/
+const int cMandelBatch = 8;
+
+/** Computes the escape count of a single point; the reference
+ *  implementation.
+ *
+ *  Returns the number of iterations before |z|>=2, or maxIter if the
+ *  point did not escape.
+ **/
+int		mandelPoint		(double re, double im, int maxIter);
+
+/** Computes the escape counts of a row of n points re0+i*reStep +
+ *  im*i, for i=0...n-1, into counts. The results are the same as
+ *  with mandelPoint(), except that periodic points are recognized
+ *  as non-escaping earlier.
+ *
+ *  The points are iterated in groups of cMandelLanes, with the real
+ *  and imaginary parts in separate arrays, and escaped points masked
+ *  out. Points in the main cardioid and the period-2 bulb are rejected
+ *  without iteration.
+ **/
+void	mandelRow		(double re0, double reStep, double im, int n, int maxIter, int* counts);
+
+#endif
@@ -0,0 +1,313 @@
+#include "mpi++.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <magic/applic.h>
+#include <magic/packarray.h>
+
+// Benchmarks of the MPIComm layer.
+//
+// Usage: mpibench [-minsize=N] [-maxsize=N] [-iters=N] [-warmup=N]
+//                 [-window=N] [-json=file]
+//
+// The point-to-point benchmarks run between the processes 0 and 1,
+// the collectives in all processes. The message sizes are the powers
+// of two from minsize to maxsize bytes, up to 512 MB. The buffer
+// grows with the sizes to what each benchmark needs; at most
+// window*maxsize bytes, for the non-blocking window, which must stay
+// below 2 GB.
+
+/** Largest message size; doubling it and the buffer of two messages
+ *  still fit in an int.
+ **/
+const int cMaxSize = 1<<29;
+
+/** Parameters of a benchmark run. */
+struct BenchParams {
+	int		iters;		// Measured samples per size
+	int		warmup;		// Unmeasured samples per size
+	int		window;		// Messages per streaming sample
+
+	/** The receive requests of a window, created once so that their
+	 *  allocation is not timed.
+	 **/
+	MPIRequest**	requests;
+};
+
+/** A benchmark: runs one sample of the given message size in the
+ *  calling process, and returns the time it took.
+ *  Returns the number of bytes moved per sample in *bytes.
+ **/
+typedef double (*BenchSample) (MPIInstance& mpi, char* buffer, int size,
+							   const BenchParams& params, double* bytes);
+
+/** Ping-pong; half of the round-trip time. */
+static double pingPong (MPIInstance& mpi, char* buffer, int size,
+						const BenchParams& params, double* bytes) {
+	MPIComm& comm = mpi.world ();
+	*bytes = size;
+	double t1 = mpi.time ();
+	if (comm.getRank() == 0) {
+		comm.send (buffer, size, MPI_BYTE, 1);
+		comm.recv (buffer, size, MPI_BYTE, 1);
+	} else if (comm.getRank() == 1) {
+		comm.recv (buffer, size, MPI_BYTE, 0);
+		comm.send (buffer, size, MPI_BYTE, 0);
+	}
+	return (mpi.time()-t1)/2;
+}
+
+/** Streaming; a window of messages one way, followed by a short
+ *  acknowledgement.
+ **/
+static double stream (MPIInstance& mpi, char* buffer, int size,
+					  const BenchParams& params, double* bytes) {
+	MPIComm& comm = mpi.world ();
+	*bytes = double(size)*params.window;
+	char ack;
+	double t1 = mpi.time ();
+	if (comm.getRank() == 0) {
+		for (int i=0; i<params.window; i++)
+			comm.send (buffer, size, MPI_BYTE, 1);
+		comm.recv (&ack, 1, MPI_BYTE, 1);
+	} else if (comm.getRank() == 1) {
+		for (int i=0; i<params.window; i++)
+			comm.recv (buffer, size, MPI_BYTE, 0);
+		comm.send (&ack, 1, MPI_BYTE, 0);
+	}
+	return mpi.time()-t1;
+}
+
+/** Bidirectional exchange; both processes send and receive at the
+ *  same time.
+ **/
+static double exchange (MPIInstance& mpi, char* buffer, int size,
+						const BenchParams& params, double* bytes) {
+	MPIComm& comm = mpi.world ();
+	*bytes = 2.0*size;
+	double t1 = mpi.time ();
+	int rank = comm.getRank ();
+	if (rank < 2)
+		comm.sendRecv (buffer, size, 1-rank, buffer+size, size, 1-rank, MPI_BYTE);
+	return mpi.time()-t1;
+}
+
+/** Non-blocking window; the receiver posts a window of receives
+ *  before the sender starts sending.
+ **/
+static double nbWindow (MPIInstance& mpi, char* buffer, int size,
+						const BenchParams& params, double* bytes) {
+	MPIComm& comm = mpi.world ();
+	*bytes = double(size)*params.window;
+	char ready;
+	double t1 = mpi.time ();
+	if (comm.getRank() == 0) {
+		comm.recv (&ready, 1, MPI_BYTE, 1);
+		for (int i=0; i<params.window; i++)
+			comm.send (buffer, size, MPI_BYTE, 1);
+		comm.recv (&ready, 1, MPI_BYTE, 1);
+	} else if (comm.getRank() == 1) {
+		for (int i=0; i<params.window; i++)
+			comm.nbRecv (*params.requests[i], buffer+i*size, size, MPI_BYTE, 0);
+		comm.send (&ready, 1, MPI_BYTE, 0);
+		for (int i=0; i<params.window; i++)
+			params.requests[i]->wait ();
+		comm.send (&ready, 1, MPI_BYTE, 0);
+	}
+	return mpi.time()-t1;
+}
+
+/** Barrier; the message size is ignored. */
+static double barrier (MPIInstance& mpi, char* buffer, int size,
+					   const BenchParams& params, double* bytes) {
+	*bytes = 0;
+	double t1 = mpi.time ();
+	mpi.world().barrier ();
+	return mpi.time()-t1;
+}
+
+/** Sum all-reduce of doubles. */
+static double allReduce (MPIInstance& mpi, char* buffer, int size,
+						 const BenchParams& params, double* bytes) {
+	int count = size/sizeof(double);
+	*bytes = count*sizeof(double);
+	double t1 = mpi.time ();
+	mpi.world().allReduce (buffer, buffer+size, count, MPI_DOUBLE, MPI_SUM);
+	return mpi.time()-t1;
+}
+
+/** Broadcast from process 0. */
+static double bcast (MPIInstance& mpi, char* buffer, int size,
+					 const BenchParams& params, double* bytes) {
+	*bytes = size;
+	double t1 = mpi.time ();
+	mpi.world().bcast (buffer, size, MPI_BYTE, 0);
+	return mpi.time()-t1;
+}
+
+/** The benchmarks; the point-to-point ones need two processes, and
+ *  the allReduce at least one double. A windowed sample sends a
+ *  window of messages, the others one message each way. The buffer
+ *  of a sample holds the given number of messages, or a window of
+ *  them if it is 0.
+ **/
+struct Benchmark {
+	const char*	name;
+	BenchSample	sample;
+	bool		pointToPoint;
+	int			minSize;
+	bool		sized;
+	bool		windowed;
+	int			messages;
+};
+
+static const Benchmark benchmarks[] = {
+	{"pingpong",	pingPong,	true,	0,				true,	false,	1},
+	{"stream",		stream,		true,	0,				true,	true,	1},
+	{"exchange",	exchange,	true,	0,				true,	false,	2},
+	{"nbwindow",	nbWindow,	true,	0,				true,	true,	0},
+	{"barrier",		barrier,	false,	0,				false,	false,	1},
+	{"allreduce",	allReduce,	false,	sizeof(double),	true,	false,	2},
+	{"bcast",		bcast,		false,	0,				true,	false,	1},
+};
+
+static int compareDoubles (const void* a, const void* b) {
+	double x = *(const double*) a, y = *(const double*) b;
+	return (x<y)? -1 : (x>y)? 1 : 0;
+}
+
+Main () {
+	MPIInstance mpi (mArgc, mArgv);
+	MPIComm& comm = mpi.world ();
+	bool master = comm.getRank()==0;
+
+	int minsize = mParamMap["minsize"];
+	int maxsize = mParamMap["maxsize"];
+	BenchParams params;
+	params.iters	= mParamMap["iters"];
+	params.warmup	= mParamMap["warmup"];
+	params.window	= mParamMap["window"];
+	String jsonfile	= mParamMap["json"];
+	if (minsize <= 0)
+		minsize = 1;
+	if (maxsize <= 0)
+		maxsize = 1<<22;
+	if (maxsize > cMaxSize)
+		maxsize = cMaxSize;
+	if (params.iters <= 0)
+		params.iters = 100;
+	if (params.warmup <= 0)
+		params.warmup = 10;
+	if (params.window <= 0)
+		params.window = 16;
+
+	// The largest buffer holds a window of the largest messages
+	size_t largest = size_t(maxsize)*(params.window>2? params.window : 2);
+	if (largest > size_t(INT_MAX)) {
+		if (master)
+			fprintf (stderr, "A window of %d messages of %d bytes is too large; "
+					 "decrease -window or -maxsize\n", params.window, maxsize);
+		return;
+	}
+
+	// Grown for each size to what the benchmark needs
+	PackArray<char> buffer;
+
+	PackArray<MPIRequest*> requests (params.window);
+	for (int i=0; i<params.window; i++)
+		requests[i] = new MPIRequest (comm);
+	params.requests = requests.data;
+
+	FILE* json = NULL;
+	if (master) {
+		if (jsonfile.len) {
+			json = fopen ((CONSTR) jsonfile, "w");
+			if (!json)
+				fprintf (stderr, "Can't open '%s' for writing\n", (CONSTR) jsonfile);
+			else
+				fprintf (json, "{\"processes\": %d, \"results\": [", comm.size());
+		}
+		printf ("%-10s %10s %6s %12s %12s %12s %12s\n",
+				"benchmark", "bytes", "iters", "min(us)", "median(us)", "p99(us)", "MB/s");
+	}
+
+	bool firstResult = true;
+	PackArray<double> times (params.iters);
+	PackArray<double> slowest (params.iters);
+	int nbench = sizeof(benchmarks)/sizeof(Benchmark);
+	for (int b=0; b<nbench; b++) {
+		const Benchmark& bench = benchmarks[b];
+		if (bench.pointToPoint && comm.size()<2)
+			continue;
+
+		for (int size=minsize; size<=maxsize; size*=2) {
+			if (size < bench.minSize)
+				continue;
+
+			// Fewer samples for the large messages, at most about
+			// 256 MB per size, but at least ten
+			int iters = params.iters;
+			double perSample = double(size)*(bench.windowed? params.window : 1);
+			if (iters*perSample > 256.0*1024*1024)
+				iters = int (256.0*1024*1024/perSample);
+			if (iters < 10)
+				iters = 10;
+			if (times.size < iters) {
+				times.make (iters);
+				slowest.make (iters);
+			}
+
+			size_t buflen = size_t(size)*(bench.messages? bench.messages : params.window);
+			if (size_t(buffer.size) < buflen) {
+				buffer.make (int(buflen));
+				memset (buffer.data, 0, buflen);
+			}
+
+			double bytes = 0.0;
+			comm.barrier ();
+			for (int i=0; i<params.warmup; i++)
+				bench.sample (mpi, buffer.data, size, params, &bytes);
+			for (int i=0; i<iters; i++) {
+				comm.barrier ();
+				times[i] = bench.sample (mpi, buffer.data, size, params, &bytes);
+			}
+
+			// A collective takes as long as its slowest process
+			if (!bench.pointToPoint) {
+				comm.allReduce (times.data, slowest.data, iters, MPI_DOUBLE, MPI_MAX);
+				memcpy (times.data, slowest.data, iters*sizeof(double));
+			}
+
+			if (master) {
+				qsort (times.data, iters, sizeof(double), compareDoubles);
+				double tmin = times[0]*1E6;
+				double tmed = times[iters/2]*1E6;
+				double t99 = times[(iters*99)/100 < iters? (iters*99)/100 : iters-1]*1E6;
+				double mbps = (bytes>0 && tmed>0)? bytes/tmed : 0.0;
+				printf ("%-10s %10d %6d %12.2f %12.2f %12.2f %12.2f\n",
+						bench.name, bench.sized? size:0, iters, tmin, tmed, t99, mbps);
+				fflush (stdout);
+				if (json) {
+					fprintf (json, "%s\n  {\"benchmark\": \"%s\", \"bytes\": %d, \"iterations\": %d, "
+							 "\"min_us\": %.3f, \"median_us\": %.3f, \"p99_us\": %.3f, \"mbps\": %.3f}",
+							 firstResult? "":",", bench.name, bench.sized? size:0, iters,
+							 tmin, tmed, t99, mbps);
+					firstResult = false;
+				}
+			}
+
+			// The barrier does not depend on the size
+			if (!bench.sized)
+				break;
+		}
+	}
+
+	if (json) {
+		fprintf (json, "\n]}\n");
+		fclose (json);
+	}
+
+	for (int i=0; i<params.window; i++)
+		delete requests[i];
+}
@@ -14,9 +14,58 @@
 
 #include <mpi++.h>
 #include <mpe++.h>
+#include <mpiwindow.h>
 #include <magic/applic.h>
 #include "nbody.h"
 #include <unistd.h> // sleep()
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/** Converts a float to IEEE 754 half precision, rounding to nearest. */
+static unsigned short floatToHalf (float value) {
+	union {float f; unsigned int i;} bits;
+	bits.f = value;
+	unsigned int sign		= (bits.i>>16) & 0x8000;
+	int exponent			= int ((bits.i>>23) & 0xff) - 127 + 15;
+	unsigned int mantissa	= bits.i & 0x7fffff;
+
+	if (exponent <= 0) {
+		// Subnormal half, or too small to be represented at all
+		if (exponent < -10)
+			return sign;
+		mantissa |= 0x800000;
+		int shift = 14 - exponent;
+		unsigned int half = mantissa >> shift;
+		if ((mantissa >> (shift-1)) & 1)
+			half++;
+		return sign | half;
+	}
+	if (exponent >= 31) // Overflow to infinity
+		return sign | 0x7c00;
+
+	unsigned int half = sign | (exponent<<10) | (mantissa>>13);
+	if (mantissa & 0x1000) // Round; a carry to the exponent is correct
+		half++;
+	return half;
+}
+
+/** Converts an IEEE 754 half precision value to a float. */
+static float halfToFloat (unsigned short half) {
+	unsigned int sign		= (half & 0x8000) << 16;
+	int exponent			= (half>>10) & 0x1f;
+	unsigned int mantissa	= half & 0x3ff;
+
+	if (exponent == 0) // Zero or subnormal
+		return (sign? -1.0:1.0) * ldexp (double(mantissa), -24);
+
+	union {float f; unsigned int i;} bits;
+	if (exponent == 31)
+		bits.i = sign | 0x7f800000 | (mantissa<<13);
+	else
+		bits.i = sign | ((exponent-15+127)<<23) | (mantissa<<13);
+	return bits.f;
+}
 
 //////////////////////////////////////////////////////////////////////////////
 //                          ----           |                                //
@@ -57,7 +106,8 @@ void Body::print (OStream& out) const {
 //                                               \_/                        //
 //////////////////////////////////////////////////////////////////////////////
 
-NBody::NBody (const StringMap& params, MPEWindow& mpe) : mrParams(params), mrMPE(mpe) {
+NBody::NBody (const StringMap& params, MPEWindow* mpe)
+		: mrParams(params), mpTrajectory (NULL), mTrajectoryFreq (0), mpMPE(mpe) {
 	mBodies.make (int(params["NBody.n"]));
 	mMinR = float(params["NBody.r"]);
 
@@ -67,9 +117,30 @@ NBody::NBody (const StringMap& params, MPEWindow& mpe) : mrParams(params), mrMPE
 	mDensity = int(params["NBody.density"]);
 }
 
-void NBody::init (const BodyIniter& initer) {
+void NBody::init (BodyIniter& initer) {
+	initer.prepare (firstBody(), mBodies.size, totalBodies());
 	for (int i=0; i<mBodies.size; i++)
-		initer.visit (mBodies[i], i, mBodies.size);
+		initer.visit (mBodies[i], firstBody()+i, totalBodies());
+}
+
+void NBody::setTrajectory (TrajectoryWriter* writer, int freq) {
+	mpTrajectory = writer;
+	mTrajectoryFreq = freq;
+}
+
+void NBody::record (int iter, float drift, float kick) {
+	if (!mpTrajectory || iter%mTrajectoryFreq)
+		return;
+
+	// The leapfrog keeps the positions and velocities half a step
+	// apart; bring them to the same instant for restarting
+	mRecorded.make (mBodies.size);
+	for (int i=0; i<mBodies.size; i++) {
+		Body& body = mRecorded[i] = mBodies[i];
+		body.setPosition (body.position() + body.velocity()*drift);
+		body.updateVelocity (body.totalForce()*cGravity*kick);
+	}
+	mpTrajectory->write (iter, mRecorded, firstBody());
 }
 
 void NBody::run (int iters, float h, int updateFreq) {
@@ -86,6 +157,9 @@ void NBody::run (int iters, float h, int updateFreq) {
 		resetForces ();
 		calculateForces (mBodies, mBodies, true);
 
+		// The velocities lag the positions by half a step
+		record (i, 0.0, i? h/2 : 0.0);
+
 		// Update velocity of the bodies
 		updateVelocities (i? h : h/2);
 	}
@@ -97,10 +171,14 @@ void NBody::resetForces () {
 }
 
 void NBody::calculateForces (PackArray<Body>& a, PackArray<Body>& b, bool diagonal) {
+	calculateForces (a.data, a.size, b.data, b.size, diagonal);
+}
+
+void NBody::calculateForces (Body* a, int na, Body* b, int nb, bool diagonal) {
 	float r;
-	for (int i=0; i<a.size; i++) {
+	for (int i=0; i<na; i++) {
 		// Iterate only half of the a*b matrix
-		for (int j=diagonal? i+1:0; j<b.size; j++) {
+		for (int j=diagonal? i+1:0; j<nb; j++) {
 			// Compute force
 			Coord force = a[i].force (b[j], r);
 
@@ -122,7 +200,24 @@ void NBody::updateVelocities (float h) {
 }
 
 void NBody::updatePositions (float h, bool updateView, PackArray<Coord>& plotCoords) {
-	for (int a=0; a<mBodies.size; a++) {
+	// Nothing to draw when running headless
+	if (!mpMPE)
+		updateView = false;
+
+	// The circles are collected and drawn with a single request:
+	// first the old pictures to undraw, then the new ones.
+	int n = mBodies.size;
+	int first = mUndraw? n:0;
+	PackArray<int> xs, ys, rs;
+	PackArray<MPE_Color> colors;
+	if (updateView) {
+		xs.make (first+n);
+		ys.make (first+n);
+		rs.make (first+n);
+		colors.make (first+n);
+	}
+
+	for (int a=0; a<n; a++) {
 		// Calculate drawing radius
 		float rf = pow(3000*mBodies[a].mass()/(4*mDensity*M_PI), 1.0/3);
 		int r = int (rf/mViewRadius+0.5);
@@ -130,8 +225,12 @@ void NBody::updatePositions (float h, bool updateView, PackArray<Coord>& plotCoo
 			r=1;
 
 		// Undraw the old picture
-		if (updateView && mUndraw)
-			mrMPE.fillCircle (plotCoords[a].x, plotCoords[a].y, r, MPE_WHITE);
+		if (updateView && mUndraw) {
+			xs[a] = int (plotCoords[a].x);
+			ys[a] = int (plotCoords[a].y);
+			rs[a] = r;
+			colors[a] = MPE_WHITE;
+		}
 		
 		// Update body position
 		mBodies[a].updatePosition (h);
@@ -140,11 +239,17 @@ void NBody::updatePositions (float h, bool updateView, PackArray<Coord>& plotCoo
 		if (updateView) {
 			plotCoords[a] = Coord (200+200*mBodies[a].position().x/mViewRadius,
 								   200+200*mBodies[a].position().y/mViewRadius);
-			mrMPE.fillCircle (plotCoords[a].x, plotCoords[a].y, r, mrMPE.comm().getRank()? MPE_BLACK:MPE_BLUE);
+			xs[first+a] = int (plotCoords[a].x);
+			ys[first+a] = int (plotCoords[a].y);
+			rs[first+a] = r;
+			colors[first+a] = mpMPE->comm().getRank()? MPE_BLACK:MPE_BLUE;
 		}
 	}
-	if (updateView)
-		mrMPE.update ();
+
+	if (updateView) {
+		mpMPE->fillCircles (xs.data, ys.data, rs.data, colors.data, first+n);
+		mpMPE->update ();
+	}
 }
 
 
@@ -158,7 +263,8 @@ void NBody::updatePositions (float h, bool updateView, PackArray<Coord>& plotCoo
 //                            __/                          \_/              //
 //////////////////////////////////////////////////////////////////////////////
 
-RingNBody::RingNBody (const StringMap& params, MPEWindow& mpe, MPIInstance& mpi) : NBody (params, mpe), mrMPI (mpi) {
+RingNBody::RingNBody (const StringMap& params, MPEWindow* mpe, MPIInstance& mpi)
+		: NBody (params, mpe), mrMPI (mpi), mpShared (NULL), mpRemote (NULL), mpForceVectorType (NULL) {
 	ASSERTWITH (!(mBodies.size%2), "N for RingNBody system must be divisible by 2.");
 	
 	// Determine the next and previous process id in the process ring
@@ -168,6 +274,57 @@ RingNBody::RingNBody (const StringMap& params, MPEWindow& mpe, MPIInstance& mpi)
 	// Create MPI vector type for Body arrays. Note that the order of
 	// the member variables in the Body class is crucial!
 	mpBodyVectorType = new MPIVector (mBodies.size, 5, sizeof (Body)/sizeof(float), MPI_FLOAT);
+
+	// Share the bodies in the memory of each node. If all the
+	// processes are on the same node, the segments hold the bodies
+	// to visit, and otherwise the circulating buffers.
+#if MPI_VERSION >= 3
+	if (params["RingNBody.transport"] == "shared") {
+		MPIComm& node = mpi.world().nodeComm ();
+		mAllShared = node.size() == mpi.world().size();
+		mNodeRank = node.getRank ();
+
+		// Find the ring neighbours on the same node
+		int rank = mpi.world().getRank ();
+		PackArray<int> ranks (node.size());
+		node.allGather (&rank, ranks.data, 1, MPI_INT);
+		mPrevShared = -1;
+		mNextShared = false;
+		for (int i=0; i<node.size(); i++) {
+			if (ranks[i] == mPrev)
+				mPrevShared = i;
+			if (ranks[i] == mNext)
+				mNextShared = true;
+		}
+
+		mpShared = new MPISharedWindow (node, (mAllShared? 1:2)*mBodies.size*sizeof(Body));
+		mSegments.make (node.size());
+		for (int i=0; i<node.size(); i++)
+			mSegments[i] = (Body*) mpShared->segment (i);
+	}
+#endif
+
+	// Expose the local bodies to the other processes. A single
+	// process has nothing to exchange.
+#if MPI_VERSION >= 2
+	if (params["RingNBody.transport"] == "rma" && mpi.world().size() > 1) {
+		mExposed.make (mBodies.size);
+		mVisiting.make (mBodies.size*mpi.world().size());
+		mpRemote = new MPIWindow (mpi.world(), mExposed.data, mBodies.size*sizeof(Body), sizeof(float));
+		mpForceVectorType = new MPIVector (mBodies.size, cCoordDims, sizeof (Body)/sizeof(float), MPI_FLOAT);
+	}
+#endif
+}
+
+RingNBody::~RingNBody () {
+#if MPI_VERSION >= 3
+	delete mpShared;
+#endif
+#if MPI_VERSION >= 2
+	delete mpRemote;
+#endif
+	delete mpForceVectorType;
+	delete mpBodyVectorType;
 }
 
 void RingNBody::run (int iters, float h, int updateFreq) {
@@ -179,42 +336,170 @@ void RingNBody::run (int iters, float h, int updateFreq) {
 	circulatingBodies.add (new PackArray<Body> (mBodies.size)); // Create buffer #0
 	circulatingBodies.add (new PackArray<Body> (mBodies.size)); // Create buffer #1
 
-	int ringSize = mrMPI.world().size();
 	for (int iter=0; iter<iters; iter++) {
 		// Update positions of the bodies. Use h on the first
 		// iteration, to implement leapfrog method.
 		updatePositions (iter? h:h/2, !(iter%updateFreq), plotCoords);
 
-		resetForces ();
+		// The positions lead the velocities by half a step
+		record (iter, -h/2, 0.0);
 
-		// Copy the local bodies into circulating bodies.
-		circulatingBodies[0].shallowCopy (mBodies);
-
-		for (int i=0; i<ringSize; i++) {
-			// Calculate forces diagonally between resident and
-			// circulating bodies. On the step=0, the circulating
-			// bodies are local.
-			calculateForces (mBodies, circulatingBodies[i%2], true);
-			
-			// Send circulating bodies forward in the ring
-			mrMPI.world().nbSend (circulatingBodies[i%2].data, 1, mpBodyVectorType->getType(), mNext);
-			
-			// Receive circulating bodies from previous node in the
-			// ring. In the last step, we receive back the local
-			// circulating bodies, which we sent out in the step=0.
-			mrMPI.world().recv (circulatingBodies[(i+1)%2].data, 1, mpBodyVectorType->getType(), mPrev);
-		}
+		resetForces ();
 
-		// Add the forces from the circulated local bodies to resident
-		// bodies
-		for (int i=0; i<mBodies.size; i++)
-			mBodies[i].addForce (circulatingBodies[ringSize%2][i].totalForce());
+		if (mpShared && mAllShared)
+			visitShared ();
+		else if (mpShared)
+			circulateShared ();
+		else if (mpRemote)
+			visitRemote ();
+		else
+			circulate (circulatingBodies);
 
 		// Update velocities of the bodies
 		updateVelocities (h);
 	}
 }
 
+void RingNBody::circulate (Array<PackArray<Body> >& circulatingBodies) {
+	int ringSize = mrMPI.world().size();
+
+	// Copy the local bodies into circulating bodies. The copy must
+	// be deep, as the received bodies are stored in the buffers.
+	for (int i=0; i<mBodies.size; i++)
+		circulatingBodies[0][i] = mBodies[i];
+
+	for (int i=0; i<ringSize; i++) {
+		// Calculate forces diagonally between resident and
+		// circulating bodies. On the step=0, the circulating
+		// bodies are local.
+		calculateForces (mBodies, circulatingBodies[i%2], true);
+		
+		// Send circulating bodies forward in the ring
+		mrMPI.world().nbSend (circulatingBodies[i%2].data, 1, mpBodyVectorType->getType(), mNext);
+		
+		// Receive circulating bodies from previous node in the
+		// ring. In the last step, we receive back the local
+		// circulating bodies, which we sent out in the step=0.
+		mrMPI.world().recv (circulatingBodies[(i+1)%2].data, 1, mpBodyVectorType->getType(), mPrev);
+	}
+
+	// Add the forces from the circulated local bodies to resident
+	// bodies
+	for (int i=0; i<mBodies.size; i++)
+		mBodies[i].addForce (circulatingBodies[ringSize%2][i].totalForce());
+}
+
+void RingNBody::visitShared () {
+#if MPI_VERSION >= 3
+	// The node communicator is ordered by the world ranks, so the
+	// segments are in the ring order
+	int ringSize = mrMPI.world().size();
+	int rank = mrMPI.world().getRank();
+
+	// Publish the local bodies, with their forces reset, in the own
+	// segment
+	Body* own = mSegments[rank];
+	for (int i=0; i<mBodies.size; i++)
+		own[i] = mBodies[i];
+	mpShared->fence ();
+
+	// Visit the segments in the same order as the bodies would
+	// circulate in the ring. On each step every process visits a
+	// different segment, so the forces added to the visited bodies
+	// don't collide.
+	for (int i=0; i<ringSize; i++) {
+		calculateForces (mBodies.data, mBodies.size,
+						 mSegments[(rank-i+ringSize)%ringSize], mBodies.size, true);
+		mpShared->fence ();
+	}
+
+	// Add the forces from the visits to resident bodies
+	for (int i=0; i<mBodies.size; i++)
+		mBodies[i].addForce (own[i].totalForce());
+#endif
+}
+
+void RingNBody::circulateShared () {
+#if MPI_VERSION >= 3
+	int ringSize = mrMPI.world().size();
+	int n = mBodies.size;
+
+	// The circulating buffers are in the own segment. The bodies
+	// start from the buffer #0.
+	Body* own = mSegments[mNodeRank];
+	Body* prev = (mPrevShared>=0)? mSegments[mPrevShared] : NULL;
+	for (int i=0; i<n; i++)
+		own[i] = mBodies[i];
+
+	for (int i=0; i<ringSize; i++) {
+		Body* current = own + (i%2)*n;
+		Body* next = own + ((i+1)%2)*n;
+		calculateForces (mBodies.data, n, current, n, true);
+
+		// Send the circulating bodies forward to another node
+		if (!mNextShared)
+			mrMPI.world().nbSend (current, 1, mpBodyVectorType->getType(), mNext);
+
+		// Wait until the processes of the node are done with their
+		// current buffers
+		mpShared->fence ();
+
+		// Take the circulating bodies of the previous process from
+		// its segment, or receive them from another node
+		if (prev)
+			for (int j=0; j<n; j++)
+				next[j] = prev[(i%2)*n+j];
+		else
+			mrMPI.world().recv (next, 1, mpBodyVectorType->getType(), mPrev);
+	}
+
+	// Add the forces from the circulated local bodies to resident
+	// bodies
+	for (int i=0; i<n; i++)
+		mBodies[i].addForce (own[(ringSize%2)*n+i].totalForce());
+
+	// The next process may still be copying the last buffer
+	mpShared->fence ();
+#endif
+}
+
+void RingNBody::visitRemote () {
+#if MPI_VERSION >= 2
+	int ringSize = mrMPI.world().size();
+	int rank = mrMPI.world().getRank();
+	int n = mBodies.size;
+
+	// Expose the local bodies, with their forces reset
+	for (int i=0; i<n; i++)
+		mExposed[i] = mBodies[i];
+	mpRemote->fence (MPI_MODE_NOPRECEDE);
+
+	// Fetch the bodies of all processes at once
+	for (int s=0; s<ringSize; s++)
+		mpRemote->get (&mVisiting[s*n], 1, mpBodyVectorType->getType(), s, 0);
+	mpRemote->fence ();
+
+	// Visit the bodies in the same order as they would circulate in
+	// the ring
+	for (int i=0; i<ringSize; i++) {
+		int s = (rank-i+ringSize)%ringSize;
+		calculateForces (mBodies.data, n, &mVisiting[s*n], n, true);
+	}
+
+	// Add the reaction forces to the exposed bodies of their owners.
+	// The accumulates of different processes to the same bodies
+	// don't conflict.
+	for (int s=0; s<ringSize; s++)
+		mpRemote->accumulate ((float*) &mVisiting[s*n] + cCoordDims, 1, mpForceVectorType->getType(),
+							  s, cCoordDims, MPI_SUM);
+	mpRemote->fence (MPI_MODE_NOSUCCEED);
+
+	// Add the reaction forces to resident bodies
+	for (int i=0; i<n; i++)
+		mBodies[i].addForce (mExposed[i].totalForce());
+#endif
+}
+
 
 
 //////////////////////////////////////////////////////////////////////////////
@@ -226,11 +511,21 @@ void RingNBody::run (int iters, float h, int updateFreq) {
 //                               \_/                                        //
 //////////////////////////////////////////////////////////////////////////////
 
-BodyIniter::BodyIniter () {
-	srandom (time(0)+getpid()*100);
+/** Returns the RandomIniter.seed parameter, or the current time of the
+ *  first process if it is 0. Collective.
+ **/
+static int randomSeed (const StringMap& params, MPIComm& comm) {
+	int seed = int(params["RandomIniter.seed"]);
+	if (!seed) {
+		// The clocks of the processes can differ
+		seed = time (0);
+		comm.bcast (&seed, 1, 0);
+	}
+	return seed;
 }
 
-RandomIniter::RandomIniter (const StringMap& params) {
+RandomIniter::RandomIniter (const StringMap& params, MPIComm& comm)
+		: mRandom (randomSeed (params, comm)) {
 	mCorner1		= Coord (params["RandomIniter.upperleft.x"],
 							 params["RandomIniter.upperleft.y"]);
 	mCorner2		= Coord (params["RandomIniter.lowerright.x"],
@@ -240,9 +535,13 @@ RandomIniter::RandomIniter (const StringMap& params) {
 }
 
 /*virtual*/ void RandomIniter::visit (Body& body, int id, int size) const {
-	body.setPosition (Coord(mCorner1.x+fabs(mCorner1.x-mCorner2.x)*frnd(),
-							mCorner1.y+fabs(mCorner1.y-mCorner2.y)*frnd()));
-	float x = frnd()*M_PI*2;
+	// All random numbers of the body come from one counter value
+	uint32_t rnd[4];
+	mRandom.generate (id, 0, 0, 0, rnd);
+
+	body.setPosition (Coord(mCorner1.x+fabs(mCorner1.x-mCorner2.x)*Philox::uniform(rnd[0]),
+							mCorner1.y+fabs(mCorner1.y-mCorner2.y)*Philox::uniform(rnd[1])));
+	float x = Philox::uniform(rnd[2])*M_PI*2;
 	body.setVelocity (Coord (mVelocityRange.x*sin(x),
 							 mVelocityRange.y*cos(x)));
 	body.setMass (1.0E2); // Always 100kg. TODO: read from parameters
@@ -263,6 +562,341 @@ PresetIniter::PresetIniter (const StringMap& params) : mrParams (params) {
 	body.print (sout);
 }
 
+SnapshotIniter::SnapshotIniter (const StringMap& params, MPIComm& comm)
+		: mrComm (comm), mFrame (-1) {
+	mFilename	= params["SnapshotIniter.file"];
+	mFrame		= int (params["SnapshotIniter.frame"]);
+}
+
+/*virtual*/ void SnapshotIniter::prepare (int first, int count, int total) {
+	MPIFile file (mrComm, mFilename, MPI_MODE_RDONLY);
+
+	TrajectoryHeader header;
+	file.readAtAll (0, &header, sizeof(header), MPI_BYTE);
+	ASSERTWITH (!strncmp (header.magic, "NBTJ", 4) && header.version==1,
+				format ("'%s' is not an N-body trajectory file", (CONSTR) mFilename));
+	ASSERTWITH (header.bodies==total && header.dims==cCoordDims,
+				format ("Snapshot '%s' has %d bodies, but the system has %d",
+						(CONSTR) mFilename, header.bodies, total));
+
+	// Count the complete frames in the file
+	int frames = 0;
+	while (header.frameOffset (frames+1) <= file.size())
+		frames++;
+	int frame = (mFrame<0)? frames-1 : mFrame;
+	ASSERTWITH (frame>=0 && frame<frames,
+				format ("Snapshot '%s' has no frame %d", (CONSTR) mFilename, frame));
+
+	// Read the local bodies from the latest keyframe
+	int keyframe = frame;
+	while (!header.isKeyframe (keyframe))
+		keyframe--;
+	mState.make (count*fields());
+	file.readAtAll (header.frameOffset(keyframe) + sizeof(TrajectoryFrame)
+					+ MPI_Offset(first)*header.keyRecordSize(),
+					mState.data, mState.size, MPI_FLOAT);
+
+	// Apply the deltas of a non-keyframe
+	if (keyframe != frame) {
+		TrajectoryFrame frameHeader;
+		file.readAtAll (header.frameOffset(frame), &frameHeader, sizeof(frameHeader), MPI_BYTE);
+		PackArray<unsigned short> deltas (count*2*cCoordDims);
+		file.readAtAll (header.frameOffset(frame) + sizeof(TrajectoryFrame)
+						+ MPI_Offset(first)*header.deltaRecordSize(),
+						deltas.data, deltas.size, MPI_UNSIGNED_SHORT);
+		for (int i=0; i<count; i++)
+			for (int k=0; k<2*cCoordDims; k++)
+				mState[i*fields()+k] += halfToFloat (deltas[i*2*cCoordDims+k])
+					* ((k<cCoordDims)? frameHeader.posScale : frameHeader.velScale);
+	}
+
+	mFirst = first;
+	file.close ();
+}
+
+/*virtual*/ void BulkIniter::visit (Body& body, int id, int size) const {
+	const float* state = mState.data + (id-mFirst)*fields();
+	Coord position, velocity;
+	for (int k=0; k<cCoordDims; k++) {
+		((float*) &position)[k] = state[k];
+		((float*) &velocity)[k] = state[cCoordDims+k];
+	}
+	body.setPosition (position);
+	body.setVelocity (velocity);
+	body.setMass (state[2*cCoordDims]);
+}
+
+/** Parses a decimal floating point number at p, and advances p past
+ *  it. Returns false if there is no number at p. Much faster than
+ *  strtod(), at the cost of possibly rounding the last bit of a double
+ *  differently.
+ **/
+static bool parseFloat (const char*& p, const char* end, float& result) {
+	static const double powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+									1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+	while (p<end && (*p==' ' || *p=='\t'))
+		p++;
+	bool negative = false;
+	if (p<end && (*p=='-' || *p=='+'))
+		negative = (*p++ == '-');
+
+	// Collect at most 19 significant digits into an integer mantissa
+	const char* start = p;
+	uint64_t mantissa = 0;
+	int exponent = 0, digits = 0;
+	for (; p<end && *p>='0' && *p<='9'; p++)
+		if (digits < 19) {
+			mantissa = mantissa*10 + (*p-'0');
+			if (mantissa)
+				digits++;
+		} else
+			exponent++;
+	if (p<end && *p=='.')
+		for (p++; p<end && *p>='0' && *p<='9'; p++)
+			if (digits < 19) {
+				mantissa = mantissa*10 + (*p-'0');
+				if (mantissa)
+					digits++;
+				exponent--;
+			}
+	if (p == start)
+		return false;
+
+	if (p<end && (*p=='e' || *p=='E')) {
+		p++;
+		bool negativeExp = false;
+		if (p<end && (*p=='-' || *p=='+'))
+			negativeExp = (*p++ == '-');
+		int e = 0;
+		for (; p<end && *p>='0' && *p<='9'; p++)
+			e = e*10 + (*p-'0');
+		exponent += negativeExp? -e : e;
+	}
+
+	double value = double (mantissa);
+	for (; exponent>22; exponent-=22)
+		value *= 1e22;
+	for (; exponent<-22; exponent+=22)
+		value /= 1e22;
+	value = (exponent<0)? value/powers[-exponent] : value*powers[exponent];
+	result = negative? -value : value;
+	return true;
+}
+
+TableIniter::TableIniter (const StringMap& params, MPIComm& comm) : mrComm (comm) {
+	mFilename = params["TableIniter.file"];
+}
+
+/*virtual*/ void TableIniter::prepare (int first, int count, int total) {
+	int rank = mrComm.getRank ();
+	int size = mrComm.size ();
+
+	// Collect the body ranges of all processes to the root
+	int range[2] = {first, count};
+	PackArray<int> ranges;
+	if (rank == 0)
+		ranges.make (2*size);
+	mrComm.gather (range, ranges.data, 2, MPI_INT, 0);
+
+	PackArray<float>	table;
+	PackArray<int>		counts, displs;
+	String				error;
+	int					n = -1;
+	if (rank == 0) {
+		// Map the table file into memory and parse it in one pass
+		int fd = open (mFilename, O_RDONLY);
+		struct stat info;
+		const char* data = (const char*) MAP_FAILED;
+		if (fd < 0)
+			error = format ("Could not open body table '%s'", (CONSTR) mFilename);
+		else if (fstat (fd, &info) != 0
+				 || (data = (const char*) mmap (NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+			error = format ("Could not map body table '%s'", (CONSTR) mFilename);
+		else {
+			madvise ((void*) data, info.st_size, MADV_SEQUENTIAL);
+			table.make (total*fields());
+			n = parse (data, info.st_size, table.data, total, error);
+			munmap ((void*) data, info.st_size);
+		}
+		if (fd >= 0)
+			close (fd);
+	}
+
+	// The other processes would wait in the scatter for a root that
+	// failed, so all check the body count of the root
+	mrComm.bcast (&n, 1, 0);
+	ASSERTWITH (n>=0, (rank==0)? error : format ("Could not load body table '%s'", (CONSTR) mFilename));
+	ASSERTWITH (n==total, format ("Body table '%s' has %d bodies, but the system has %d",
+								  (CONSTR) mFilename, n, total));
+
+	if (rank == 0) {
+		counts.make (size);
+		displs.make (size);
+		for (int i=0; i<size; i++) {
+			displs[i] = ranges[2*i]*fields();
+			counts[i] = ranges[2*i+1]*fields();
+		}
+	}
+
+	// Give every process its own bodies
+	mState.make (count*fields());
+	mrComm.scatterv (table.data, counts.data, displs.data, mState.data, mState.size, MPI_FLOAT, 0);
+	mFirst = first;
+}
+
+int TableIniter::parse (const char* data, size_t len, float* records, int max, String& error) const {
+	// Binary table
+	if (len>=4+sizeof(int) && !strncmp (data, "NBTB", 4)) {
+		int n;
+		memcpy (&n, data+4, sizeof(int));
+		if (n<0 || size_t(n)*fields()*sizeof(float) > len-4-sizeof(int)) {
+			error = format ("Body table '%s' is truncated", (CONSTR) mFilename);
+			return -1;
+		}
+		memcpy (records, data+4+sizeof(int), size_t(n<max? n : max)*fields()*sizeof(float));
+		return n;
+	}
+
+	// Text table, one body per line. The bodies beyond max are only
+	// counted.
+	const char* p = data;
+	const char* end = data+len;
+	int n = 0;
+	float extra[2*cCoordDims+1];
+	while (true) {
+		while (p<end && (*p==' ' || *p=='\t' || *p=='\r' || *p=='\n'))
+			p++;
+		if (p==end)
+			break;
+
+		// Comment line
+		if (*p=='#') {
+			while (p<end && *p!='\n')
+				p++;
+			continue;
+		}
+
+		float* record = (n<max)? records + n*fields() : extra;
+		for (int k=0; k<fields(); k++) {
+			if (k>0) {
+				while (p<end && (*p==' ' || *p=='\t'))
+					p++;
+				if (p==end || *p!=',') {
+					error = format ("Body %d in table '%s' has too few fields", n, (CONSTR) mFilename);
+					return -1;
+				}
+				p++;
+			}
+			if (!parseFloat (p, end, record[k])) {
+				error = format ("Body %d in table '%s' has an invalid number", n, (CONSTR) mFilename);
+				return -1;
+			}
+		}
+		while (p<end && *p!='\n')
+			p++;
+		n++;
+	}
+	return n;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//          -----               o                                           //
+//            |           ___       ___   ___   |         ___               //
+//            |   |/\     ___| |   /   ) |   \ -+- \  /|/\ \   |           //
+//            |   |      (   | |   |---  |      |   \/ |    \  |           //
+//            |   |       \__| |    \__   \__/   \  /  |     \_/           //
+//                            _/                              \_/           //
+//////////////////////////////////////////////////////////////////////////////
+
+MPI_Offset TrajectoryHeader::frameOffset (int frame) const {
+	// Number of keyframes and delta frames before the frame
+	int keys = (precision==32)? frame : (frame+keyframes-1)/keyframes;
+	int deltas = frame - keys;
+	return MPI_Offset (sizeof(TrajectoryHeader))
+		+ MPI_Offset (keys) * (sizeof(TrajectoryFrame) + MPI_Offset(bodies)*keyRecordSize())
+		+ MPI_Offset (deltas) * (sizeof(TrajectoryFrame) + MPI_Offset(bodies)*deltaRecordSize());
+}
+
+TrajectoryWriter::TrajectoryWriter (MPIComm& comm, const char* filename, int total,
+									int precision, int keyframes)
+		: mrComm (comm), mFile (comm, filename, MPI_MODE_CREATE|MPI_MODE_WRONLY), mFrames (0) {
+	ASSERTWITH (precision==32 || precision==16, "Trajectory precision must be 32 or 16");
+	ASSERTWITH (keyframes>0, "Trajectory keyframe interval must be positive");
+
+	memcpy (mHeader.magic, "NBTJ", 4);
+	mHeader.version		= 1;
+	mHeader.bodies		= total;
+	mHeader.dims		= cCoordDims;
+	mHeader.precision	= precision;
+	mHeader.keyframes	= keyframes;
+
+	// Discard any earlier contents of the file
+	mFile.setSize (0);
+	if (mrComm.getRank() == 0)
+		mFile.writeAt (0, &mHeader, sizeof(mHeader), MPI_BYTE);
+}
+
+void TrajectoryWriter::write (int step, const PackArray<Body>& bodies, int first) {
+	const int fields = 2*cCoordDims+1;
+	TrajectoryFrame frame;
+	frame.step		= step;
+	frame.keyframe	= mHeader.isKeyframe (mFrames);
+	frame.posScale	= 1.0;
+	frame.velScale	= 1.0;
+	MPI_Offset offset = mHeader.frameOffset (mFrames);
+
+	if (frame.keyframe) {
+		// Keyframe: store the full state, and remember it for the
+		// following delta frames.
+		mKeyframe.make (bodies.size*fields);
+		for (int i=0; i<bodies.size; i++) {
+			float* record = &mKeyframe[i*fields];
+			for (int k=0; k<cCoordDims; k++) {
+				record[k]				= ((const float*) &bodies[i].position())[k];
+				record[cCoordDims+k]	= ((const float*) &bodies[i].velocity())[k];
+			}
+			record[2*cCoordDims] = bodies[i].mass();
+		}
+		mFile.writeAtAll (offset + sizeof(TrajectoryFrame) + MPI_Offset(first)*mHeader.keyRecordSize(),
+						  mKeyframe.data, mKeyframe.size, MPI_FLOAT);
+	} else {
+		// Delta frame: find the largest differences to the keyframe
+		// in the whole system to normalize the float16 values.
+		mDeltas.make (bodies.size*2*cCoordDims);
+		float localMax[2] = {0.0, 0.0}, globalMax[2];
+		for (int i=0; i<bodies.size; i++)
+			for (int k=0; k<cCoordDims; k++) {
+				float dp = ((const float*) &bodies[i].position())[k] - mKeyframe[i*fields+k];
+				float dv = ((const float*) &bodies[i].velocity())[k] - mKeyframe[i*fields+cCoordDims+k];
+				if (fabs(dp) > localMax[0])
+					localMax[0] = fabs(dp);
+				if (fabs(dv) > localMax[1])
+					localMax[1] = fabs(dv);
+			}
+		mrComm.allReduce (localMax, globalMax, 2, MPI_FLOAT, MPI_MAX);
+		if (globalMax[0] > 0.0)
+			frame.posScale = globalMax[0];
+		if (globalMax[1] > 0.0)
+			frame.velScale = globalMax[1];
+
+		for (int i=0; i<bodies.size; i++)
+			for (int k=0; k<cCoordDims; k++) {
+				float dp = ((const float*) &bodies[i].position())[k] - mKeyframe[i*fields+k];
+				float dv = ((const float*) &bodies[i].velocity())[k] - mKeyframe[i*fields+cCoordDims+k];
+				mDeltas[i*2*cCoordDims+k]				= floatToHalf (dp/frame.posScale);
+				mDeltas[i*2*cCoordDims+cCoordDims+k]	= floatToHalf (dv/frame.velScale);
+			}
+		mFile.writeAtAll (offset + sizeof(TrajectoryFrame) + MPI_Offset(first)*mHeader.deltaRecordSize(),
+						  mDeltas.data, mDeltas.size, MPI_UNSIGNED_SHORT);
+	}
+
+	if (mrComm.getRank() == 0)
+		mFile.writeAt (offset, &frame, sizeof(frame), MPI_BYTE);
+	mFrames++;
+}
+
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -281,7 +915,11 @@ Main () {
 	mParamMap.failByThrow ();
 
 	MPIInstance mpi (mArgc, mArgv);
-	MPEWindow mpe (mpi.world(), 0, 0, 400, 400, NULL);
+
+	// Open graphics, unless we run headless in batch mode
+	MPEWindow* mpe = NULL;
+	if (!int(paramMap()["headless"]))
+		mpe = new MPEWindow (mpi.world(), 0, 0, 400, 400, NULL);
 
 	// Create the N-body system
 	NBody* system;
@@ -295,15 +933,35 @@ Main () {
 	// Initialize the system
 	BodyIniter* initer;
 	if (paramMap()["initer"] == "RandomIniter")
-		initer = new RandomIniter (paramMap());
+		initer = new RandomIniter (paramMap(), mpi.world());
 	else if (paramMap()["initer"] == "PresetIniter")
 		initer = new PresetIniter (paramMap());
+	else if (paramMap()["initer"] == "SnapshotIniter")
+		initer = new SnapshotIniter (paramMap(), mpi.world());
+	else if (paramMap()["initer"] == "TableIniter")
+		initer = new TableIniter (paramMap(), mpi.world());
 	else
 		exit (1);
 	system->init (*initer);
 
+	// Record the trajectory for offline analysis and restarting
+	TrajectoryWriter* trajectory = NULL;
+	if (int(paramMap()["trajectory.freq"]) > 0) {
+		// Writing over the snapshot would lose it
+		ASSERTWITH (paramMap()["initer"] != "SnapshotIniter"
+					|| strcmp ((CONSTR) paramMap()["trajectory.file"],
+							   (CONSTR) paramMap()["SnapshotIniter.file"]),
+					"The trajectory can not be written over the snapshot it restarts from");
+		trajectory = new TrajectoryWriter (mpi.world(), paramMap()["trajectory.file"],
+										   system->totalBodies(),
+										   int(paramMap()["trajectory.precision"]),
+										   int(paramMap()["trajectory.keyframes"]));
+		system->setTrajectory (trajectory, int(paramMap()["trajectory.freq"]));
+	}
+
 	// Run the system
 	system->run (int(paramMap()["iters"]), float(paramMap()["h"]), int(paramMap()["update"]));
+	delete trajectory; // Closes the file collectively
 	
 	printf ("Done.\n");
 }
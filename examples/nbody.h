@@ -18,14 +18,21 @@
 #include <magic/Math.h>
 #include <magic/coord.h>
 #include <magic/packarray.h>
+#include "philox.h"
 
 const float cGravity = 6.67259E-11;
 
 class BodyIniter;	// Local
+class TrajectoryWriter;	// Local
+class MPIWindow;		// Local
+class MPISharedWindow;	// Local
 
 // Coord can be either Coord3D or Coord2D - the both classes have identical operations
 #define Coord Coord2D
 
+/** Number of float components in a Coord. */
+const int cCoordDims = sizeof(Coord)/sizeof(float);
+
 
 //////////////////////////////////////////////////////////////////////////////
 //                          ----           |                                //
@@ -57,6 +64,7 @@ class Body {
 	void			updatePosition	(float h);
 
 	const Coord&	position		() const {return mPosition;}
+	const Coord&	velocity		() const {return mVelocity;}
 	float			mass			() const {return mMass;}
 	
 	void			setMass			(float mass) {mMass = mass;}
@@ -106,20 +114,33 @@ class Body {
 
 /** N-body system, a sequential solution.
  *
+ *  If the MPEWindow is NULL, the system runs headless without any
+ *  graphical output.
  **/
 class NBody {
   public:
-					NBody				(const StringMap& params, MPEWindow& mpe);
+					NBody				(const StringMap& params, MPEWindow* mpe);
 
 	/** Initializes the bodies in the system with the given
 	 *  initializer.
 	 **/
-	virtual void	init				(const BodyIniter& initer);
+	virtual void	init				(BodyIniter& initer);
 
 	/** Runs the system.
 	 **/
 	virtual void	run					(int iters, float h, int updateFreq);
 
+	/** Records the state of the system to the given trajectory every
+	 *  freq iterations. The writer is not owned by the system.
+	 **/
+	void			setTrajectory		(TrajectoryWriter* writer, int freq);
+
+	/** Returns the global index of the first local body. */
+	virtual int		firstBody			() const {return 0;}
+
+	/** Returns the total number of bodies in the system. */
+	virtual int		totalBodies			() const {return mBodies.size;}
+
   protected:
 	/** Updates the positions of all bodies and draws them in
 	 *  MPEWindow if updateView is true.
@@ -141,9 +162,21 @@ class NBody {
 	 *  bodies.
 	 **/
 	void			calculateForces		(PackArray<Body>& a, PackArray<Body>& b, bool diagonal);
+	/** Calculates forces between two arrays of bodies, such as
+	 *  bodies in shared memory.
+	 **/
+	void			calculateForces		(Body* a, int na, Body* b, int nb, bool diagonal);
 
 	/** Updates the velocities of all bodies. */
 	void			updateVelocities	(float h);
+
+	/** Writes the state of the bodies to the trajectory, if this is
+	 *  a recorded iteration. The positions are advanced by the drift
+	 *  time with the current velocities, and the velocities by the
+	 *  kick time with the current forces, so that the recorded
+	 *  state is synchronized.
+	 **/
+	void			record				(int iter, float drift, float kick);
 	
   protected:
 	/** All local bodies, both resident and circulating. */
@@ -169,8 +202,17 @@ class NBody {
 	/** Store the parameters for later use. */
 	const StringMap&	mrParams;
 
+	/** Trajectory output; NULL if not recorded. */
+	TrajectoryWriter*	mpTrajectory;
+
+	/** Frequency of trajectory output in iterations. */
+	int					mTrajectoryFreq;
+
+	/** The synchronized state of the recorded bodies. */
+	PackArray<Body>		mRecorded;
+
   private:
-	MPEWindow&			mrMPE;
+	MPEWindow*			mpMPE;
 };
 
 
@@ -186,16 +228,53 @@ class NBody {
 
 /** Parallel ring-shaped N-body system.
  *
+ *  The bodies of each process visit all the other processes in
+ *  turn. The RingNBody.transport parameter selects how they get
+ *  there: "messages" passes them around the ring of processes, while
+ *  "shared" lets the processes read them directly from each other's
+ *  segments of node-shared memory, and "rma" fetches them with
+ *  one-sided gets and adds the reaction forces back to their owners
+ *  with one-sided accumulates.
+ *
+ *  If all the processes run on the same node, the shared transport
+ *  visits the bodies in place. Otherwise the bodies circulate in the
+ *  ring, but a process copies them from the segment of its previous
+ *  process when that is on the same node, and only the processes at
+ *  the node boundaries pass them in messages.
  **/
 class RingNBody : public NBody {
   public:
-					RingNBody	(const StringMap& params, MPEWindow& mpe, MPIInstance& mpi);
-					~RingNBody	() {delete mpBodyVectorType;}
+					RingNBody	(const StringMap& params, MPEWindow* mpe, MPIInstance& mpi);
+					~RingNBody	();
 
 	/** Runs the system. */
 	void			run			(int iters, float h, int updateFreq);
+
+	/** Implementation. Each process owns a contiguous range of
+	 *  bodies.
+	 **/
+	virtual int		firstBody	() const {return mrMPI.world().getRank()*mBodies.size;}
+	virtual int		totalBodies	() const {return mrMPI.world().size()*mBodies.size;}
 	
   private:
+	/** Calculates the forces of an iteration by passing the bodies
+	 *  around the ring.
+	 **/
+	void			circulate	(Array<PackArray<Body> >& circulatingBodies);
+	/** Calculates the forces of an iteration through the shared
+	 *  memory window, when all the processes are on the same node.
+	 **/
+	void			visitShared	();
+	/** Calculates the forces of an iteration by passing the bodies
+	 *  around the ring through the shared memory window within the
+	 *  nodes, and in messages between them.
+	 **/
+	void			circulateShared	();
+	/** Calculates the forces of an iteration with one-sided
+	 *  transfers.
+	 **/
+	void			visitRemote	();
+
 	MPIInstance&	mrMPI;
 
 	/** Previous process in the process ring. */
@@ -206,6 +285,37 @@ class RingNBody : public NBody {
 
 	/** MPI datatype for Body vectors. */
 	MPIVector*		mpBodyVectorType;
+	/** Node-shared memory for the bodies of all processes; NULL if
+	 *  the bodies are passed in messages.
+	 **/
+	MPISharedWindow*	mpShared;
+	/** The segments of the shared window, by process rank in the
+	 *  node. With several nodes, a segment holds the two circulating
+	 *  buffers of its process.
+	 **/
+	PackArray<Body*>	mSegments;
+	/** Whether all the processes are on the same node. */
+	bool				mAllShared;
+	/** Rank of this process in the node. */
+	int					mNodeRank;
+	/** Rank of the previous process in the node; -1 if it is on
+	 *  another node.
+	 **/
+	int					mPrevShared;
+	/** Whether the next process is on the same node. */
+	bool				mNextShared;
+	/** Window to the exposed bodies of all processes; NULL if the
+	 *  one-sided transfers are not used.
+	 **/
+	MPIWindow*			mpRemote;
+	/** The local bodies exposed in the window. Their forces collect
+	 *  the reaction forces from the other processes.
+	 **/
+	PackArray<Body>		mExposed;
+	/** The bodies of all processes fetched from the window. */
+	PackArray<Body>		mVisiting;
+	/** MPI datatype for the forces of Body vectors. */
+	MPIVector*			mpForceVectorType;
 };
 
 
@@ -225,22 +335,40 @@ class RingNBody : public NBody {
  **/
 class BodyIniter {
   public:
-					BodyIniter		();
-	
+	/** Called once before the bodies are visited, with the global
+	 *  index of the first local body, the number of local bodies and
+	 *  the total number of bodies in the system. Initializers that
+	 *  load the bodies in bulk can do it here.
+	 *
+	 *  Collective: called by all processes of the system.
+	 **/
+	virtual void	prepare			(int first, int count, int total) {}
+
+	/** Initializes a body. The id is the global index of the
+	 *  body.
+	 **/
 	virtual void	visit			(Body& body, int id, int size) const=0;
 };
 
 /** Body initializer that does completely random initialization within
  *  a value range.
+ *
+ *  The random numbers of a body are generated with a counter-based
+ *  generator keyed on the RandomIniter.seed parameter, with the global
+ *  body id as the counter. A body thus always gets the same initial
+ *  state with the same seed, regardless of the number of processes or
+ *  the order of initialization. Seed 0 uses the current time of the
+ *  first process, which is not reproducible across runs.
  **/
 class RandomIniter : public BodyIniter {
   public:
-					RandomIniter	(const StringMap& params);
+					RandomIniter	(const StringMap& params, MPIComm& comm);
 
 	/** Implementation. */
 	virtual void	visit			(Body& body, int id, int size) const;
 	
   private:
+	Philox	mRandom;
 	Coord	mVelocityRange;
 	Coord	mCorner1;
 	Coord	mCorner2;
@@ -260,4 +388,176 @@ class PresetIniter : public BodyIniter {
 	const StringMap&	mrParams;
 };
 
+/** Baseclass for initializers that load the local bodies in bulk in
+ *  prepare().
+ *
+ *  The loaded bodies are stored as records of position, velocity and
+ *  mass, the same as the keyframe records of a trajectory file.
+ **/
+class BulkIniter : public BodyIniter {
+  public:
+					BulkIniter		() : mFirst (0) {}
+
+	/** Implementation. */
+	virtual void	visit			(Body& body, int id, int size) const;
+
+	/** Returns the number of floats in a body record. */
+	static int		fields			() {return 2*cCoordDims+1;}
+
+  protected:
+	/** Global index of the first local body. */
+	int					mFirst;
+
+	/** Position, velocity and mass for each local body. */
+	PackArray<float>	mState;
+};
+
+/** Body initializer that restarts the system from a trajectory
+ *  snapshot written by TrajectoryWriter.
+ *
+ *  Reads the frame given in the SnapshotIniter.frame parameter; a
+ *  negative value means the last frame in the file. Restarting from a
+ *  float16 delta frame gives the state only at half precision; use a
+ *  keyframe for an exact restart.
+ **/
+class SnapshotIniter : public BulkIniter {
+  public:
+					SnapshotIniter	(const StringMap& params, MPIComm& comm);
+
+	/** Implementation. Reads the local bodies from the file. */
+	virtual void	prepare			(int first, int count, int total);
+
+  private:
+	MPIComm&		mrComm;
+	String			mFilename;
+	int				mFrame;
+};
+
+/** Body initializer that loads a large preset system from a body
+ *  table file, given in the TableIniter.file parameter.
+ *
+ *  The table is either binary, starting with the magic "NBTB", an int
+ *  body count and then the body records as floats; or text, with one
+ *  body per line in the same comma-separated format as the
+ *  PresetIniter bodies (x,y,dx,dy,m). Empty lines and lines starting
+ *  with '#' are ignored.
+ *
+ *  The root process maps the file into memory, parses it in one pass
+ *  and scatters the bodies of each process to it. The table must have
+ *  exactly as many bodies as the system; otherwise, or if the table
+ *  can not be read, all processes fail.
+ **/
+class TableIniter : public BulkIniter {
+  public:
+					TableIniter		(const StringMap& params, MPIComm& comm);
+
+	/** Implementation. Loads and scatters the bodies. */
+	virtual void	prepare			(int first, int count, int total);
+
+  private:
+	/** Parses the table in memory into body records, storing at most
+	 *  max of them. Returns the number of bodies in the table, or -1
+	 *  with the reason in error if the table is invalid.
+	 **/
+	int				parse			(const char* data, size_t len, float* records, int max,
+									 String& error) const;
+
+	MPIComm&		mrComm;
+	String			mFilename;
+};
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//          -----               o                                           //
+//            |           ___       ___   ___   |         ___               //
+//            |   |/\     ___| |   /   ) |   \ -+- \  /|/\ \   |           //
+//            |   |      (   | |   |---  |      |   \/ |    \  |           //
+//            |   |       \__| |    \__   \__/   \  /  |     \_/           //
+//                            _/                              \_/           //
+//////////////////////////////////////////////////////////////////////////////
+
+/** File header of an N-body trajectory file.
+ *
+ *  The header is followed by the frames. A frame consists of a
+ *  TrajectoryFrame header and one record per body, in global body
+ *  order.
+ *
+ *  With precision 32, every frame is a keyframe, which stores the
+ *  position, velocity and mass of each body as floats. With precision
+ *  16, only every keyframes:th frame is a keyframe; the other frames
+ *  store the position and velocity differences to the previous
+ *  keyframe as float16 values, normalized by the scales given in the
+ *  frame header.
+ *
+ *  All values are in the native byte order.
+ **/
+struct TrajectoryHeader {
+	char	magic[4];		// "NBTJ"
+	int		version;
+	int		bodies;			// Total number of bodies
+	int		dims;			// Components in a coordinate
+	int		precision;		// 32 or 16
+	int		keyframes;		// Keyframe interval with precision 16
+
+	/** Returns true if the given frame is a keyframe. */
+	bool		isKeyframe		(int frame) const {return precision==32 || !(frame%keyframes);}
+
+	/** Returns the size of a keyframe record of one body in bytes. */
+	int			keyRecordSize	() const {return (2*dims+1)*sizeof(float);}
+
+	/** Returns the size of a delta record of one body in bytes. */
+	int			deltaRecordSize	() const {return 2*dims*sizeof(unsigned short);}
+
+	/** Returns the byte offset of the given frame in the file. */
+	MPI_Offset	frameOffset		(int frame) const;
+};
+
+/** Header of a frame in an N-body trajectory file. */
+struct TrajectoryFrame {
+	int		step;			// Iteration of the system
+	int		keyframe;		// Non-zero for keyframes
+	float	posScale;		// Normalization of position deltas
+	float	velScale;		// Normalization of velocity deltas
+};
+
+/** Writes the trajectory of an N-body system into a compact binary
+ *  file with MPI-IO. Every process writes its own bodies
+ *  collectively.
+ *
+ *  See TrajectoryHeader for the file format.
+ **/
+class TrajectoryWriter {
+  public:
+	/** Creates the trajectory file. Collective.
+	 *
+	 *  @param total Total number of bodies in the system.
+	 *  @param precision Either 32 for float frames, or 16 for float16
+	 *  delta frames between float keyframes.
+	 *  @param keyframes Keyframe interval with precision 16.
+	 **/
+					TrajectoryWriter	(MPIComm& comm, const char* filename, int total,
+										 int precision=32, int keyframes=10);
+
+	/** Writes a frame. Collective.
+	 *
+	 *  @param first Global index of the first body in the array.
+	 **/
+	void			write				(int step, const PackArray<Body>& bodies, int first);
+
+  private:
+	MPIComm&			mrComm;
+	MPIFile				mFile;
+	TrajectoryHeader	mHeader;
+
+	/** Number of frames written so far. */
+	int					mFrames;
+
+	/** The previous keyframe of the local bodies. */
+	PackArray<float>	mKeyframe;
+
+	/** Encoding buffer for delta frames. */
+	PackArray<unsigned short>	mDeltas;
+};
+
 #endif
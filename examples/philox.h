@@ -0,0 +1,67 @@
+/***************************************************************************
+    copyright            : (C) 2000 by Marko Grnroos
+    email                : magi@iki.fi
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************
+ *
+ **/
+
+#ifndef __PHILOX_H__
+#define __PHILOX_H__
+
+#include <stdint.h>
+
+/** Philox4x32-10 counter-based random number generator (Salmon et
+ *  al., "Parallel random numbers: as easy as 1, 2, 3", SC'11).
+ *
+ *  The generator has no state besides its key: every 128-bit counter
+ *  value maps to four independent random words. Using for example an
+ *  object index as the counter, any process can generate the random
+ *  numbers of any object without generating the preceding ones, and
+ *  the results do not depend on how the objects are distributed.
+ **/
+class Philox {
+  public:
+	/** Creates a generator keyed with the given seed. */
+					Philox		(uint32_t seed0, uint32_t seed1=0) {
+						mKey[0] = seed0;
+						mKey[1] = seed1;
+					}
+
+	/** Generates the four random words for the given counter. */
+	void			generate	(uint32_t c0, uint32_t c1, uint32_t c2, uint32_t c3,
+								 uint32_t result[4]) const {
+		uint32_t ctr[4] = {c0, c1, c2, c3};
+		uint32_t key[2] = {mKey[0], mKey[1]};
+		for (int round=0; round<10; round++) {
+			uint64_t p0 = uint64_t(0xD2511F53) * ctr[0];
+			uint64_t p1 = uint64_t(0xCD9E8D57) * ctr[2];
+			uint32_t next[4] = {uint32_t(p1>>32) ^ ctr[1] ^ key[0], uint32_t(p1),
+								uint32_t(p0>>32) ^ ctr[3] ^ key[1], uint32_t(p0)};
+			for (int i=0; i<4; i++)
+				ctr[i] = next[i];
+
+			// Bump the key with the Weyl sequence
+			key[0] += 0x9E3779B9;
+			key[1] += 0xBB67AE85;
+		}
+		for (int i=0; i<4; i++)
+			result[i] = ctr[i];
+	}
+
+	/** Converts a random word to a float in the range [0,1). Uses 24
+	 *  bits, so that the result is exact in single precision.
+	 **/
+	static float	uniform		(uint32_t word) {return (word>>8) * (1.0f/16777216.0f);}
+
+  private:
+	uint32_t		mKey[2];
+};
+
+#endif
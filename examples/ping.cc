@@ -3,8 +3,6 @@
 #include <magic/applic.h>
 #include <magic/Math.h>
 
-#define MAX_SIZE 1000000
-
 Main () {
 	MPIInstance mpi (mArgc, mArgv);
 
@@ -18,9 +16,10 @@ Main () {
 	for (int i=0; i<record.size; i++)
 		record[i] = 0.0;
 
-	// Create a buffer, and allocate enough space for it.
-	String buffer;
-	buffer.reserve (msgMaxlen);
+	// Create a buffer, and allocate enough space for it. The echo
+	// receives to a buffer of the same size, so neither one is
+	// reallocated during the measurement.
+	MPIBuffer buffer (msgMaxlen);
 
 	if (mpi.world().getRank() == 0) {
 
@@ -33,12 +32,12 @@ Main () {
 			fprintf (stderr, "\r% 5d\r", l);
 			// Send packets of growing sizes
 			for (int s=msgMinlen; s<=msgMaxlen; s+=msgIncrement) {
-				buffer.len = s; // Force the buffer size; don't care about contents
+				buffer.setLength (s); // Don't care about contents
 				
 				// Bounce the buffer from Echo, and measure time
 				double t1 = mpi.time();
 				mpi.world().send (buffer, 1);
-				mpi.world().recv (buffer, buffer.len, 1);
+				mpi.world().recv (buffer, 1);
 				double t2 = mpi.time();
 				
 				// Record time difference in milliseconds
@@ -51,21 +50,15 @@ Main () {
 		fprintf(stderr, "\r     \r");
 		for (int i=0; i<record.size; i++)
 			printf ("%d\t%1.6f\n", msgMinlen+i*msgIncrement, record[i]/double(loops));
+	} else if (mpi.world().getRank() == 1) {
 
-		// Send stop message to the Echo
-		mpi.world().send ("stop", 1);
-	} else {
-
-		// Echo process
+		// Echo process; bounces as many packets as the sender sends
 		
-		while (true) {
-			mpi.world().recv (buffer, MAX_SIZE, 0);
-
-			if (buffer == "stop")
-				break;
-
-			mpi.world().send (buffer, 0);
-		}
+		for (int l=0; l<loops; l++)
+			for (int s=msgMinlen; s<=msgMaxlen; s+=msgIncrement) {
+				mpi.world().recv (buffer, 0);
+				mpi.world().send (buffer, 0);
+			}
 	}
  end:;
 }
@@ -5,18 +5,17 @@
 #include <magic/Math.h>
 #include "wireelement.h"
 
+/** The wave equation of a vibrating string. */
 class StringEquation : public WireEquation {
   public:
-	StringEquation (double old, double tau) : mOldX (old), mTau(tau) {}
-	virtual double	calc	(const double* left, double x, const double* right) {
-		if (mOldX == 0.0)
-			mOldX == x;
-		double result = 2*x-mOldX+mTau*mTau*((left?*left:0.0) - 2*x + (right?*right:0.0));
-		mOldX = x;
-		return result;
+	StringEquation (double tau) : mTau(tau) {}
+	virtual void	step	(const double* prev, const double* cur, double* next,
+							 int first, int last) {
+		double tau2 = mTau*mTau;
+		for (int i=first; i<=last; i++)
+			next[i] = 2*cur[i] - prev[i] + tau2*(cur[i-1] - 2*cur[i] + cur[i+1]);
 	}
   protected:
-	double mOldX;
 	double mTau;
 };
 
@@ -32,23 +31,22 @@ void StringFragment::make (int len) {
 	int mpis = mMPI.world().size ();
 
 	// Create elements
+	allocate (len);
 	for (int i=0; i<len; i++) {
 		// Calculate initial value for the element
 		double j = (myID-1)*len+i;
 		double y = sin (2*M_PI*j/double((mpis-1)*len));
 
-		StringEquation* eq = new StringEquation (y, 1.0*0.3/1.0);
-
-		// Insert right kind of element in the fragment
-		if (i==0 && myID>1) // First element
-			mElements.add (new CommElement (y, mMPI, myID-1, eq));
-		else if (i==len-1 && myID<mpis-1) // Last element
-			mElements.add (new CommElement (y, mMPI, myID+1, eq));
-		else // All other elements are ordinary
-			mElements.add (new WireElement (y, eq));
+		element(i) = y;
 	}
-
-	link ();
+	setEquation (new StringEquation (1.0*0.3/1.0));
+
+	// The ends of the whole string are free, the others connect to
+	// the neighbouring fragments
+	if (myID>1)
+		setEnd (cLeft, cCommEnd, myID-1);
+	if (myID<mpis-1)
+		setEnd (cRight, cCommEnd, myID+1);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -76,23 +74,16 @@ Main () {
 		int childlen = wirelen / (mpi.world().size()-1);
 		printf ("childlen=%d\n", childlen);
 
-		// Send the segment length to the children
-		int children = mpi.world().size ();
-		for (int i=1; i<children; i++)
-			mpi.world().send (format("%d %f %d", childlen, epsilon, maxcycles), i);
+		// Broadcast the segment length and the other parameters to
+		// the children
+		int pars[2] = {childlen, maxcycles};
+		mpi.world().bcast (pars, 2, 0);
+		mpi.world().bcast (&epsilon, 1, 0);
 	
-		// Iterate until all children have finished
-		int t=0;
-		for (bool finished = false; !finished; t++) {
-			// Finish anyways after certain limit
-			if (t>=maxcycles)
-				finished = true;
-			
-			// Order children to continue or terminate
-			for (int i=1; i<children; i++)
-				mpi.world().send (finished? "terminate":"continue", i);
-		}
-		printf ("Master terminating after %d cycles.\n", t-1);
+		// Follow the run until all children have finished
+		WireMaster master (mpi);
+		int t = master.run ();
+		printf ("Master terminating after %d cycles.\n", t);
 		
 	} else {
 
@@ -101,12 +92,12 @@ Main () {
 		//
 		
 		// Receive some parameters from the master
-		String buffer = mpi.world().recv (100, 0);
-		Array<String> pars;
-		buffer.split (pars, ' ');
+		int pars[2];
+		double epsilon;				// Termination limit
+		mpi.world().bcast (pars, 2, 0);
+		mpi.world().bcast (&epsilon, 1, 0);
 		int len			= pars[0]; // Segment length
-		double epsilon	= pars[1]; // Termination limit
-		int maxcycles	= pars[2]; // Maximum number if iterations
+		int maxcycles	= pars[1]; // Maximum number if iterations
 
 		printf ("Making slave...\n");
 		StringFragment fragment (len, mpi);
@@ -3,6 +3,35 @@
 #include <magic/applic.h>
 #include "wireelement.h"
 
+/** Plots the reports of the wire with Gnuplot. */
+class GnuplotMaster : public WireMaster {
+  public:
+					GnuplotMaster	(MPIInstance& mpi, FILE* gnuplot)
+							: WireMaster (mpi), mGnuplot (gnuplot) {}
+
+  protected:
+	virtual void	report			(int cycle, const double* temps, const int* counts) {
+		// Order Gnuplot to plot the wire data for this cycle from
+		// its stdin
+		fprintf (mGnuplot, "plot '-' t '%d' w l\n", cycle);
+
+		// Give the values to Gnuplot, and create an empty hole
+		// between the fragments with a newline
+		for (int i=1, j=0; i<mMPI.world().size(); i++) {
+			for (int k=0; k<counts[i]; k++, j++)
+				fprintf (mGnuplot, "%g\n", temps[j]);
+			fprintf (mGnuplot, "\n");
+		}
+
+		// Finish Gnuplot data
+		fprintf (mGnuplot, "EOF\n");
+		fflush (mGnuplot);
+	}
+
+  private:
+	FILE*			mGnuplot;
+};
+
 Main () {
 	MPIInstance mpi (mArgc, mArgv);
 
@@ -12,66 +41,33 @@ Main () {
 		// MASTER
 		//
 		
-		String buffer;
-		buffer.reserve (1024);
-
 		// Get the command-line parameters
 		int wirelen		= mParamMap["wirelen"];
 		double epsilon	= mParamMap["epsilon"];
 		int maxcycles	= mParamMap["maxcycles"];
+		int reportfreq	= mParamMap["reportfreq"];
+		if (reportfreq <= 0)
+			reportfreq = 10;
 
 		// Calculate the wire segment length for the children
 		int childlen = wirelen / (mpi.world().size()-1);
 		printf ("childlen=%d\n", childlen);
 
-		// Send the segment length to the children
-		int children = mpi.world().size ();
-		for (int i=1; i<children; i++)
-			mpi.world().send (format("%d %f %d", childlen, epsilon, maxcycles), i);
+		// Broadcast the segment length and the other parameters to
+		// the children
+		int pars[3] = {childlen, maxcycles, reportfreq};
+		mpi.world().bcast (pars, 3, 0);
+		mpi.world().bcast (&epsilon, 1, 0);
 	
 		// We use gnuplot to plot the data vector during the run
 		FILE* gnuplot = popen ("gnuplot", "w");
 
-		// Iterate until all children have finished
-		int t=0;
-		for (bool finished = false; !finished; t++) {
-			
-			// Order Gnuplot to plot the wire data for this cycle from
-			// its stdin
-			fprintf (gnuplot, "plot '-' t '%d' w l\n", t);
-
-			// Collect data from the children
-			finished = true;
-			for (int i=1; i<children; i++) {
-				// Receive wire fragment report from child
-				mpi.world().recv (buffer, buffer.maxLen(), i);
-
-				// Check if the child wants to terminate
-				if (buffer[0] == 'N')
-					finished = false;
-					
-				// Give the values to Gnuplot, and create an empty
-				// hole between the fragments with a newline
-				fprintf (gnuplot, "%s\n", ((CONSTR) buffer)+1);
-			}
-
-			// Finish Gnuplot data
-			fprintf (gnuplot, "EOF\n");
-			fflush (gnuplot);
+		// Follow the run until all children have finished
+		GnuplotMaster master (mpi, gnuplot);
+		int t = master.run ();
 
-			if (finished)
-				printf ("All children under delta epsilon -> terminating\n");
-
-			// Finish anyways after certain limit
-			if (t>=maxcycles)
-				finished = true;
-
-			// Order children to continue or terminate
-			for (int i=1; i<children; i++)
-				mpi.world().send (finished? "terminate":"continue", i);
-		}
 		fclose (gnuplot);
-		printf ("Master terminating after %d cycles.\n", t-1);
+		printf ("Master terminating after %d cycles.\n", t);
 		
 	} else {
 
@@ -80,16 +76,17 @@ Main () {
 		//
 		
 		// Receive some parameters from the master
-		String buffer = mpi.world().recv (100, 0);
-		Array<String> pars;
-		buffer.split (pars, ' ');
+		int pars[3];
+		double epsilon;				// Termination limit
+		mpi.world().bcast (pars, 3, 0);
+		mpi.world().bcast (&epsilon, 1, 0);
 		int len			= pars[0]; // Segment length
-		double epsilon	= pars[1]; // Termination limit
-		int maxcycles	= pars[2]; // Maximum number if iterations
+		int maxcycles	= pars[1]; // Maximum number if iterations
+		int reportfreq	= pars[2]; // Cycles between reports
 	
 		WireFragment fragment (len, mpi);
 		fragment.print ();
-		fragment.run (epsilon, maxcycles);
+		fragment.run (epsilon, maxcycles, reportfreq);
 		printf ("Child %d finished\n", mpi.world().getRank ());
 	}
 }
@@ -3,26 +3,6 @@
 #include <magic/Math.h>
 #include "wireelement.h"
 
-///////////////////////////////////////////////////////////////////////////////
-//           |   | o           ----- |                                       //
-//           | | |        ___  |     |  ___         ___    _    |            //
-//           | | | | |/\ /   ) |---  | /   ) |/|/| /   ) |/ \  -+-           //
-//           | | | | |   |---  |     | |---  | | | |---  |   |  |            //
-//            V V  | |    \__  |____ |  \__  | | |  \__  |   |   \           //
-///////////////////////////////////////////////////////////////////////////////
-
-void WireElement::update () {
-	if (mEquation) {
-		double leftTemp = mLeft? mLeft->mTemp : 0.0;
-		double rightTemp = mRight? mRight->mTemp : 0.0;
-		mNewTemp = mEquation->calc (mLeft? &leftTemp : NULL, this->mTemp, mRight? &rightTemp : NULL);
-	}  else
-		mNewTemp = ((mLeft? mLeft->mTemp:0) + (mRight? mRight->mTemp:0))
-			/ (!!mLeft + !!mRight);
-}
-
-
-
 //////////////////////////////////////////////////////////////////////////////
 //         ___                   ----- |                                    //
 //        /   \                  |     |  ___         ___    _    |         //
@@ -31,35 +11,24 @@ void WireElement::update () {
 //        \___/ \__/ | | | | | | |____ |  \__  | | |  \__  |   |   \        //
 //////////////////////////////////////////////////////////////////////////////
 
-void CommElement::update () {
-	// Receive data from the neighbouring element
-	String buffer;
-	buffer.ensure (100);
-	mMPI.world().recv (buffer, buffer.maxLen(), mNeighbourID);
-	double mNeighbourTemp = buffer; // The value is there as plain ascii text
-
-	// Now use it with the data from the other, ordinary neighbour to
-	// update the temperature.
-	if (mEquation) {
-		double leftTemp = mLeft? mLeft->mTemp : mNeighbourTemp; // A little kludge
-		double rightTemp = mRight? mRight->mTemp : mNeighbourTemp;
-		mNewTemp = mEquation->calc (mLeft? &leftTemp : NULL, this->mTemp, mRight? &rightTemp : NULL);
-	}  else
-		mNewTemp = ((mLeft? mLeft->mTemp:0) + (mRight? mRight->mTemp:0)
-					+ mNeighbourTemp) / (!!mLeft + !!mRight + 1);
+double CommElement::exchange (double temp) {
+	mChannel.sendRecv (&temp, 1, mNeighbourID, &mNeighbourTemp, 1, mNeighbourID, MPI_DOUBLE);
+	return mNeighbourTemp;
+}
+
+void CommElement::post () {
+	mChannel.nbRecv (mRequest, &mNeighbourTemp, 1, MPI_DOUBLE, mNeighbourID);
 }
 
-void CommElement::update2 () {
-	mTemp = mNewTemp;
-	send (); // Send the new value to the neighbour
+void CommElement::send (double temp) {
+	// The neighbour has already posted the receive, so the send
+	// completes immediately.
+	mChannel.send (&temp, 1, MPI_DOUBLE, mNeighbourID);
 }
 
-void CommElement::send () {
-	// Use nonblocking send; the receiver uses blocking receive, which
-	// synchronizes the computation in these two wire elements.
-	//
-	// NOTE: The temperature is sent as plain ascii text.
-	mMPI.world().nbSend (mTemp, mNeighbourID);
+double CommElement::recv () {
+	mRequest.wait ();
+	return mNeighbourTemp;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -72,101 +41,250 @@ void CommElement::send () {
 ///////////////////////////////////////////////////////////////////////////////
 
 WireFragment::WireFragment (int len, MPIInstance& mpi)
-		: mMPI (mpi) {
+		: mMPI (mpi), mHalo (mpi.world()), mLen (0), mPrev (NULL), mCur (NULL), mNext (NULL), mpEquation (NULL) {
+	mEnds[cLeft] = mEnds[cRight] = cFreeEnd;
+	mComm[cLeft] = mComm[cRight] = NULL;
 
 	if (len)
 		make (len);
 }
 
+WireFragment::~WireFragment () {
+	delete mComm[cLeft];
+	delete mComm[cRight];
+	delete mpEquation;
+}
+
 void WireFragment::make (int len) {
 	int myID = mMPI.world().getRank ();
 	int mpis = mMPI.world().size ();
 
-	// Create elements
-	for (int i=0; i<len; i++) {
-		if (i==0) // First element
-			if (myID==1) // First wire fragment
-				mElements.add (new StaticElement (0.0));
-			else // Later fragments connect to the previous fragments
-				mElements.add (new CommElement (20.0, mMPI, myID-1));
-		else
-			if (i==len-1) // Last element
-				if (myID==mpis-1) // Last wire fragment
-					mElements.add (new StaticElement (100.0));
-				else // Earlier fragments connect to the later fragments
-					mElements.add (new CommElement (20.0, mMPI, myID+1));
-			else // All other elements are ordinary
-				mElements.add (new WireElement (20.0));
+	allocate (len);
+	for (int i=0; i<len; i++)
+		element(i) = 20.0;
+
+	if (myID==1) { // First wire fragment
+		setEnd (cLeft, cStaticEnd);
+		element(0) = 0.0;
+	} else // Later fragments connect to the previous fragments
+		setEnd (cLeft, cCommEnd, myID-1);
+
+	if (myID==mpis-1) { // Last wire fragment
+		setEnd (cRight, cStaticEnd);
+		element(len-1) = 100.0;
+	} else // Earlier fragments connect to the later fragments
+		setEnd (cRight, cCommEnd, myID+1);
+}
+
+void WireFragment::allocate (int len) {
+	mLen = len;
+	for (int k=0; k<3; k++) {
+		mTemps[k].make (len+2);
+		for (int i=0; i<len+2; i++)
+			mTemps[k][i] = 0.0;
 	}
+	mPrev = mTemps[0].data;
+	mCur = mTemps[1].data;
+	mNext = mTemps[2].data;
+}
 
-	link ();
+void WireFragment::setEquation (WireEquation* equation) {
+	delete mpEquation;
+	mpEquation = equation;
 }
 
-void WireFragment::link () {
-	// Link the neighbouring elements together as a doubly-linked list
-	for (int i=0; i<mElements.size; i++)
-		mElements[i].link ((i>0)?     &mElements[i-1] : NULL,
-						   (i<mElements.size-1)? &mElements[i+1] : NULL);
+void WireFragment::setEnd (int side, EndType type, int neighbour) {
+	mEnds[side] = type;
+	delete mComm[side];
+	mComm[side] = (type==cCommEnd)? new CommElement (mHalo, neighbour) : NULL;
 }
 
 void WireFragment::print (FILE* out) const {
 	fprintf (out, "Child %d has %d elements: ",
-			mMPI.world().getRank (), mElements.size);
+			mMPI.world().getRank (), mLen);
 
 	// List elements
-	for (int i=0; i<mElements.size; i++)
-		if (dynamic_cast<const CommElement*>(&mElements[i]))
-			fprintf (out, "C");
-		else if (dynamic_cast<const WireElement*>(&mElements[i]))
+	const char endChar[] = {'W', 'S', 'C'};
+	for (int i=0; i<mLen; i++)
+		if (i==0)
+			fprintf (out, "%c", endChar[mEnds[cLeft]]);
+		else if (i==mLen-1)
+			fprintf (out, "%c", endChar[mEnds[cRight]]);
+		else
 			fprintf (out, "W");
-		else if (dynamic_cast<const StaticElement*>(&mElements[i]))
-			fprintf (out, "S");
-			else
-				fprintf (out, "?");
 	fprintf (out, "\n");
 	fflush (out);
 }
 
 void WireFragment::initComm () {
-	// Order communicative elements to send their initial data to
-	// other processes.
-	for (int i=0; i<mElements.size; i++)
-		if (CommElement* e = dynamic_cast<CommElement*>(&mElements[i]))
-			e->send ();
+	// Exchange the initial values of the communicating ends with the
+	// neighbouring processes. The fragments exchange first on the left
+	// and then on the right, so the chain of exchanges can't deadlock.
+	if (mComm[cLeft])
+		mCur[0] = mComm[cLeft]->exchange (mCur[1]);
+	if (mComm[cRight])
+		mCur[mLen+1] = mComm[cRight]->exchange (mCur[mLen]);
+}
+
+double WireFragment::step () {
+	// The static end elements are not updated
+	int first = (mEnds[cLeft]==cStaticEnd)? 2 : 1;
+	int last = (mEnds[cRight]==cStaticEnd)? mLen-1 : mLen;
+	const double* cur = mCur;
+	double* next = mNext;
+
+	if (mpEquation)
+		mpEquation->step (mPrev, cur, next, first, last);
+	else {
+		for (int i=first; i<=last; i++)
+			next[i] = 0.5*(cur[i-1]+cur[i+1]);
+
+		// Free ends have only one neighbour to average
+		if (mEnds[cLeft]==cFreeEnd)
+			next[1] = cur[2];
+		if (mEnds[cRight]==cFreeEnd)
+			next[mLen] = cur[mLen-1];
+	}
+
+	double delta = 0.0;
+	for (int i=first; i<=last; i++) {
+		double d = fabs (next[i]-cur[i]);
+		if (d > delta)
+			delta = d;
+	}
+
+	// Make the new values current. The static end elements and the
+	// free ghost elements are the same in all arrays.
+	mNext = mPrev;
+	mPrev = mCur;
+	mCur = next;
+	return delta;
 }
 
-void WireFragment::run (double epsilon, int maxcycles) {
+void WireFragment::run (double epsilon, int maxcycles, int reportFreq, int master) {
+	// The values that are never updated, the static end elements and
+	// the free ghost elements, must be the same in all arrays. The
+	// elements start at rest, so the previous values are the initial
+	// ones.
+	memcpy (mPrev, mCur, (mLen+2)*sizeof(double));
+	memcpy (mNext, mCur, (mLen+2)*sizeof(double));
+
 	initComm ();
 
+	// The fragments vote on the termination and collect the reports
+	// among themselves; the master is left out of the communicator
+	MPIComm* workers = mMPI.world().split (1, mMPI.world().getRank ());
+
+	// The first fragment collects the reports, and needs the lengths
+	// of all fragments for that. The report header has the cycle, the
+	// termination and the lengths.
+	bool reporter = master>=0 && workers->getRank()==0;
+	int fragments = workers->size ();
+	PackArray<int> header, displs;
+	PackArray<double> temps;
+	if (reporter) {
+		header.make (2+fragments);
+		displs.make (fragments);
+	}
+	int* lengths = reporter? header.data+2 : NULL;
+	if (master >= 0)
+		workers->gather (&mLen, lengths, 1, MPI_INT, 0);
+	int total = 0;
+	if (reporter) {
+		for (int i=0; i<fragments; i++) {
+			displs[i] = total;
+			total += lengths[i];
+		}
+		temps.make (total);
+	}
+	MPIChannel reports (mMPI.world(), WireMaster::cReportTag);
+
 	// Run for at most maxcycles, or infinitely, if it is -1
 	int cycle=0;
 	for (;true;cycle++) {
-		// Update the values once
-		for (int i=0; i<mElements.size; i++)
-			mElements[i].update ();
-
-		// Update new temperature values as current
-		bool under_epsilon=true;
-		for (int i=0; i<mElements.size; i++) {
-			// Check if any of the deltas is still greater than epsilon
-			if (mElements[i].delta() > epsilon)
-				under_epsilon = false;
-			mElements[i].update2 ();
-		}
+		// Post the receives of the next ghost values
+		for (int side=cLeft; side<=cRight; side++)
+			if (mComm[side])
+				mComm[side]->post ();
 
-		// Generate and send a report to the master
+		// Update the values once, and check if any of the deltas is
+		// still greater than epsilon
+		bool under_epsilon = step () <= epsilon;
 
-		// Report starts with T, if the delta is below epsilon,
-		// otherwise with N
-		String report = under_epsilon? "T" : "N";
+		// Send the new end values to the neighbours, and get theirs
+		if (mComm[cLeft])
+			mComm[cLeft]->send (mCur[1]);
+		if (mComm[cRight])
+			mComm[cRight]->send (mCur[mLen]);
+		if (mComm[cLeft])
+			mCur[0] = mComm[cLeft]->recv ();
+		if (mComm[cRight])
+			mCur[mLen+1] = mComm[cRight]->recv ();
 
-		// Temperatures of the elements are listed in plain text
-		for (int i=0; i<mElements.size; i++)
-			report += format ("%g\n", mElements[i].temp());
-		mMPI.world().nbSend (report, 0);
+		// Vote on the termination
+		int vote = under_epsilon, all;
+		workers->allReduce (&vote, &all, 1, MPI_INT, MPI_MIN);
+		bool finished = all || (maxcycles>=0 && cycle>=maxcycles);
 
-		// Get orders from master
-		if (mMPI.world().recv (100, 0) == "terminate")
+		// Report the values to the master now and then. The first
+		// fragment sends the report on without waiting for the
+		// master to receive it.
+		if (master>=0 && (finished || !(cycle%reportFreq))) {
+			workers->gatherv (mCur+1, mLen, temps.data, lengths, displs.data, MPI_DOUBLE, 0);
+			if (reporter) {
+				header[0] = cycle;
+				header[1] = finished;
+				reports.nbSend (header.data, header.size, MPI_INT, master);
+				reports.nbSend (temps.data, total, MPI_DOUBLE, master);
+			}
+		}
+
+		if (finished)
 			break;
 	}
+
+	delete workers;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+//       |   | o           |   |                                             //
+//       | | |        ___  |\ /|  ___   ____  |   ___                        //
+//       | | | | |/\ /   ) | V |  ___| (     -+- /   ) |/\                   //
+//       | | | | |   |---  | | | (   |  \__   |  |---  |                     //
+//        V V  | |    \__  |   |  \__| ____)   \  \__  |                     //
+///////////////////////////////////////////////////////////////////////////////
+
+int WireMaster::run () {
+	// Stay out of the communicator of the fragments
+	mMPI.world().split (MPI_UNDEFINED);
+
+	int size = mMPI.world().size ();
+	int rank = mMPI.world().getRank ();
+	PackArray<int> header (2+size), counts (size);
+	PackArray<double> temps;
+	MPIChannel reports (mMPI.world(), cReportTag);
+
+	// Receive the reports of the first fragment until the last one
+	int cycle = 0;
+	bool finished = false;
+	while (!finished) {
+		MPI_Status status;
+		reports.recv (header.data, header.size, MPI_INT, MPI_ANY_SOURCE, &status);
+		cycle = header[0];
+		finished = header[1];
+
+		// The fragments are all the other processes, in rank order
+		int total = 0;
+		for (int i=0, j=2; i<size; i++) {
+			counts[i] = (i==rank)? 0 : header[j++];
+			total += counts[i];
+		}
+		if (temps.size < total)
+			temps.make (total);
+		reports.recv (temps.data, total, MPI_DOUBLE, status.MPI_SOURCE);
+		report (cycle, temps.data, counts.data);
+	}
+	return cycle;
 }
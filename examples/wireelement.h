@@ -3,109 +3,32 @@
 
 #include <magic/object.h>
 #include <magic/pararr.h>
+#include <magic/packarray.h>
 #include <math.h>
 
-class AnyElement;
-
+/** The update rule of the elements of a wire fragment.
+ *
+ *  The equation updates a range of elements at a time, from arrays
+ *  of the element values, so that the loop can be vectorized. The
+ *  arrays have the neighbours of the range available; at a free end
+ *  of the wire, the missing neighbour has the value zero.
+ **/
 class WireEquation {
-	int mDummy;
-  public:
-	WireEquation () {}
-	virtual double	calc	(const double* left, double x, const double* right) {return x;}
-};
-
-///////////////////////////////////////////////////////////////////////////////
-//                                                                           //
-//             _               ----- |                                       //
-//            / \    _         |     |  ___         ___    _    |            //
-//           /   \ |/ \  \   | |---  | /   ) |/|/| /   ) |/ \  -+-           //
-//           |---| |   |  \  | |     | |---  | | | |---  |   |  |            //
-//           |   | |   |   \_/ |____ |  \__  | | |  \__  |   |   \           //
-//                        \_/                                                //
-///////////////////////////////////////////////////////////////////////////////
-
-class AnyElement {
   public:
-	AnyElement (double temp=20) : mTemp (temp) {}
-
-	double	temp	() const {return mTemp;}
-
-	void	link	(const AnyElement* left, const AnyElement* right) {
-		mLeft = left;
-		mRight = right;
-	}
-
-	/** Updates the temperature. The temperature change does not
-	 *  actualize before update2().
-	 *
-	 *  Must be overloaded.
-	 **/
-	virtual void	update	() {MUST_OVERLOAD}
+					WireEquation	() {}
+	virtual			~WireEquation	() {}
 
-	/** Returns the temperature change after previous update.
-	 *
-	 *  Must be overloaded by immediate inheritors.
-	 *  
-	 *  OBSERVE! The method is not valid after the update2() call!
-	 **/
-	virtual double	delta	() const {MUST_OVERLOAD}
-	
-	/** Updates the new calculated temperature as current.
+	/** Computes the next values of the elements first...last.
 	 *
-	 *  Must be overloaded.
+	 *  %param prev Values of the previous cycle
+	 *  %param cur Current values
+	 *  %param next The new values, result parameter
 	 **/
-	virtual void	update2	() {MUST_OVERLOAD}
-	
-	double	mTemp;
-	double  mNewTemp;
-  protected:
-	const AnyElement* mLeft;
-	const AnyElement* mRight;
-};
-
-
-
-///////////////////////////////////////////////////////////////////////////////
-//                                                                           //
-//       ----               o       ----- |                                  //
-//      (      |   ___   |     ___  |     |  ___         ___    _    |       //
-//       ---  -+-  ___| -+- | |   \ |---  | /   ) |/|/| /   ) |/ \  -+-      //
-//          )  |  (   |  |  | |     |     | |---  | | | |---  |   |  |       //
-//      ___/    \  \__|   \ |  \__/ |____ |  \__  | | |  \__  |   |   \      //
-//                                                                           //
-///////////////////////////////////////////////////////////////////////////////
-
-class StaticElement : public AnyElement {
-  public:
-	StaticElement (double temp) : AnyElement (temp) {}
-
-	/** Dummy; static elements can't be modified. */
-	virtual void	update	() {}
-	virtual void	update2	() {}
-	virtual double	delta	() const {return 0.0;}
-  protected:
-};
-
-
-
-///////////////////////////////////////////////////////////////////////////////
-//           |   | o           ----- |                                       //
-//           | | |        ___  |     |  ___         ___    _    |            //
-//           | | | | |/\ /   ) |---  | /   ) |/|/| /   ) |/ \  -+-           //
-//           | | | | |   |---  |     | |---  | | | |---  |   |  |            //
-//            V V  | |    \__  |____ |  \__  | | |  \__  |   |   \           //
-///////////////////////////////////////////////////////////////////////////////
-
-class WireElement : public AnyElement {
-  public:
-					WireElement (double temp, WireEquation* equation=NULL) : AnyElement (temp), mEquation(equation) {}
-	
-	virtual void	update		();
-	virtual double	delta		() const {return fabs (mTemp-mNewTemp);}
-	virtual void	update2		() {mTemp = mNewTemp;}
-
-  protected:
-	WireEquation*	mEquation;
+	virtual void	step			(const double* prev, const double* cur, double* next,
+									 int first, int last) {
+		for (int i=first; i<=last; i++)
+			next[i] = cur[i];
+	}
 };
 
 
@@ -118,30 +41,46 @@ class WireElement : public AnyElement {
 //        \___/ \__/ | | | | | | |____ |  \__  | | |  \__  |   |   \        //
 //////////////////////////////////////////////////////////////////////////////
 
-/** Comm element acts just like an ordinary WireElement, except that
- *  it gets its values by communication.
+/** Connects an end of a WireFragment to the end of the neighbouring
+ *  fragment in another process. The end element is updated just like
+ *  the others, with the value of the neighbouring end element as its
+ *  outer neighbour.
+ *
+ *  The values are exchanged as binary doubles through the given
+ *  channel. The receive of the next value is posted before the
+ *  computation of a cycle, so that it can arrive while we compute.
  **/
-class CommElement : public WireElement {
+class CommElement {
   public:
-	CommElement	(double temp, MPIInstance& mpi, int neighbour, WireEquation* equation=NULL)
-			: WireElement (temp, equation), mMPI (mpi), mNeighbourID (neighbour) {}
-	
-	virtual void	update	();
-	virtual void	update2	();
-	
-	/** Sends the data to the neighbouring CommElement in neighbouring
-	 *  WireFragment, over the MPI interface.
-	 *
-	 *  Used by the CommElement itself autonomously, and also by the
-	 *  WireFragment, to send the initial value.
-	**/
-	void			send	();
+	CommElement	(MPIChannel& channel, int neighbour)
+			: mChannel (channel), mNeighbourID (neighbour), mRequest (channel.comm()) {}
+
+	/** Exchanges the values of the end elements with the
+	 *  neighbouring fragment. Returns the value of the neighbouring
+	 *  end element.
+	 **/
+	double			exchange	(double temp);
+
+	/** Posts the receive of the next value of the neighbouring end
+	 *  element.
+	 **/
+	void			post		();
+
+	/** Sends the value of our end element to the neighbouring
+	 *  fragment.
+	 **/
+	void			send		(double temp);
+
+	/** Waits for the posted value of the neighbouring end element and
+	 *  returns it.
+	 **/
+	double			recv		();
 
   protected:
-	MPIInstance&	mMPI;
+	MPIChannel&		mChannel;
 	int				mNeighbourID;
 	double			mNeighbourTemp;
-
+	MPIRequest		mRequest;
 };
 
 
@@ -155,27 +94,55 @@ class CommElement : public WireElement {
 //                                          __/                              //
 ///////////////////////////////////////////////////////////////////////////////
 
+/** A fragment of the wire, computed by one process.
+ *
+ *  The temperatures of the elements are kept in two flat arrays, the
+ *  current and the next values, with a ghost element at both ends.
+ *  The ends of the fragment behave in one of three ways:
+ *
+ *  A static end element keeps its value; it is not updated.
+ *
+ *  A communicating end gets its ghost value from the neighbouring
+ *  fragment through a CommElement. The equation sees that value too;
+ *  the old per-element CommElement passed no neighbour to the
+ *  equation, so equation-driven fragments such as the vibrating
+ *  string were computed as if their communicating ends were free.
+ *
+ *  A free end has a ghost value of zero.
+ *
+ *  An update of the elements is thus a plain three-point stencil over
+ *  the array.
+ **/
 class WireFragment : public Object {
   public:
 						WireFragment	(int len, MPIInstance& mpi);
+						~WireFragment	();
 
-	virtual void		make			(int len);
-
-	/** Links the neighbouring elements together as a doubly-linked
-	 *  list. Any reimplementation of make must call this!
+	/** Creates the elements. A reimplementation must call
+	 *  allocate() and setEnd() for both ends, and set the initial
+	 *  values with element().
 	 **/
-	void				link			();
+	virtual void		make			(int len);
 
 	/** Prints out the data in the fragment.
 	 **/
 	void				print			(FILE* out=stdout) const;
 
-	/** Shakes hands with the neighbouring fragments (CommElements
-	 *  exchange their values.
+	/** Shakes hands with the neighbouring fragments (communicating
+	 *  ends exchange their values to the ghost elements).
 	 **/
 	void				initComm		();
 
-	/** Runs the wire.
+	/** Runs the wire. All the other processes of the world must be
+	 *  fragments, except for an optional master, which must follow
+	 *  the run with WireMaster::run().
+	 *
+	 *  After every cycle, the fragments vote on the termination with
+	 *  an all-reduce over a communicator of their own. The values of
+	 *  the elements are gathered to the first fragment every
+	 *  reportFreq cycles and after the last cycle, and it sends them
+	 *  on to the master. The master thus only receives the reports,
+	 *  and does not pace the fragments.
 	 *
 	 *  %param epsilon Minimum delta for the elements. The run
 	 *  terminates ONLY after all fragments have their delta below
@@ -183,11 +150,110 @@ class WireFragment : public Object {
 	 *
 	 *  %param maxcycles Maximum number of cycles. Value -1 causes to
 	 *  run forever, unless terminated by the epsilon parameter.
+	 *
+	 *  %param master Rank of the master process in the world, or -1
+	 *  to run without a master and reports.
+	 **/
+	void				run				(double epsilon=0.01, int maxcycles=-1, int reportFreq=10,
+										 int master=0);
+
+	/** Returns the number of elements. */
+	int					length			() const {return mLen;}
+
+	/** Returns the current value of element i. */
+	double				temp			(int i) const {return mCur[i+1];}
+
+	/** Sets the update rule of the elements. The fragment takes the
+	 *  ownership of the equation. Without an equation, the new value
+	 *  of an element is the average of its neighbours.
 	 **/
-	void				run				(double epsilon=0.01, int maxcycles=-1);
-	
+	void				setEquation		(WireEquation* equation);
+
   protected:
-	Array<AnyElement>	mElements;
+	/** Behaviour of the fragment ends. */
+	enum EndType {cFreeEnd, cStaticEnd, cCommEnd};
+
+	/** Sides of the fragment. */
+	enum {cLeft, cRight};
+
+	/** Allocates the arrays for len elements, initialized to zero. */
+	void				allocate		(int len);
+
+	/** Sets the behaviour of an end of the fragment. Communicating
+	 *  ends are connected to the given neighbour process.
+	 **/
+	void				setEnd			(int side, EndType type, int neighbour=-1);
+
+	/** Returns element i, for setting its initial value. */
+	double&				element			(int i) {return mCur[i+1];}
+
+	/** Computes the next values of the elements and makes them
+	 *  current. Returns the largest change.
+	 **/
+	double				step			();
+
 	MPIInstance&		mMPI;
+
+	/** Channel of the end element values; kept apart from the other
+	 *  messages of the processes.
+	 **/
+	MPIChannel			mHalo;
+
+	/** Number of elements. */
+	int					mLen;
+
+	/** Storage of the previous, current and next values, with the
+	 *  ghost elements at indices 0 and len+1. The arrays are rotated
+	 *  after each cycle.
+	 **/
+	PackArray<double>	mTemps[3];
+	double*				mPrev;
+	double*				mCur;
+	double*				mNext;
+
+	EndType				mEnds[2];
+	CommElement*		mComm[2];
+
+	/** Update rule of the elements; NULL for simple averaging. */
+	WireEquation*		mpEquation;
+};
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+//       |   | o           |   |                                             //
+//       | | |        ___  |\ /|  ___   ____  |   ___                        //
+//       | | | | |/\ /   ) | V |  ___| (     -+- /   ) |/\                   //
+//       | | | | |   |---  | | | (   |  \__   |  |---  |                     //
+//        V V  | |    \__  |   |  \__| ____)   \  \__  |                     //
+///////////////////////////////////////////////////////////////////////////////
+
+/** The master side of a wire run. Receives the reports of the
+ *  fragments, but does not take part in their termination votes nor
+ *  pace them. The master joins the fragments only in creating their
+ *  communicator, at the start of the run.
+ **/
+class WireMaster {
+  public:
+	/** Message tag of the reports; below the tags of the channels. */
+	enum {cReportTag=MPIComm::cDefaultTag-1};
+
+					WireMaster		(MPIInstance& mpi) : mMPI (mpi) {}
+
+	/** Follows the run of the fragments until they send their last
+	 *  report. Returns the number of cycles run.
+	 **/
+	int				run				();
+
+  protected:
+	/** Called with the values of the whole wire when the fragments
+	 *  report them.
+	 *
+	 *  %param counts Number of values from each process, in rank
+	 *  order; the master has zero values.
+	 **/
+	virtual void	report			(int cycle, const double* temps, const int* counts) {}
+
+	MPIInstance&	mMPI;
 };
 #endif
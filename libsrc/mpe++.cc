@@ -1,4 +1,5 @@
 #include "mpe++.h"
+#include <math.h>
 
 MPEWindow::MPEWindow (MPIComm& comm, int x, int y, int xsize, int ysize, const char* xserver)
 		: mComm (comm) {
@@ -54,6 +55,86 @@ void MPEWindow::fillCircle (int x, int y, int r, MPE_Color color) {
 								 (CONSTR) mComm.mpi().error(errcode)));
 }
 
+void MPEWindow::drawPoints (const int* x, const int* y, const MPE_Color* colors, int n) {
+	MPE_Point* p = points (n);
+	for (int i=0; i<n; i++) {
+		p[i].x = x[i];
+		p[i].y = y[i];
+		p[i].c = colors[i];
+	}
+	submitPoints (n, "drawPoints");
+}
+
+void MPEWindow::drawSpan (int x, int y, int n, const MPE_Color* colors) {
+	MPE_Point* p = points (n);
+	for (int i=0; i<n; i++) {
+		p[i].x = x+i;
+		p[i].y = y;
+		p[i].c = colors[i];
+	}
+	submitPoints (n, "drawSpan");
+}
+
+void MPEWindow::fillCircles (const int* x, const int* y, const int* r,
+							 const MPE_Color* colors, int n) {
+	// The MPE has no request for drawing many circles, so the circles
+	// are rasterized into the point list. The bounding squares are an
+	// upper limit for the number of points.
+	int maxpoints = 0;
+	for (int i=0; i<n; i++)
+		maxpoints += (2*r[i]+1)*(2*r[i]+1);
+	MPE_Point* p = points (maxpoints);
+
+	int npoints = 0;
+	for (int i=0; i<n; i++)
+		for (int dy=-r[i]; dy<=r[i]; dy++) {
+			// Half width of the circle on this row
+			int dx = int (sqrt (double (r[i]*r[i]-dy*dy)));
+			for (int c=x[i]-dx; c<=x[i]+dx; c++, npoints++) {
+				p[npoints].x = c;
+				p[npoints].y = y[i]+dy;
+				p[npoints].c = colors[i];
+			}
+		}
+	submitPoints (npoints, "fillCircles");
+}
+
+void MPEWindow::putImage (int x, int y, int w, int h, const MPE_Color* pixels) {
+	MPE_Point* p = points (w*h);
+	for (int r=0, i=0; r<h; r++)
+		for (int c=0; c<w; c++, i++) {
+			p[i].x = x+c;
+			p[i].y = y+r;
+			p[i].c = pixels[i];
+		}
+	submitPoints (w*h, "putImage");
+}
+
+void MPEWindow::drawImage (const MPIImage& image, const MPE_Color* palette, int x, int y) {
+	int w = image.width(), h = image.height();
+	const unsigned char* pixels = image.pixels ();
+	MPE_Point* p = points (w*h);
+	for (int r=0, i=0; r<h; r++)
+		for (int c=0; c<w; c++, i++) {
+			p[i].x = x+c;
+			p[i].y = y+r;
+			p[i].c = palette[pixels[i]];
+		}
+	submitPoints (w*h, "drawImage");
+}
+
+MPE_Point* MPEWindow::points (int n) {
+	if (mPoints.size < n)
+		mPoints.make (n);
+	return mPoints.data;
+}
+
+void MPEWindow::submitPoints (int n, const char* method) {
+	int errcode;
+	if ((errcode=MPE_Draw_points (mWin, mPoints.data, n)) != MPE_SUCCESS)
+		throw mpe_error (format ("MPE_Draw_points error in MPEWindow::%s: %s\n",
+								 method, (CONSTR) mComm.mpi().error(errcode)));
+}
 
 void MPEWindow::update () {
 	int errcode;
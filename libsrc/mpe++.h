@@ -8,6 +8,8 @@
 #else
 
 #include "mpi++.h"
+#include "mpiimage.h"
+#include <magic/packarray.h>
 #define MPE_GRAPHICS 1
 #include <mpe.h>
 
@@ -59,6 +61,42 @@ class MPEWindow {
 
 	void			fillCircle		(int x, int y, int r, MPE_Color color);
 
+	/** Draws n points with a single drawing request.
+	 *
+	 *  @param x,y Coordinates of the points
+	 *  @param colors Colors of the points
+	 **/
+	void			drawPoints		(const int* x, const int* y, const MPE_Color* colors, int n);
+
+	/** Draws a horizontal span of n points starting from (x,y) with a
+	 *  single drawing request.
+	 **/
+	void			drawSpan		(int x, int y, int n, const MPE_Color* colors);
+
+	/** Fills n circles with a single drawing request. The circles are
+	 *  drawn in order, so later circles cover the earlier ones.
+	 *
+	 *  @param x,y Centers of the circles
+	 *  @param r Radii of the circles
+	 *  @param colors Colors of the circles
+	 **/
+	void			fillCircles		(const int* x, const int* y, const int* r,
+									 const MPE_Color* colors, int n);
+
+	/** Puts a block of w*h pixels, given row by row, with a single
+	 *  drawing request.
+	 *
+	 *  @param x,y Position of the upper left corner
+	 **/
+	void			putImage		(int x, int y, int w, int h, const MPE_Color* pixels);
+
+	/** Draws an image with a single drawing request.
+	 *
+	 *  @param palette MPE colors of the palette indices of the image.
+	 *  @param x,y Position of the upper left corner
+	 **/
+	void			drawImage		(const MPIImage& image, const MPE_Color* palette, int x=0, int y=0);
+
 	/** Flushes all recent draw operations and actually draws them. */
 	void			update			();
 
@@ -76,8 +114,19 @@ class MPEWindow {
 	MPIComm&		comm			() {return mComm;}
 	
   protected:
-	MPE_XGraph	mWin;
-	MPIComm&	mComm;
+	/** Makes room for n points in the request list. */
+	MPE_Point*		points			(int n);
+
+	/** Submits the first n points of the request list. */
+	void			submitPoints	(int n, const char* method);
+
+	MPE_XGraph				mWin;
+	MPIComm&				mComm;
+
+	/** Request list of the batched drawing operations; reused between
+	 *  the calls.
+	 **/
+	PackArray<MPE_Point>	mPoints;
 };
 
 #endif
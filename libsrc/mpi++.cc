@@ -1,4 +1,28 @@
 #include "mpi++.h"
+#include "mpiprof.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sched.h>
+
+// The persistent collectives are standard since MPI-4, and an
+// extension of Open MPI before that
+#if MPI_VERSION >= 4
+#define PERSISTENT_COLLECTIVES
+#define MPI_BARRIER_INIT	MPI_Barrier_init
+#define MPI_BCAST_INIT		MPI_Bcast_init
+#define MPI_ALLREDUCE_INIT	MPI_Allreduce_init
+#define MPI_ALLGATHER_INIT	MPI_Allgather_init
+#elif defined(OPEN_MPI) && MPI_VERSION >= 3
+#include <mpi-ext.h>
+#if defined(OMPI_HAVE_MPI_EXT_PCOLLREQ) && OMPI_HAVE_MPI_EXT_PCOLLREQ
+#define PERSISTENT_COLLECTIVES
+#define MPI_BARRIER_INIT	MPIX_Barrier_init
+#define MPI_BCAST_INIT		MPIX_Bcast_init
+#define MPI_ALLREDUCE_INIT	MPIX_Allreduce_init
+#define MPI_ALLGATHER_INIT	MPIX_Allgather_init
+#endif
+#endif
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -9,14 +33,20 @@
 //        |   | |     _|_ _|_ |   | ____)   \  \__| |   |  \__/  \__         //
 ///////////////////////////////////////////////////////////////////////////////
 
-MPIInstance::MPIInstance (int& argc, char**& argv) {
-	MPI_Init (&argc, &argv);
+MPIInstance::MPIInstance (int& argc, char**& argv, int threadLevel) : mBufferAttached (false) {
+	MPI_Init_thread (&argc, &argv, threadLevel, &mThreadLevel);
 	mpWorld = new MPIComm (*this, MPI_COMM_WORLD);
-	initBuffer (1024);
+	mpSendPool = new MPISendPool (*this);
 }
 
 MPIInstance::~MPIInstance () {
+	// The pending sends must complete before finalizing
+	mpSendPool->flush ();
+	delete mpSendPool;
 	delete mpWorld;
+#ifdef ENABLE_MPIPROF
+	MPIProfiler::report ();
+#endif
     MPI_Finalize(); 
 }
 
@@ -25,8 +55,19 @@ double MPIInstance::time () const {
 }
 
 void MPIInstance::initBuffer (int len) {
+	// Detach the previous buffer, if any
+	void* old;
+	int oldlen;
+	if (mBufferAttached)
+		MPI_Buffer_detach (&old, &oldlen);
+	mBufferAttached = false;
+
 	mBuffer.ensure (len);
-	MPI_Buffer_attach (mBuffer.getbuffer(), mBuffer.maxLen());
+	int errcode;
+	if ((errcode=MPI_Buffer_attach (mBuffer.getbuffer(), mBuffer.maxLen())) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIInstance::initBuffer(): %s\n",
+								 (CONSTR) error(errcode)));
+	mBufferAttached = true;
 }
 
 String MPIInstance::error (int errcode) const {
@@ -37,28 +78,338 @@ String MPIInstance::error (int errcode) const {
 }
 
 void MPIRequest::wait () {
-	MPI_Wait (&mRequest, &mComm.mpi().mMPIStatus);
+	MPIPROF_SITE;
+	MPI_Wait (&mRequest, &mStatus);
 
 	complete ();
 }
 
 bool MPIRequest::check () {
+	MPIPROF_SITE;
 	int flag;
-	MPI_Test (&mRequest, &flag, &mComm.mpi().mMPIStatus);
+	MPI_Test (&mRequest, &flag, &mStatus);
 	if (flag)
 		complete ();
 	return flag;
 }
 
 void MPIRequest::complete () {
+	// Raw buffers need no termination
+	if (!mpBuffer)
+		return;
+
 	// Always get the length info. I'm not sure about how much
 	// overhead this makes. Might be really small.
 	int len;
-	MPI_Get_count (&mComm.mpi().mMPIStatus, MPI_CHAR, &len);
+	MPI_Get_count (&mStatus, MPI_CHAR, &len);
 
 	// Ensure string termination (there is always room for one 0 in
 	// MagiClib Strings).
-	mBuffer.getbuffer()[mBuffer.len=len] = 0;
+	mpBuffer->getbuffer()[mpBuffer->len=len] = 0;
+}
+
+MPICollective::MPICollective (MPIComm& comm, Kind kind, const void* sendBuffer, void* recvBuffer,
+							  int count, MPI_Datatype datatype, MPI_Op op, int root)
+		: MPIRequest (comm), mKind (kind), mpSendBuffer (sendBuffer), mpRecvBuffer (recvBuffer),
+		  mCount (count), mDatatype (datatype), mOp (op), mRoot (root) {
+#ifdef PERSISTENT_COLLECTIVES
+	MPITAGTYPE tag = comm.getCommTag ();
+	int errcode = MPI_SUCCESS;
+	switch (kind) {
+	  case cBarrier:
+		errcode = MPI_BARRIER_INIT (tag, MPI_INFO_NULL, &mRequest);
+		break;
+	  case cBcast:
+		errcode = MPI_BCAST_INIT (recvBuffer, count, datatype, root, tag, MPI_INFO_NULL, &mRequest);
+		break;
+	  case cAllReduce:
+		errcode = MPI_ALLREDUCE_INIT (sendBuffer, recvBuffer, count, datatype, op, tag,
+									  MPI_INFO_NULL, &mRequest);
+		break;
+	  case cAllGather:
+		errcode = MPI_ALLGATHER_INIT (sendBuffer, count, datatype, recvBuffer, count, datatype, tag,
+									  MPI_INFO_NULL, &mRequest);
+		break;
+	}
+	if (errcode != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPICollective::MPICollective(): %s\n",
+								 (CONSTR) comm.mpi().error(errcode)));
+#endif
+}
+
+MPICollective::~MPICollective () {
+#ifdef PERSISTENT_COLLECTIVES
+	if (mRequest != MPI_REQUEST_NULL)
+		MPI_Request_free (&mRequest);
+#endif
+}
+
+void MPICollective::start () {
+	MPIPROF_SITE;
+#ifdef PERSISTENT_COLLECTIVES
+	int errcode;
+	if ((errcode=MPI_Start (&mRequest)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPICollective::start(): %s\n",
+								 (CONSTR) mComm.mpi().error(errcode)));
+#else
+	switch (mKind) {
+	  case cBarrier:
+		mComm.iBarrier (*this);
+		break;
+	  case cBcast:
+		mComm.iBcast (*this, mpRecvBuffer, mCount, mDatatype, mRoot);
+		break;
+	  case cAllReduce:
+		mComm.iAllReduce (*this, mpSendBuffer, mpRecvBuffer, mCount, mDatatype, mOp);
+		break;
+	  case cAllGather:
+		mComm.iAllGather (*this, mpSendBuffer, mpRecvBuffer, mCount, mDatatype);
+		break;
+	}
+#endif
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//        |   | ----  --- ----         _   _                                //
+//        |\ /| |   )  |  |   )       /   /    ___                          //
+//        | V | |---   |  |---  |   | -+- -+- /   ) |/\                     //
+//        | | | |      |  |   ) |   |  |   |  |---  |                       //
+//        |   | |     _|_ |___   \__!  |   |   \__  |                       //
+//////////////////////////////////////////////////////////////////////////////
+
+MPIBuffer::MPIBuffer (int capacity) : mpData (NULL), mCapacity (0), mLength (0) {
+	reserve (capacity);
+}
+
+MPIBuffer::~MPIBuffer () {
+	free (mpData);
+}
+
+void MPIBuffer::setLength (int length) {
+	if (length > mCapacity)
+		throw mpi_error (format ("Error in MPIBuffer::setLength(): length %d exceeds the capacity %d\n",
+								 length, mCapacity));
+	mLength = length;
+}
+
+void MPIBuffer::reserve (int capacity) {
+	if (capacity <= mCapacity)
+		return;
+
+	// Round up to whole pages
+	int pagesize = sysconf (_SC_PAGESIZE);
+	capacity = ((capacity+pagesize-1)/pagesize)*pagesize;
+
+	void* data;
+	if (posix_memalign (&data, pagesize, capacity) != 0)
+		throw mpi_error (format ("Error in MPIBuffer::reserve(): out of memory for %d bytes\n",
+								 capacity));
+	free (mpData);
+	mpData = (char*) data;
+	mCapacity = capacity;
+	mLength = 0;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//         |   | ----  --- ----                |  ----                 |    //
+//         |\ /| |   )  |  (      ___    _     |  |   )  __    __   |       //
+//         | V | |---   |   ---  /   ) |/ \  __|  |---  /  \  /  \  |       //
+//         | | | |      |      ) |---  |   | (  |  |     |  | |  |  |       //
+//         |   | |     _|_ ___/   \__  |   |  \_|  |     \__/ \__/  |       //
+//////////////////////////////////////////////////////////////////////////////
+
+MPISendPool::MPISendPool (MPIInstance& mpi, int maxBytes)
+		: mMPI (mpi), mpRequests (NULL), mpBusy (NULL), mpBytes (NULL), mpWaited (NULL), mMaxBytes (maxBytes) {
+}
+
+MPISendPool::~MPISendPool () {
+	flush ();
+	free (mpRequests);
+	free (mpBusy);
+	free (mpBytes);
+	free (mpWaited);
+}
+
+void MPISendPool::setMaxBytes (int maxBytes) {
+	MPILock lock (mMutex);
+	mMaxBytes = maxBytes;
+}
+
+void MPISendPool::send (const void* buffer, int count, MPI_Datatype datatype,
+						int receiver, int tag, MPITAGTYPE comm) {
+	// A datatype without gaps is copied as it is; others are packed
+	int size;
+	MPI_Aint lb, extent, truelb, trueextent;
+	MPI_Type_size (datatype, &size);
+	MPI_Type_get_extent (datatype, &lb, &extent);
+	MPI_Type_get_true_extent (datatype, &truelb, &trueextent);
+	bool contiguous = truelb==0 && trueextent==size && extent==size;
+
+	int bytes;
+	if (contiguous)
+		bytes = count*size;
+	else
+		MPI_Pack_size (count, datatype, comm, &bytes);
+
+	// The lock is held until the send has been started, so that no
+	// other thread tests the request while it is being set
+	MPILock lock (mMutex);
+	int slot = acquire (bytes);
+	MPIBuffer& copy = mBuffers[slot];
+	int errcode;
+	if (contiguous) {
+		memcpy (copy.data(), buffer, bytes);
+		errcode = MPI_Isend (copy.data(), count, datatype, receiver, tag,
+							 comm, &mpRequests[slot]);
+	} else {
+		int position = 0;
+		if ((errcode=MPI_Pack (const_cast<void*>(buffer), count, datatype, copy.data(), copy.capacity(),
+							   &position, comm)) == MPI_SUCCESS)
+			errcode = MPI_Isend (copy.data(), position, MPI_PACKED, receiver, tag,
+								 comm, &mpRequests[slot]);
+	}
+	if (errcode != MPI_SUCCESS) {
+		mpBusy[slot] = false;
+		throw mpi_error (format ("Error in MPISendPool::send(): %s\n",
+								 (CONSTR) mMPI.error(errcode)));
+	}
+}
+
+int MPISendPool::acquire (int bytes) {
+	recycleLocked ();
+
+	// Keep within the limit by waiting for the earlier sends
+	while (mMaxBytes && busyBytes()+bytes > mMaxBytes && recycleLocked ())
+		waitSome ();
+
+	// Prefer the smallest free buffer that is large enough, then the
+	// largest free buffer, which is grown.
+	int best = -1;
+	for (int i=0; i<mBuffers.size; i++) {
+		if (mpBusy[i])
+			continue;
+		if (best < 0)
+			best = i;
+		else if (mBuffers[i].capacity() >= bytes) {
+			if (mBuffers[best].capacity() < bytes || mBuffers[i].capacity() < mBuffers[best].capacity())
+				best = i;
+		} else if (mBuffers[best].capacity() < bytes && mBuffers[i].capacity() > mBuffers[best].capacity())
+			best = i;
+	}
+
+	// All buffers are busy; add a new one
+	if (best < 0) {
+		best = mBuffers.size;
+		mBuffers.add (new MPIBuffer ());
+		mpRequests = (MPI_Request*) realloc (mpRequests, mBuffers.size*sizeof(MPI_Request));
+		mpBusy = (bool*) realloc (mpBusy, mBuffers.size*sizeof(bool));
+		mpBytes = (int*) realloc (mpBytes, mBuffers.size*sizeof(int));
+		mpWaited = (bool*) realloc (mpWaited, mBuffers.size*sizeof(bool));
+		mpWaited[best] = false;
+		mIndices.make (mBuffers.size);
+		mStatuses.make (mBuffers.size);
+	}
+
+	mBuffers[best].reserve (bytes);
+	mpRequests[best] = MPI_REQUEST_NULL;
+	mpBusy[best] = true;
+	mpBytes[best] = bytes;
+	return best;
+}
+
+int MPISendPool::recycle () {
+	MPILock lock (mMutex);
+	return recycleLocked ();
+}
+
+int MPISendPool::recycleLocked () {
+	// Completed requests are set to MPI_REQUEST_NULL, and their
+	// indices are returned
+	int count = 0;
+	if (mBuffers.size)
+		MPI_Testsome (mBuffers.size, mpRequests, &count, mIndices.data, mStatuses.data);
+	for (int i=0; i<count; i++)
+		mpBusy[mIndices[i]] = false;
+
+	int pending = 0;
+	for (int i=0; i<mBuffers.size; i++)
+		if (mpBusy[i])
+			pending++;
+	return pending;
+}
+
+void MPISendPool::waitSome () {
+	// Take the pending requests out
+	PackArray<int> slots (mBuffers.size);
+	PackArray<MPI_Request> requests (mBuffers.size);
+	int n = 0;
+	for (int i=0; i<mBuffers.size; i++)
+		if (mpRequests[i] != MPI_REQUEST_NULL) {
+			slots[n] = i;
+			requests[n++] = mpRequests[i];
+			mpRequests[i] = MPI_REQUEST_NULL;
+			mpWaited[i] = true;
+		}
+
+	mMutex.unlock ();
+	if (n) {
+		int count;
+		PackArray<int> indices (n);
+		MPI_Waitsome (n, requests.data, &count, indices.data, MPI_STATUSES_IGNORE);
+	} else
+		sched_yield (); // Another thread waits for all the pending sends
+	mMutex.lock ();
+
+	// Put the requests back; the completed ones are MPI_REQUEST_NULL
+	for (int i=0; i<n; i++) {
+		mpRequests[slots[i]] = requests[i];
+		mpWaited[slots[i]] = false;
+		if (requests[i] == MPI_REQUEST_NULL)
+			mpBusy[slots[i]] = false;
+	}
+}
+
+void MPISendPool::flush () {
+	MPILock lock (mMutex);
+	while (true) {
+		if (mBuffers.size)
+			MPI_Waitall (mBuffers.size, mpRequests, mStatuses.data);
+
+		// The requests taken out by a waiting thread are done when
+		// it puts them back
+		bool waited = false;
+		for (int i=0; i<mBuffers.size; i++)
+			if (mpWaited[i])
+				waited = true;
+			else
+				mpBusy[i] = false;
+		if (!waited)
+			break;
+
+		mMutex.unlock ();
+		sched_yield ();
+		mMutex.lock ();
+	}
+}
+
+int MPISendPool::capacity () {
+	MPILock lock (mMutex);
+	int result = 0;
+	for (int i=0; i<mBuffers.size; i++)
+		result += mBuffers[i].capacity();
+	return result;
+}
+
+int MPISendPool::busyBytes () const {
+	int result = 0;
+	for (int i=0; i<mBuffers.size; i++)
+		if (mpBusy[i])
+			result += mpBytes[i];
+	return result;
 }
 
 
@@ -71,79 +422,521 @@ void MPIRequest::complete () {
 //                  |   | |     _|_ \___/ \__/ | | | | | |                  //
 //////////////////////////////////////////////////////////////////////////////
 
-void MPIComm::send (void* buffer, int len, MPI_Datatype datatype, int receiver) {
-	MPI_Send (buffer, len, datatype, receiver, 99, mCommTag);
+MPIComm::~MPIComm () {
+	delete mpNode;
+	delete mpLeaders;
+	if (mOwned)
+		MPI_Comm_free (&mCommTag);
+}
+
+void MPIComm::send (void* buffer, int len, MPI_Datatype datatype, int receiver, int tag) {
+	MPIPROF_SITE;
+	MPI_Send (buffer, len, datatype, receiver, tag, mCommTag);
 }
 
-void MPIComm::send (const String& buffer, int target) {
+void MPIComm::send (const String& buffer, int target, int tag) {
+	MPIPROF_SITE;
 	// Use the more generic method
-	send (buffer.getbuffer(), buffer.len, MPI_CHAR, target);
+	send (buffer.getbuffer(), buffer.len, MPI_CHAR, target, tag);
 }
 
-void MPIComm::nbSend (void* buffer, int len, MPI_Datatype datatype, int target) {
-	MPI_Request request;
-	int errcode;
-	if ((errcode=MPI_Ibsend (buffer, len, datatype, target, 99, mCommTag, &request)) != MPI_SUCCESS)
-		throw mpi_error (format ("Error in MPIComm::nbSend(,,,): %s\n",
-								 (CONSTR) mpi().error(errcode)));
-	MPI_Wait (&request, &mMPI.mMPIStatus);
+void MPIComm::nbSend (void* buffer, int len, MPI_Datatype datatype, int target, int tag) {
+	MPIPROF_SITE;
+	// The message is copied into a pool buffer; it can be received
+	// with any datatype of the same type signature
+	mMPI.sendPool().send (buffer, len, datatype, target, tag, mCommTag);
 }
 
-void MPIComm::nbSend (const String& buffer, int target) {
-	MPI_Request request;
-	MPI_Ibsend (buffer.getbuffer(), buffer.len, MPI_CHAR, target, 99, mCommTag, &request);
-	MPI_Wait (&request, &mMPI.mMPIStatus);
+void MPIComm::nbSend (const String& buffer, int target, int tag) {
+	MPIPROF_SITE;
+	nbSend (buffer.getbuffer(), buffer.len, MPI_CHAR, target, tag);
 }
 
-int MPIComm::recv (void* buffer, int maxlen, MPI_Datatype datatype, int source) {
+int MPIComm::recv (void* buffer, int maxlen, MPI_Datatype datatype, int source, int tag,
+				   MPI_Status* status) {
+	MPIPROF_SITE;
+	MPI_Status local;
+	status = mMPI.statusOf (status, local);
 	int errcode;
-	if ((errcode=MPI_Recv (buffer, maxlen, datatype, source, 99, mCommTag, & mMPI.mMPIStatus)) != MPI_SUCCESS)
+	if ((errcode=MPI_Recv (buffer, maxlen, datatype, source, tag, mCommTag, status)) != MPI_SUCCESS)
 		throw mpi_error (format ("Error in MPIComm::recv(,,,): %s\n",
 								 (CONSTR) mpi().error(errcode)));
 
 	// Always get the length info. I'm not sure about how much
 	// overhead this makes. Might be really small.
 	int len;
-	MPI_Get_count (&mMPI.mMPIStatus, datatype, &len);
+	MPI_Get_count (status, datatype, &len);
 	return len;
 }
 
-void MPIComm::recv (String& buffer, int maxlen, int source) {
-	buffer.ensure (maxlen+1);
-
-	// Use the more generic one to actually receive it
-	int len = recv (buffer.getbuffer(), maxlen, MPI_CHAR, source);
+void MPIComm::recv (String& buffer, int maxlen, int source, int tag, MPI_Status* status) {
+	MPIPROF_SITE;
+	Matched match;
+	MPI_Status local;
+	match.status = mMPI.statusOf (status, local);
+	int len = probeMatched (source, tag, MPI_CHAR, match);
+	if (len > maxlen) {
+		// Take the message off the queue before failing, as a plain
+		// receive would, so that it is not left matched but unreceived
+		PackArray<char> scratch (len);
+		recvMatched (scratch.data, len, MPI_CHAR, match);
+		throw mpi_error (format ("Error in MPIComm::recv(String&,,): message of %d bytes exceeds the maximum %d\n",
+								 len, maxlen));
+	}
+	buffer.ensure (len+1);
+	recvMatched (buffer.getbuffer(), len, MPI_CHAR, match);
 
 	// Ensure string termination (there is always room for one \x00 in
 	// MagiClib Strings).
 	buffer.getbuffer()[buffer.len=len] = 0;
 }
 
-MPIRequest* MPIComm::nbRecv (String& buffer, int maxlen, int source) {
+void MPIComm::send (const MPIBuffer& buffer, int target, int tag) {
+	MPIPROF_SITE;
+	int errcode;
+	if ((errcode=MPI_Send (const_cast<char*>(buffer.data()), buffer.length(), MPI_BYTE,
+						   target, tag, mCommTag)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIComm::send(MPIBuffer&,): %s\n",
+								 (CONSTR) mpi().error(errcode)));
+}
+
+int MPIComm::recv (MPIBuffer& buffer, int source, int tag, MPI_Status* status) {
+	MPIPROF_SITE;
+	Matched match;
+	MPI_Status local;
+	match.status = mMPI.statusOf (status, local);
+	int len = probeMatched (source, tag, MPI_BYTE, match);
+	buffer.reserve (len);
+	recvMatched (buffer.data(), len, MPI_BYTE, match);
+	return buffer.mLength = len;
+}
+
+int MPIComm::probeMatched (int source, int tag, MPI_Datatype datatype, Matched& match) {
+	MPIPROF_SITE;
+	int errcode;
+#if MPI_VERSION >= 3
+	errcode = MPI_Mprobe (source, tag, mCommTag, &match.message, match.status);
+#else
+	errcode = MPI_Probe (source, tag, mCommTag, match.status);
+#endif
+	if (errcode != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIComm::probeMatched(): %s\n",
+								 (CONSTR) mpi().error(errcode)));
+
+	int len;
+	MPI_Get_count (match.status, datatype, &len);
+	return len;
+}
+
+void MPIComm::recvMatched (void* buffer, int len, MPI_Datatype datatype, Matched& match) {
+	MPIPROF_SITE;
+	int errcode;
+#if MPI_VERSION >= 3
+	errcode = MPI_Mrecv (buffer, len, datatype, &match.message, match.status);
+#else
+	// Without matched probes, receive the sender and tag that were
+	// found; messages between two processes do not overtake each
+	// other. Another thread may still take the message first.
+	errcode = MPI_Recv (buffer, len, datatype, match.status->MPI_SOURCE,
+						match.status->MPI_TAG, mCommTag, match.status);
+#endif
+	if (errcode != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIComm::recvMatched(): %s\n",
+								 (CONSTR) mpi().error(errcode)));
+}
+
+MPIRequest* MPIComm::nbRecv (String& buffer, int maxlen, int source, int tag) {
+	MPIPROF_SITE;
 	buffer.ensure (maxlen+1);
 
 	MPIRequest* request = new MPIRequest (*this, buffer);
-	MPI_Irecv(buffer.getbuffer(), maxlen, MPI_CHAR, source, 99,
+	MPI_Irecv(buffer.getbuffer(), maxlen, MPI_CHAR, source, tag,
 			 mCommTag, &request->mRequest);
 
 	return request;
 }
 
-String MPIComm::recv (int maxlen, int sender) {
+void MPIComm::nbRecv (MPIRequest& request, void* buffer, int maxlen,
+					  MPI_Datatype datatype, int source, int tag) {
+	MPIPROF_SITE;
+	int errcode;
+	if ((errcode=MPI_Irecv (buffer, maxlen, datatype, source, tag,
+							mCommTag, &request.mRequest)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIComm::nbRecv(,,,,): %s\n",
+								 (CONSTR) mpi().error(errcode)));
+}
+
+int MPIComm::sendRecv (const void* sendBuffer, int sendCount, int receiver,
+					   void* recvBuffer, int maxlen, int source, MPI_Datatype datatype, int tag,
+					   MPI_Status* status) {
+	MPIPROF_SITE;
+	MPI_Status local;
+	status = mMPI.statusOf (status, local);
+	int errcode;
+	if ((errcode=MPI_Sendrecv (const_cast<void*>(sendBuffer), sendCount, datatype, receiver, tag,
+							   recvBuffer, maxlen, datatype, source, tag,
+							   mCommTag, status)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIComm::sendRecv(): %s\n",
+								 (CONSTR) mpi().error(errcode)));
+
+	int len;
+	MPI_Get_count (status, datatype, &len);
+	return len;
+}
+
+String MPIComm::recv (int maxlen, int sender, int tag) {
+	MPIPROF_SITE;
 	String result;
-	recv (result, maxlen, sender);
+	recv (result, maxlen, sender, tag);
 	return result;
 }
 
+bool MPIComm::iprobe (int source, int tag, MPI_Status* status) {
+	MPIPROF_SITE;
+	int flag;
+	MPI_Status local;
+	MPI_Iprobe (source, tag, mCommTag, &flag, mMPI.statusOf (status, local));
+	return flag;
+}
+
+int MPIComm::allocateTag () {
+	MPILock lock (mTagMutex);
+
+	// Every MPI implementation supports at least the tags up to 32767
+	if (mNextTag > 32767)
+		throw mpi_error ("Error in MPIComm::allocateTag(): out of message tags\n");
+	return mNextTag++;
+}
+
 void MPIComm::allReduce (const void* sendBuffer, void* recvBuffer, int count, const MPI_Datatype& datatype, const MPI_Op& op) {
+	MPIPROF_SITE;
 	MPI_Allreduce (const_cast<void*>(sendBuffer), recvBuffer,
 				   count, datatype, op, mCommTag);
 }
 
+void MPIComm::reduceScatter (const void* sendBuffer, void* recvBuffer, const int* recvCounts,
+							 const MPI_Datatype& datatype, const MPI_Op& op) {
+	MPIPROF_SITE;
+	int errcode;
+	if ((errcode=MPI_Reduce_scatter (const_cast<void*>(sendBuffer), recvBuffer,
+									 const_cast<int*>(recvCounts), datatype, op, mCommTag)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIComm::reduceScatter(): %s\n",
+								 (CONSTR) mpi().error(errcode)));
+}
+
+void MPIComm::scan (const void* sendBuffer, void* recvBuffer, int count, const MPI_Datatype& datatype, const MPI_Op& op) {
+	MPIPROF_SITE;
+	int errcode;
+	if ((errcode=MPI_Scan (const_cast<void*>(sendBuffer), recvBuffer, count, datatype,
+						   op, mCommTag)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIComm::scan(): %s\n",
+								 (CONSTR) mpi().error(errcode)));
+}
+
+void MPIComm::reduce (const void* sendBuffer, void* recvBuffer, int count, const MPI_Datatype& datatype, const MPI_Op& op, int root) {
+	MPIPROF_SITE;
+	int errcode;
+	if ((errcode=MPI_Reduce (const_cast<void*>(sendBuffer), recvBuffer, count, datatype,
+							 op, root, mCommTag)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIComm::reduce(): %s\n",
+								 (CONSTR) mpi().error(errcode)));
+}
+
+void MPIComm::allGather (const void* sendBuffer, void* recvBuffer, int count, const MPI_Datatype& datatype) {
+	MPIPROF_SITE;
+	int errcode;
+	if ((errcode=MPI_Allgather (const_cast<void*>(sendBuffer), count, datatype,
+								recvBuffer, count, datatype, mCommTag)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIComm::allGather(): %s\n",
+								 (CONSTR) mpi().error(errcode)));
+}
+
+void MPIComm::allGatherv (const void* sendBuffer, int sendCount, void* recvBuffer,
+						  const int* counts, const int* displs, const MPI_Datatype& datatype) {
+	MPIPROF_SITE;
+	int errcode;
+	if ((errcode=MPI_Allgatherv (const_cast<void*>(sendBuffer), sendCount, datatype,
+								 recvBuffer, const_cast<int*>(counts), const_cast<int*>(displs),
+								 datatype, mCommTag)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIComm::allGatherv(): %s\n",
+								 (CONSTR) mpi().error(errcode)));
+}
+
+void MPIComm::gather (const void* sendBuffer, void* recvBuffer, int count, const MPI_Datatype& datatype, int root) {
+	MPIPROF_SITE;
+	int errcode;
+	if ((errcode=MPI_Gather (const_cast<void*>(sendBuffer), count, datatype,
+							 recvBuffer, count, datatype, root, mCommTag)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIComm::gather(): %s\n",
+								 (CONSTR) mpi().error(errcode)));
+}
+
+void MPIComm::bcast (void* buffer, int count, const MPI_Datatype& datatype, int root) {
+	MPIPROF_SITE;
+	int errcode;
+	if ((errcode=MPI_Bcast (buffer, count, datatype, root, mCommTag)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIComm::bcast(): %s\n",
+								 (CONSTR) mpi().error(errcode)));
+}
+
+void MPIComm::gatherv (const void* sendBuffer, int sendCount, void* recvBuffer,
+					   const int* counts, const int* displs, const MPI_Datatype& datatype, int root) {
+	MPIPROF_SITE;
+	int errcode;
+	if ((errcode=MPI_Gatherv (const_cast<void*>(sendBuffer), sendCount, datatype,
+							  recvBuffer, const_cast<int*>(counts), const_cast<int*>(displs),
+							  datatype, root, mCommTag)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIComm::gatherv(): %s\n",
+								 (CONSTR) mpi().error(errcode)));
+}
+
+void MPIComm::scatter (const void* sendBuffer, void* recvBuffer, int count, const MPI_Datatype& datatype, int root) {
+	MPIPROF_SITE;
+	int errcode;
+	if ((errcode=MPI_Scatter (const_cast<void*>(sendBuffer), count, datatype,
+							  recvBuffer, count, datatype, root, mCommTag)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIComm::scatter(): %s\n",
+								 (CONSTR) mpi().error(errcode)));
+}
+
+void MPIComm::scatterv (const void* sendBuffer, const int* counts, const int* displs,
+						void* recvBuffer, int recvCount, const MPI_Datatype& datatype, int root) {
+	MPIPROF_SITE;
+	int errcode;
+	if ((errcode=MPI_Scatterv (const_cast<void*>(sendBuffer), const_cast<int*>(counts),
+							   const_cast<int*>(displs), datatype,
+							   recvBuffer, recvCount, datatype, root, mCommTag)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIComm::scatterv(): %s\n",
+								 (CONSTR) mpi().error(errcode)));
+}
+
+void MPIComm::allToAll (const void* sendBuffer, void* recvBuffer, int count, const MPI_Datatype& datatype) {
+	MPIPROF_SITE;
+	int errcode;
+	if ((errcode=MPI_Alltoall (const_cast<void*>(sendBuffer), count, datatype,
+							   recvBuffer, count, datatype, mCommTag)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIComm::allToAll(): %s\n",
+								 (CONSTR) mpi().error(errcode)));
+}
+
+void MPIComm::allToAllv (const void* sendBuffer, const int* sendCounts, const int* sendDispls,
+						 void* recvBuffer, const int* recvCounts, const int* recvDispls,
+						 const MPI_Datatype& datatype) {
+	MPIPROF_SITE;
+	int errcode;
+	if ((errcode=MPI_Alltoallv (const_cast<void*>(sendBuffer), const_cast<int*>(sendCounts),
+								const_cast<int*>(sendDispls), datatype,
+								recvBuffer, const_cast<int*>(recvCounts),
+								const_cast<int*>(recvDispls), datatype, mCommTag)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIComm::allToAllv(): %s\n",
+								 (CONSTR) mpi().error(errcode)));
+}
+
 void MPIComm::barrier () {
+	MPIPROF_SITE;
 	MPI_Barrier (mCommTag);
 }
 
+void MPIComm::iBarrier (MPIRequest& request) {
+	MPIPROF_SITE;
+#if MPI_VERSION >= 3
+	int errcode;
+	if ((errcode=MPI_Ibarrier (mCommTag, &request.mRequest)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIComm::iBarrier(): %s\n",
+								 (CONSTR) mpi().error(errcode)));
+#else
+	barrier ();
+	request.mRequest = MPI_REQUEST_NULL;
+#endif
+}
+
+void MPIComm::iBcast (MPIRequest& request, void* buffer, int count,
+					  const MPI_Datatype& datatype, int root) {
+	MPIPROF_SITE;
+#if MPI_VERSION >= 3
+	int errcode;
+	if ((errcode=MPI_Ibcast (buffer, count, datatype, root, mCommTag,
+							 &request.mRequest)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIComm::iBcast(): %s\n",
+								 (CONSTR) mpi().error(errcode)));
+#else
+	bcast (buffer, count, datatype, root);
+	request.mRequest = MPI_REQUEST_NULL;
+#endif
+}
+
+void MPIComm::iAllReduce (MPIRequest& request, const void* sendBuffer, void* recvBuffer,
+						  int count, const MPI_Datatype& datatype, const MPI_Op& op) {
+	MPIPROF_SITE;
+#if MPI_VERSION >= 3
+	int errcode;
+	if ((errcode=MPI_Iallreduce (sendBuffer, recvBuffer, count, datatype, op, mCommTag,
+								 &request.mRequest)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIComm::iAllReduce(): %s\n",
+								 (CONSTR) mpi().error(errcode)));
+#else
+	allReduce (sendBuffer, recvBuffer, count, datatype, op);
+	request.mRequest = MPI_REQUEST_NULL;
+#endif
+}
+
+void MPIComm::iAllGather (MPIRequest& request, const void* sendBuffer, void* recvBuffer,
+						  int count, const MPI_Datatype& datatype) {
+	MPIPROF_SITE;
+#if MPI_VERSION >= 3
+	int errcode;
+	if ((errcode=MPI_Iallgather (sendBuffer, count, datatype, recvBuffer, count, datatype,
+								 mCommTag, &request.mRequest)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIComm::iAllGather(): %s\n",
+								 (CONSTR) mpi().error(errcode)));
+#else
+	allGather (sendBuffer, recvBuffer, count, datatype);
+	request.mRequest = MPI_REQUEST_NULL;
+#endif
+}
+
+MPICollective* MPIComm::barrierInit () {
+	MPIPROF_SITE;
+	return new MPICollective (*this, MPICollective::cBarrier, NULL, NULL, 0, MPI_DATATYPE_NULL, MPI_OP_NULL, 0);
+}
+
+MPICollective* MPIComm::bcastInit (void* buffer, int count, const MPI_Datatype& datatype, int root) {
+	MPIPROF_SITE;
+	return new MPICollective (*this, MPICollective::cBcast, NULL, buffer, count, datatype, MPI_OP_NULL, root);
+}
+
+MPICollective* MPIComm::allReduceInit (const void* sendBuffer, void* recvBuffer, int count,
+									   const MPI_Datatype& datatype, const MPI_Op& op) {
+	MPIPROF_SITE;
+	return new MPICollective (*this, MPICollective::cAllReduce, sendBuffer, recvBuffer, count, datatype, op, 0);
+}
+
+MPICollective* MPIComm::allGatherInit (const void* sendBuffer, void* recvBuffer, int count,
+									   const MPI_Datatype& datatype) {
+	MPIPROF_SITE;
+	return new MPICollective (*this, MPICollective::cAllGather, sendBuffer, recvBuffer, count, datatype, MPI_OP_NULL, 0);
+}
+
+MPIComm* MPIComm::split (int color, int key) {
+	MPIPROF_SITE;
+	MPI_Comm newcomm;
+	int errcode;
+	if ((errcode=MPI_Comm_split (mCommTag, color, key, &newcomm)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIComm::split(): %s\n",
+								 (CONSTR) mpi().error(errcode)));
+	if (newcomm == MPI_COMM_NULL)
+		return NULL;
+	return new MPIComm (mMPI, newcomm, true);
+}
+
+MPIComm* MPIComm::splitShared (int key) {
+	MPIPROF_SITE;
+#if MPI_VERSION >= 3
+	MPI_Comm newcomm;
+	int errcode;
+	if ((errcode=MPI_Comm_split_type (mCommTag, MPI_COMM_TYPE_SHARED, key,
+									  MPI_INFO_NULL, &newcomm)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIComm::splitShared(): %s\n",
+								 (CONSTR) mpi().error(errcode)));
+	return new MPIComm (mMPI, newcomm, true);
+#else
+	// Without shared memory communicators, group the processes by the
+	// names of their hosts.
+	char name [MPI_MAX_PROCESSOR_NAME];
+	int namelen;
+	memset (name, 0, MPI_MAX_PROCESSOR_NAME);
+	MPI_Get_processor_name (name, &namelen);
+	PackArray<char> names (MPI_MAX_PROCESSOR_NAME*size());
+	allGather (name, names.data, MPI_MAX_PROCESSOR_NAME, MPI_CHAR);
+
+	// The color is the lowest rank on the same host
+	int color = 0;
+	while (strcmp (names.data+color*MPI_MAX_PROCESSOR_NAME, name))
+		color++;
+	return split (color, key);
+#endif
+}
+
+void MPIComm::makeHierarchy () {
+	if (mpNode)
+		return;
+
+	int rank = getRank ();
+	mpNode = splitShared (rank);
+	int nodeRank = mpNode->getRank ();
+	mpLeaders = split (nodeRank==0? 0 : MPI_UNDEFINED, rank);
+
+	// Tell everybody who is the leader of everybody
+	int mine[2] = {mpLeaders? mpLeaders->getRank() : 0, nodeRank};
+	mpNode->bcast (mine, 1, MPI_INT, 0);
+	PackArray<int> all (2*size());
+	allGather (mine, all.data, 2, MPI_INT);
+	mLeaderOf.make (size());
+	mNodeRankOf.make (size());
+	mNodes = 0;
+	for (int i=0; i<size(); i++) {
+		mLeaderOf[i] = all[2*i];
+		mNodeRankOf[i] = all[2*i+1];
+		if (mNodeRankOf[i] == 0)
+			mNodes++;
+	}
+}
+
+MPIComm& MPIComm::nodeComm () {
+	makeHierarchy ();
+	return *mpNode;
+}
+
+MPIComm* MPIComm::leaderComm () {
+	makeHierarchy ();
+	return mpLeaders;
+}
+
+int MPIComm::nodes () {
+	makeHierarchy ();
+	return mNodes;
+}
+
+void MPIComm::hierarchicalAllReduce (const void* sendBuffer, void* recvBuffer, int count,
+									 const MPI_Datatype& datatype, const MPI_Op& op) {
+	MPIPROF_SITE;
+	makeHierarchy ();
+
+	// The processes of a node need not have consecutive ranks, so
+	// the order of the reduction changes
+	int commutative = 1;
+#if MPI_VERSION > 2 || (MPI_VERSION == 2 && MPI_SUBVERSION >= 2)
+	MPI_Op_commutative (op, &commutative);
+#endif
+	if (mNodes == 1 || mNodes == size() || !commutative) {
+		allReduce (sendBuffer, recvBuffer, count, datatype, op);
+		return;
+	}
+
+	mpNode->reduce (sendBuffer, recvBuffer, count, datatype, op, 0);
+	if (mpLeaders)
+		mpLeaders->allReduce (MPI_IN_PLACE, recvBuffer, count, datatype, op);
+	mpNode->bcast (recvBuffer, count, datatype, 0);
+}
+
+void MPIComm::hierarchicalBcast (void* buffer, int count, const MPI_Datatype& datatype, int root) {
+	MPIPROF_SITE;
+	makeHierarchy ();
+	if (mNodes == 1 || mNodes == size()) {
+		bcast (buffer, count, datatype, root);
+		return;
+	}
+
+	int rootLeader = mLeaderOf[root];
+	bool rootNode = mLeaderOf[getRank()] == rootLeader;
+	if (rootNode)
+		mpNode->bcast (buffer, count, datatype, mNodeRankOf[root]);
+	if (mpLeaders)
+		mpLeaders->bcast (buffer, count, datatype, rootLeader);
+	if (!rootNode)
+		mpNode->bcast (buffer, count, datatype, 0);
+}
+
 int MPIComm::getRank () const {
 	int myrank;
 	MPI_Comm_rank (mCommTag, &myrank);
@@ -176,3 +969,99 @@ void MPIVector::make (int count, int blocklength, int stride, MPI_Datatype oldty
 	MPI_Type_commit (&mDatatype);
 }
 
+
+
+//////////////////////////////////////////////////////////////////////////////
+//               |   | ----  --- -----  o |                                 //
+//               |\ /| |   )  |  |        |  ___                            //
+//               | V | |---   |  |---  |  | /   )                           //
+//               | | | |      |  |     |  | |---                            //
+//               |   | |     _|_ |     |  |  \__                            //
+//////////////////////////////////////////////////////////////////////////////
+
+MPIFile::MPIFile (MPIComm& comm, const char* filename, int amode)
+		: mComm (comm), mOpen (false) {
+	int errcode;
+	if ((errcode=MPI_File_open (comm.getCommTag(), (char*) filename, amode,
+								MPI_INFO_NULL, &mFile)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIFile::MPIFile() while opening '%s': %s\n",
+								 filename, (CONSTR) comm.mpi().error(errcode)));
+	mOpen = true;
+}
+
+MPIFile::~MPIFile () {
+	if (mOpen)
+		MPI_File_close (&mFile);
+}
+
+void MPIFile::close () {
+	if (mOpen) {
+		MPI_File_close (&mFile);
+		mOpen = false;
+	}
+}
+
+void MPIFile::writeAt (MPI_Offset offset, const void* buffer, int count, MPI_Datatype datatype) {
+	MPI_Status local;
+	MPI_Status* status = mComm.mpi().statusOf (NULL, local);
+	int errcode;
+	if ((errcode=MPI_File_write_at (mFile, offset, const_cast<void*>(buffer), count, datatype,
+									status)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIFile::writeAt(): %s\n",
+								 (CONSTR) mComm.mpi().error(errcode)));
+}
+
+void MPIFile::writeAtAll (MPI_Offset offset, const void* buffer, int count, MPI_Datatype datatype) {
+	MPI_Status local;
+	MPI_Status* status = mComm.mpi().statusOf (NULL, local);
+	int errcode;
+	if ((errcode=MPI_File_write_at_all (mFile, offset, const_cast<void*>(buffer), count, datatype,
+										status)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIFile::writeAtAll(): %s\n",
+								 (CONSTR) mComm.mpi().error(errcode)));
+}
+
+int MPIFile::readAt (MPI_Offset offset, void* buffer, int count, MPI_Datatype datatype) {
+	MPI_Status local;
+	MPI_Status* status = mComm.mpi().statusOf (NULL, local);
+	int errcode;
+	if ((errcode=MPI_File_read_at (mFile, offset, buffer, count, datatype,
+								   status)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIFile::readAt(): %s\n",
+								 (CONSTR) mComm.mpi().error(errcode)));
+
+	int len;
+	MPI_Get_count (status, datatype, &len);
+	return len;
+}
+
+int MPIFile::readAtAll (MPI_Offset offset, void* buffer, int count, MPI_Datatype datatype) {
+	MPI_Status local;
+	MPI_Status* status = mComm.mpi().statusOf (NULL, local);
+	int errcode;
+	if ((errcode=MPI_File_read_at_all (mFile, offset, buffer, count, datatype,
+									   status)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIFile::readAtAll(): %s\n",
+								 (CONSTR) mComm.mpi().error(errcode)));
+
+	int len;
+	MPI_Get_count (status, datatype, &len);
+	return len;
+}
+
+MPI_Offset MPIFile::size () const {
+	MPI_Offset result;
+	MPI_File_get_size (mFile, &result);
+	return result;
+}
+
+void MPIFile::setSize (MPI_Offset size) {
+	int errcode;
+	if ((errcode=MPI_File_set_size (mFile, size)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIFile::setSize(): %s\n",
+								 (CONSTR) mComm.mpi().error(errcode)));
+}
+
+void MPIFile::sync () {
+	MPI_File_sync (mFile);
+}
@@ -19,14 +19,21 @@
 
 #include <magic/object.h>
 #include <magic/cstring.h>
+#include <magic/packarray.h>
 
 #include <mpi.h>
+#include <pthread.h>
 
 class MPIInstance;
 class MPIRequest;
+class MPICollective;
+class MPIBuffer;
+class MPISendPool;
 class MPIComm;
+class MPIChannel;
 class MPIDatatype;
 class MPIVector;
+class MPIFile;
 
 /** A very simple exception class that passes an error message. For
  *  some reason my standard Exception class didn't work with
@@ -51,6 +58,115 @@ typedef int MPITAGTYPE;
 typedef _comm* MPITAGTYPE;
 #endif
 
+/** A mutual exclusion lock for the shared state of the library, so
+ *  that several threads can communicate at the same time.
+ **/
+class MPIMutex {
+  public:
+					MPIMutex		() {pthread_mutex_init (&mMutex, NULL);}
+					~MPIMutex		() {pthread_mutex_destroy (&mMutex);}
+
+	void			lock			() {pthread_mutex_lock (&mMutex);}
+	void			unlock			() {pthread_mutex_unlock (&mMutex);}
+
+  private:
+	pthread_mutex_t	mMutex;
+};
+
+/** Keeps a mutex locked for the lifetime of the object. */
+class MPILock {
+  public:
+					MPILock			(MPIMutex& mutex) : mMutex (mutex) {mMutex.lock ();}
+					~MPILock		() {mMutex.unlock ();}
+
+  private:
+	MPIMutex&		mMutex;
+};
+
+/** The MPI datatype of a basic C++ type, for the typed collectives
+ *  of MPIComm: MPIType<double>::type() is MPI_DOUBLE. Using a type
+ *  without a datatype is a compile error.
+ **/
+template <class T>
+class MPIType {
+};
+
+#define MPITYPE(T,datatype) \
+template <> class MPIType<T> { \
+  public: \
+	static MPI_Datatype	type	() {return datatype;} \
+}
+
+MPITYPE (char,				MPI_CHAR);
+MPITYPE (signed char,		MPI_SIGNED_CHAR);
+MPITYPE (unsigned char,		MPI_UNSIGNED_CHAR);
+MPITYPE (short,				MPI_SHORT);
+MPITYPE (unsigned short,	MPI_UNSIGNED_SHORT);
+MPITYPE (int,				MPI_INT);
+MPITYPE (unsigned int,		MPI_UNSIGNED);
+MPITYPE (long,				MPI_LONG);
+MPITYPE (unsigned long,		MPI_UNSIGNED_LONG);
+MPITYPE (float,				MPI_FLOAT);
+MPITYPE (double,			MPI_DOUBLE);
+MPITYPE (long double,		MPI_LONG_DOUBLE);
+
+#undef MPITYPE
+
+/** A reduction operation defined by a C++ functor, for reducing a
+ *  struct of several values, such as different diagnostics, in a
+ *  single collective.
+ *
+ *  The functor combines an item into another, like the MPI
+ *  operations: void operator() (const T& in, T& inout) const. It must
+ *  be stateless and default-constructible: MPI gives the operation no
+ *  context, so a new functor is constructed for every call, and the
+ *  functor given to the typed collectives only selects its type. The
+ *  items are transmitted as raw bytes, so T must be a plain struct
+ *  without pointers or virtual methods.
+ *
+ *  The MPI operation and datatype are created at the first use, and
+ *  then cached for the rest of the program.
+ *
+ *  @param commutative Whether the functor is commutative; MPI may
+ *  then combine the items in any order.
+ **/
+template <class T, class F, bool commutative=true>
+class MPIReduction {
+  public:
+	/** Returns the MPI operation. */
+	static MPI_Op		op		() {init (); return sOp;}
+
+	/** Returns the MPI datatype of the items. */
+	static MPI_Datatype	type	() {init (); return sType;}
+
+  private:
+	static void			init	() {
+		MPILock lock (sMutex);
+		if (sOp != MPI_OP_NULL)
+			return;
+		MPI_Type_contiguous (sizeof(T), MPI_BYTE, &sType);
+		MPI_Type_commit (&sType);
+		MPI_Op_create (apply, commutative, &sOp);
+	}
+
+	static void			apply	(void* in, void* inout, int* len, MPI_Datatype*) {
+		F functor;
+		for (int i=0; i<*len; i++)
+			functor (((const T*) in)[i], ((T*) inout)[i]);
+	}
+
+	static MPI_Op		sOp;
+	static MPI_Datatype	sType;
+	static MPIMutex		sMutex;
+};
+
+template <class T, class F, bool commutative>
+MPI_Op MPIReduction<T,F,commutative>::sOp = MPI_OP_NULL;
+template <class T, class F, bool commutative>
+MPI_Datatype MPIReduction<T,F,commutative>::sType = MPI_DATATYPE_NULL;
+template <class T, class F, bool commutative>
+MPIMutex MPIReduction<T,F,commutative>::sMutex;
+
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -62,12 +178,23 @@ typedef _comm* MPITAGTYPE;
 ///////////////////////////////////////////////////////////////////////////////
 
 /** MPI process data; a singleton (although that is not explicit).
+ *
+ *  Several threads may communicate at the same time if the thread
+ *  level MPI_THREAD_MULTIPLE is requested and provided. See MPIComm
+ *  for what is then safe.
  *
  *  Design Patterns: Singleton.
  **/
 class MPIInstance : public Object {
   public:
-						MPIInstance		(int& argc, char**& argv);
+	/** Initializes MPI.
+	 *
+	 *  @param threadLevel The requested level of thread support, one
+	 *  of MPI_THREAD_SINGLE, MPI_THREAD_FUNNELED,
+	 *  MPI_THREAD_SERIALIZED and MPI_THREAD_MULTIPLE. The library may
+	 *  provide a different level; check threadLevel().
+	 **/
+						MPIInstance		(int& argc, char**& argv, int threadLevel=MPI_THREAD_SINGLE);
 						~MPIInstance	();
 
 	/** Returns a time stamp. */
@@ -76,23 +203,47 @@ class MPIInstance : public Object {
 	/** Returns the MPI_COMM_WORLD-communicator. */
 	MPIComm&			world			() {return *mpWorld;}
 
-	/** Returns MPI status data block. */
+	/** Returns the level of thread support provided by MPI. */
+	int					threadLevel		() const {return mThreadLevel;}
+
+	/** Returns the status of the last operation that was not given a
+	 *  status of its own. Not updated if the thread level is
+	 *  MPI_THREAD_MULTIPLE; the threads must then use the per-call
+	 *  status arguments instead.
+	 **/
 	const MPI_Status&	status			() const {return mMPIStatus;}
 
 	/** Returns an MPI error code to a string. */
 	String				error			(int errcode) const;
 
-	/** Initializes the buffer to the given length.
+	/** Returns the buffer pool of the non-blocking sends. */
+	MPISendPool&		sendPool		() {return *mpSendPool;}
+
+	/** Attaches a buffer of the given length for MPI_Bsend() and
+	 *  MPI_Ibsend() called directly. The non-blocking sends of
+	 *  MPIComm use the sendPool() instead.
 	 **/
 	void				initBuffer		(int len);
 	
   protected:
+	/** Returns the status to store the result of an operation in:
+	 *  the given one, or else the shared one, or else the local one
+	 *  if several threads may communicate at the same time.
+	 **/
+	MPI_Status*		statusOf		(MPI_Status* status, MPI_Status& local) {
+		return status? status : (mThreadLevel==MPI_THREAD_MULTIPLE)? &local : &mMPIStatus;
+	}
+
 	MPIComm*		mpWorld;
+	MPISendPool*	mpSendPool;
 	MPI_Status		mMPIStatus;
 	String			mBuffer;
+	bool			mBufferAttached;
+	int				mThreadLevel;
 
 	friend MPIComm;
 	friend MPIRequest;
+	friend MPIFile;
 };
 
 
@@ -117,7 +268,13 @@ class MPIRequest {
 	 *  in this buffer when it arrives.
 	 **/
 					MPIRequest		(MPIComm& comm, String& buff)
-							: mComm (comm), mBuffer (buff) {}
+							: mRequest (MPI_REQUEST_NULL), mComm (comm), mpBuffer (&buff) {}
+
+	/** Creates a request for a raw buffer. The request can be used
+	 *  again after it has been completed.
+	 **/
+					MPIRequest		(MPIComm& comm)
+							: mRequest (MPI_REQUEST_NULL), mComm (comm), mpBuffer (NULL) {}
 
 	/** Waits until the request has been completed. */
 	void			wait			();
@@ -126,10 +283,14 @@ class MPIRequest {
 	 *  it has, otherwise false.
 	 **/
 	bool			check			();
+
+	/** Returns the status of the completed request. */
+	const MPI_Status&	status		() const {return mStatus;}
 	
   protected:
 	MPI_Request		mRequest;
-	String&			mBuffer;
+	MPI_Status		mStatus;
+	String*			mpBuffer;	// NULL for raw buffers
 	MPIComm&		mComm;
 
 	void 			complete		();
@@ -137,6 +298,190 @@ class MPIRequest {
 	friend MPIComm;
 };
 
+/** A persistent collective operation, created with one of the
+ *  ...Init() methods of MPIComm.
+ *
+ *  The operation is set up once, with fixed buffers and arguments,
+ *  and can then be started any number of times with start(). Every
+ *  start is completed with wait() or check(), which must happen
+ *  before the next start, and before the object is destroyed.
+ *
+ *  Uses the persistent collectives of MPI-4, or of the Open MPI
+ *  extension, where available; otherwise every start() begins a
+ *  non-blocking collective with the arguments.
+ **/
+class MPICollective : public MPIRequest {
+  public:
+					~MPICollective	();
+
+	/** Starts the operation. Collective. */
+	void			start			();
+
+  protected:
+	enum Kind {cBarrier, cBcast, cAllReduce, cAllGather};
+
+					MPICollective	(MPIComm& comm, Kind kind, const void* sendBuffer, void* recvBuffer,
+									 int count, MPI_Datatype datatype, MPI_Op op, int root);
+
+	Kind			mKind;
+	const void*		mpSendBuffer;
+	void*			mpRecvBuffer;
+	int				mCount;
+	MPI_Datatype	mDatatype;
+	MPI_Op			mOp;
+	int				mRoot;
+
+	friend MPIComm;
+};
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//        |   | ----  --- ----         _   _                                //
+//        |\ /| |   )  |  |   )       /   /    ___                          //
+//        | V | |---   |  |---  |   | -+- -+- /   ) |/\                     //
+//        | | | |      |  |   ) |   |  |   |  |---  |                       //
+//        |   | |     _|_ |___   \__!  |   |   \__  |                       //
+//////////////////////////////////////////////////////////////////////////////
+
+/** A caller-owned, page-aligned message buffer for large messages.
+ *
+ *  The memory is allocated once and only reallocated when a larger
+ *  message arrives, so that the MPI library can keep it registered
+ *  between the transfers. Receiving with MPIComm::recv(MPIBuffer&,)
+ *  probes the size of the incoming message first, so there is no
+ *  maximum length to give and the data is not terminated or copied.
+ **/
+class MPIBuffer : public Object {
+  public:
+	/** Creates a buffer with room for the given number of bytes. */
+	explicit		MPIBuffer		(int capacity=0);
+					~MPIBuffer		();
+
+	char*			data			() {return mpData;}
+	const char*		data			() const {return mpData;}
+
+	/** Returns the length of the message in the buffer, in bytes. */
+	int				length			() const {return mLength;}
+
+	/** Returns the number of bytes allocated. */
+	int				capacity		() const {return mCapacity;}
+
+	/** Sets the length of the message to send. The contents of the
+	 *  buffer are not touched.
+	 **/
+	void			setLength		(int length);
+
+	/** Makes room for at least the given number of bytes. The
+	 *  contents are not preserved when the buffer grows.
+	 **/
+	void			reserve			(int capacity);
+
+  protected:
+	char*			mpData;
+	int				mCapacity;
+	int				mLength;
+
+	friend MPIComm;
+
+  private:
+	/** Not copyable: a copy would free the data a second time. Not
+	 *  defined.
+	 **/
+					MPIBuffer		(const MPIBuffer& other);
+	MPIBuffer&		operator=		(const MPIBuffer& other);
+};
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//         |   | ----  --- ----                |  ----                 |    //
+//         |\ /| |   )  |  (      ___    _     |  |   )  __    __   |       //
+//         | V | |---   |   ---  /   ) |/ \  __|  |---  /  \  /  \  |       //
+//         | | | |      |      ) |---  |   | (  |  |     |  | |  |  |       //
+//         |   | |     _|_ ___/   \__  |   |  \_|  |     \__/ \__/  |       //
+//////////////////////////////////////////////////////////////////////////////
+
+/** A pool of send buffers for the non-blocking sends.
+ *
+ *  MPIComm::nbSend() copies the message into a buffer of the pool and
+ *  starts the send, so the caller can reuse its own buffer at once.
+ *  A message of a contiguous datatype is copied as it is and sent with
+ *  its own datatype; other messages are packed with MPI_Pack(). The
+ *  pool buffers are recycled when their sends complete, which is
+ *  checked whenever a new buffer is needed. The buffers grow to the
+ *  sizes of the messages actually sent, and new buffers are added
+ *  when all the old ones are busy, so a send never fails for lack of
+ *  buffer space.
+ *
+ *  The pool is owned by the MPIInstance, which waits for all the
+ *  pending sends before finalizing MPI. All the methods are thread
+ *  safe.
+ **/
+class MPISendPool : public Object {
+  public:
+	/** Creates the pool.
+	 *
+	 *  @param maxBytes If nonzero, the total size of the pending
+	 *  messages is kept below this by waiting for the earlier sends
+	 *  to complete.
+	 **/
+					MPISendPool		(MPIInstance& mpi, int maxBytes=0);
+					~MPISendPool	();
+
+	/** Sets the limit of the total size of the pending messages; 0
+	 *  for no limit. A message larger than the limit is still sent,
+	 *  after all the earlier sends have completed.
+	 **/
+	void			setMaxBytes		(int maxBytes);
+
+	/** Copies the message into a free buffer and starts sending it. */
+	void			send			(const void* buffer, int count, MPI_Datatype datatype,
+									 int receiver, int tag, MPITAGTYPE comm);
+
+	/** Frees the buffers whose sends have completed. Does not block.
+	 *  Returns the number of sends still pending.
+	 **/
+	int				recycle			();
+
+	/** Waits until all the pending sends have completed. */
+	void			flush			();
+
+	/** Returns the total size of the buffers in bytes. */
+	int				capacity		();
+
+  protected:
+	MPIInstance&			mMPI;
+	Array<MPIBuffer>		mBuffers;
+	MPI_Request*			mpRequests;	// Pending sends; MPI_REQUEST_NULL if none
+	bool*					mpBusy;		// Buffers acquired and not yet recycled
+	int*					mpBytes;	// Sizes of the messages in the busy buffers
+	bool*					mpWaited;	// Requests taken out by a waiting thread
+	PackArray<int>			mIndices;	// Work space of MPI_Testsome
+	PackArray<MPI_Status>	mStatuses;	// Work space of MPI_Testsome
+	int						mMaxBytes;
+	MPIMutex				mMutex;
+
+	/** Returns a free buffer of at least the given size. The buffer
+	 *  is busy until the send started for it completes. Must be
+	 *  called with the mutex locked, like the ones below.
+	 **/
+	int				acquire			(int bytes);
+
+	/** Marks the buffers of the completed sends free. */
+	int				recycleLocked	();
+
+	/** Waits until some of the pending sends complete, and marks their
+	 *  buffers free. The mutex is released while waiting; the
+	 *  requests waited for are taken out of mpRequests meanwhile, so
+	 *  that the other threads do not test them.
+	 **/
+	void			waitSome		();
+
+	/** Returns the total size of the pending messages in bytes. */
+	int				busyBytes		() const;
+};
+
 
 
 //////////////////////////////////////////////////////////////////////////////
@@ -148,52 +493,418 @@ class MPIRequest {
 //////////////////////////////////////////////////////////////////////////////
 
 /** An MPI communicator object.
+ *
+ *  All point-to-point methods take a message tag, which defaults to
+ *  cDefaultTag. Messages are only matched with receives of the same
+ *  tag, so messages of different tags can be received in any order.
+ *  The receives also accept MPI_ANY_TAG; the tag of the received
+ *  message is then in the given status, or in the status() of the
+ *  MPI instance if none was given and it runs a single thread. Use
+ *  MPIChannel to allocate distinct tags for independent streams of
+ *  messages.
+ *
+ *  Thread safety: if the MPI instance provides MPI_THREAD_MULTIPLE,
+ *  the point-to-point methods, including the non-blocking sends and
+ *  allocateTag(), may be called by several threads at the same time,
+ *  provided that the threads pass a status of their own to the
+ *  receives and probes if they need one; without a status, the
+ *  operations then use a status of their own and do not update the
+ *  shared status() of the instance. An MPIRequest must only be used by one thread
+ *  at a time. Collective operations on the same communicator must
+ *  not overlap, as MPI requires; give each thread its own
+ *  communicator for those.
+ *
+ *  The collectives take the MPI datatype of the items, or deduce it
+ *  from the item type of the buffers with MPIType in their typed
+ *  versions. Counts and displacements are in items.
  **/
 class MPIComm : public Object {
   public:
+	enum {cDefaultTag=99};
 
 	/** Creates a communications channel with the given comm tag.
+	 *
+	 *  @param owned If true, the communicator is freed when the object
+	 *  is destroyed, which must then happen before the MPI instance is
+	 *  destroyed.
 	 **/
-					MPIComm			(MPIInstance& mpi, MPITAGTYPE commtag)
-							: mMPI (mpi), mCommTag (commtag) {}
+					MPIComm			(MPIInstance& mpi, MPITAGTYPE commtag, bool owned=false)
+							: mMPI (mpi), mCommTag (commtag), mNextTag (cDefaultTag+1), mOwned (owned),
+							  mpNode (NULL), mpLeaders (NULL), mNodes (0) {}
+					~MPIComm		();
+
+	/* The receiving methods below store the status of the message in
+	 * the given status. If it is NULL, they store it in the status()
+	 * of the MPI instance, unless the thread level is
+	 * MPI_THREAD_MULTIPLE.
+	 */
 	
 	/** Sends a message. Blocking. */
-	void			send			(void* buffer, int len, MPI_Datatype datatype, int receiver);
+	void			send			(void* buffer, int len, MPI_Datatype datatype, int receiver, int tag=cDefaultTag);
 	
 	/** Sends a string buffer. Blocking. */
-	void			send			(const String& buffer, int receiver);
+	void			send			(const String& buffer, int receiver, int tag=cDefaultTag);
 
-	/** Sends a message. Blocking. */
-	void			nbSend			(void* buffer, int len, MPI_Datatype datatype, int receiver);
+	/** Sends a message. Non-blocking.
+	 *
+	 *  The message is copied into a buffer of the send pool of the
+	 *  MPI instance, so the given buffer can be reused immediately.
+	 **/
+	void			nbSend			(void* buffer, int len, MPI_Datatype datatype, int receiver, int tag=cDefaultTag);
 
 	/** Sends a string buffer. Non-blocking. */
-	void			nbSend			(const String& buffer, int receiver);
+	void			nbSend			(const String& buffer, int receiver, int tag=cDefaultTag);
 
 	/** Receives a message. Blocking. */
-	int				recv			(void* buffer, int maxlen, MPI_Datatype datatype, int source);
+	int				recv			(void* buffer, int maxlen, MPI_Datatype datatype, int source, int tag=cDefaultTag,
+									 MPI_Status* status=NULL);
+
+	/** Receives a string buffer. Blocking.
+	 *
+	 *  The string is only grown to the length of the message, not to
+	 *  maxlen, which is merely the limit for the message length.
+	 *
+	 *  A longer message is received and discarded, and an mpi_error
+	 *  is thrown; the string is left unchanged.
+	 **/
+	void			recv			(String& buffer, int maxlen, int sender, int tag=cDefaultTag,
+									 MPI_Status* status=NULL);
 
-	/** Receives a string buffer. Blocking. */
-	void			recv			(String& buffer, int maxlen, int sender);
+	/** Sends the message in the buffer. Blocking. */
+	void			send			(const MPIBuffer& buffer, int receiver, int tag=cDefaultTag);
+
+	/** Receives a message of any length directly to the buffer,
+	 *  which is grown if the message does not fit. Blocking.
+	 *
+	 *  Returns the length of the message in bytes.
+	 **/
+	int				recv			(MPIBuffer& buffer, int sender, int tag=cDefaultTag,
+									 MPI_Status* status=NULL);
 
 	/** Receives a message. Non-blocking.
 	 *
 	 *  Returns an MPIRequest object that can be used to wait()
 	 *  or check() if the message has yet been received.
 	 **/
-	MPIRequest*		nbRecv			(String& buffer, int maxlen, int sender);
+	MPIRequest*		nbRecv			(String& buffer, int maxlen, int sender, int tag=cDefaultTag);
+
+	/** Receives a message to a raw buffer. Non-blocking.
+	 *
+	 *  The given request must have been created for a raw buffer, and
+	 *  it must not be pending. The receive is completed with its
+	 *  wait() or check(), which store the status in the request.
+	 **/
+	void			nbRecv			(MPIRequest& request, void* buffer, int maxlen,
+									 MPI_Datatype datatype, int source, int tag=cDefaultTag);
+
+	/** Sends a message to the receiver and receives one from the
+	 *  source, without deadlocking even if they do the same. Blocking.
+	 *
+	 *  Returns the number of items received.
+	 **/
+	int				sendRecv		(const void* sendBuffer, int sendCount, int receiver,
+									 void* recvBuffer, int maxlen, int source,
+									 MPI_Datatype datatype, int tag=cDefaultTag,
+									 MPI_Status* status=NULL);
 
 	/** Coating for the other recv. */
-	String			recv			(int maxlen, int sender);
+	String			recv			(int maxlen, int sender, int tag=cDefaultTag);
+
+	/** Checks if a message from the given source (or MPI_ANY_SOURCE)
+	 *  is waiting to be received. Does not block. The sender of the
+	 *  message is stored in the status.
+	 **/
+	bool			iprobe			(int source, int tag=cDefaultTag, MPI_Status* status=NULL);
 
 	/** Performs an operation with all processors. */
 	void			allReduce		(const void* sendBuffer, void* recvBuffer, int count, const MPI_Datatype& datatype, const MPI_Op& op);
 
+	/** Performs an operation with all processors, and scatters the
+	 *  result: process i receives recvCounts[i] items of it.
+	 **/
+	void			reduceScatter	(const void* sendBuffer, void* recvBuffer, const int* recvCounts,
+									 const MPI_Datatype& datatype, const MPI_Op& op);
+
+	/** Inclusive prefix reduction: process i receives the reduction
+	 *  of the items of the processes 0..i.
+	 **/
+	void			scan			(const void* sendBuffer, void* recvBuffer, int count, const MPI_Datatype& datatype, const MPI_Op& op);
+
+	/** Performs an operation with all processors, leaving the result
+	 *  to the recvBuffer of the root process only.
+	 **/
+	void			reduce			(const void* sendBuffer, void* recvBuffer, int count, const MPI_Datatype& datatype, const MPI_Op& op, int root);
+
+	/** Gathers count items from every process to the recvBuffers of
+	 *  all processes, in rank order.
+	 **/
+	void			allGather		(const void* sendBuffer, void* recvBuffer, int count, const MPI_Datatype& datatype);
+
+	/** Gathers blocks of varying length from every process to the
+	 *  recvBuffers of all processes.
+	 **/
+	void			allGatherv		(const void* sendBuffer, int sendCount, void* recvBuffer,
+									 const int* counts, const int* displs, const MPI_Datatype& datatype);
+
+	/** Broadcasts count items from the buffer of the root process
+	 *  to the buffers of all processes.
+	 **/
+	void			bcast			(void* buffer, int count, const MPI_Datatype& datatype, int root);
+
+	/** Gathers count items from every process to the recvBuffer of
+	 *  the root process, in rank order.
+	 **/
+	void			gather			(const void* sendBuffer, void* recvBuffer, int count, const MPI_Datatype& datatype, int root);
+
+	/** Gathers blocks of varying length to the recvBuffer of the
+	 *  root process. The counts and displacements (in items) of the
+	 *  blocks are only significant in the root process.
+	 **/
+	void			gatherv			(const void* sendBuffer, int sendCount, void* recvBuffer,
+									 const int* counts, const int* displs, const MPI_Datatype& datatype, int root);
+
+	/** Scatters count items to every process from the sendBuffer of
+	 *  the root process, in rank order.
+	 **/
+	void			scatter			(const void* sendBuffer, void* recvBuffer, int count, const MPI_Datatype& datatype, int root);
+
+	/** Scatters blocks of varying length from the root process. The
+	 *  counts and displacements (in items) of the blocks are only
+	 *  significant in the root process.
+	 **/
+	void			scatterv		(const void* sendBuffer, const int* counts, const int* displs,
+									 void* recvBuffer, int recvCount, const MPI_Datatype& datatype, int root);
+
+	/** Sends count items to every process and receives count items
+	 *  from every process, in rank order.
+	 **/
+	void			allToAll		(const void* sendBuffer, void* recvBuffer, int count, const MPI_Datatype& datatype);
+
+	/** Sends a block of varying length to every process and receives
+	 *  a block from every process. The counts and displacements are
+	 *  in items.
+	 **/
+	void			allToAllv		(const void* sendBuffer, const int* sendCounts, const int* sendDispls,
+									 void* recvBuffer, const int* recvCounts, const int* recvDispls,
+									 const MPI_Datatype& datatype);
+
 	/** Blocks the calling process until all processes in the comm
 	 *  group have called this method.
 	 *
 	 *  Involves no data transmission.
 	 **/
 	void			barrier			();
+
+	/* Non-blocking collectives. They begin the operation in the
+	 * given raw-buffer request, which completes it with its wait() or
+	 * check(); the buffers may not be touched before that. All the
+	 * processes must begin the collectives of a communicator in the
+	 * same order. Without MPI-3, they complete before returning.
+	 */
+
+	/** Non-blocking barrier(). */
+	void			iBarrier		(MPIRequest& request);
+
+	/** Non-blocking bcast(). */
+	void			iBcast			(MPIRequest& request, void* buffer, int count,
+									 const MPI_Datatype& datatype, int root);
+
+	/** Non-blocking allReduce(). */
+	void			iAllReduce		(MPIRequest& request, const void* sendBuffer, void* recvBuffer,
+									 int count, const MPI_Datatype& datatype, const MPI_Op& op);
+
+	/** Non-blocking allGather(). */
+	void			iAllGather		(MPIRequest& request, const void* sendBuffer, void* recvBuffer,
+									 int count, const MPI_Datatype& datatype);
+
+	/* Persistent collectives; see MPICollective. Collective; the
+	 * returned operation is owned by the caller.
+	 */
+
+	MPICollective*	barrierInit		();
+	MPICollective*	bcastInit		(void* buffer, int count, const MPI_Datatype& datatype, int root);
+	MPICollective*	allReduceInit	(const void* sendBuffer, void* recvBuffer, int count,
+									 const MPI_Datatype& datatype, const MPI_Op& op);
+	MPICollective*	allGatherInit	(const void* sendBuffer, void* recvBuffer, int count,
+									 const MPI_Datatype& datatype);
+
+	/* Typed versions of the collectives. */
+	
+	template <class T>
+	void			allReduce		(const T* sendBuffer, T* recvBuffer, int count, const MPI_Op& op) {
+		allReduce (sendBuffer, recvBuffer, count, MPIType<T>::type(), op);
+	}
+	template <class T>
+	void			reduce			(const T* sendBuffer, T* recvBuffer, int count, const MPI_Op& op, int root) {
+		reduce (sendBuffer, recvBuffer, count, MPIType<T>::type(), op, root);
+	}
+
+	/* Reductions of structs with a stateless functor; see
+	 * MPIReduction. The functor argument only selects its type. The
+	 * functor is taken to be commutative, unless false is given as
+	 * the first template argument, as in
+	 * comm.allReduce<false> (in, out, count, Concatenate()). */
+
+	template <bool commutative, class T, class F>
+	void			allReduce		(const T* sendBuffer, T* recvBuffer, int count, const F&) {
+		allReduce (sendBuffer, recvBuffer, count, MPIReduction<T,F,commutative>::type(),
+				   MPIReduction<T,F,commutative>::op());
+	}
+	template <bool commutative, class T, class F>
+	void			reduce			(const T* sendBuffer, T* recvBuffer, int count, const F&, int root) {
+		reduce (sendBuffer, recvBuffer, count, MPIReduction<T,F,commutative>::type(),
+				MPIReduction<T,F,commutative>::op(), root);
+	}
+	template <bool commutative, class T, class F>
+	void			hierarchicalAllReduce (const T* sendBuffer, T* recvBuffer, int count, const F&) {
+		hierarchicalAllReduce (sendBuffer, recvBuffer, count, MPIReduction<T,F,commutative>::type(),
+							   MPIReduction<T,F,commutative>::op());
+	}
+	template <bool commutative, class T, class F>
+	void			iAllReduce		(MPIRequest& request, const T* sendBuffer, T* recvBuffer, int count,
+									 const F&) {
+		iAllReduce (request, sendBuffer, recvBuffer, count, MPIReduction<T,F,commutative>::type(),
+					MPIReduction<T,F,commutative>::op());
+	}
+	template <bool commutative, class T, class F>
+	MPICollective*	allReduceInit	(const T* sendBuffer, T* recvBuffer, int count, const F&) {
+		return allReduceInit (sendBuffer, recvBuffer, count, MPIReduction<T,F,commutative>::type(),
+							  MPIReduction<T,F,commutative>::op());
+	}
+
+	template <class T, class F>
+	void			allReduce		(const T* sendBuffer, T* recvBuffer, int count, const F& functor) {
+		allReduce<true> (sendBuffer, recvBuffer, count, functor);
+	}
+	template <class T, class F>
+	void			reduce			(const T* sendBuffer, T* recvBuffer, int count, const F& functor, int root) {
+		reduce<true> (sendBuffer, recvBuffer, count, functor, root);
+	}
+	template <class T, class F>
+	void			hierarchicalAllReduce (const T* sendBuffer, T* recvBuffer, int count, const F& functor) {
+		hierarchicalAllReduce<true> (sendBuffer, recvBuffer, count, functor);
+	}
+	template <class T, class F>
+	void			iAllReduce		(MPIRequest& request, const T* sendBuffer, T* recvBuffer, int count,
+									 const F& functor) {
+		iAllReduce<true> (request, sendBuffer, recvBuffer, count, functor);
+	}
+	template <class T, class F>
+	MPICollective*	allReduceInit	(const T* sendBuffer, T* recvBuffer, int count, const F& functor) {
+		return allReduceInit<true> (sendBuffer, recvBuffer, count, functor);
+	}
+	template <class T>
+	void			reduceScatter	(const T* sendBuffer, T* recvBuffer, const int* recvCounts, const MPI_Op& op) {
+		reduceScatter (sendBuffer, recvBuffer, recvCounts, MPIType<T>::type(), op);
+	}
+	template <class T>
+	void			scan			(const T* sendBuffer, T* recvBuffer, int count, const MPI_Op& op) {
+		scan (sendBuffer, recvBuffer, count, MPIType<T>::type(), op);
+	}
+	template <class T>
+	void			bcast			(T* buffer, int count, int root) {
+		bcast (buffer, count, MPIType<T>::type(), root);
+	}
+	template <class T>
+	void			gather			(const T* sendBuffer, T* recvBuffer, int count, int root) {
+		gather (sendBuffer, recvBuffer, count, MPIType<T>::type(), root);
+	}
+	template <class T>
+	void			gatherv			(const T* sendBuffer, int sendCount, T* recvBuffer,
+									 const int* counts, const int* displs, int root) {
+		gatherv (sendBuffer, sendCount, recvBuffer, counts, displs, MPIType<T>::type(), root);
+	}
+	template <class T>
+	void			scatter			(const T* sendBuffer, T* recvBuffer, int count, int root) {
+		scatter (sendBuffer, recvBuffer, count, MPIType<T>::type(), root);
+	}
+	template <class T>
+	void			scatterv		(const T* sendBuffer, const int* counts, const int* displs,
+									 T* recvBuffer, int recvCount, int root) {
+		scatterv (sendBuffer, counts, displs, recvBuffer, recvCount, MPIType<T>::type(), root);
+	}
+	template <class T>
+	void			allGather		(const T* sendBuffer, T* recvBuffer, int count) {
+		allGather (sendBuffer, recvBuffer, count, MPIType<T>::type());
+	}
+	template <class T>
+	void			allGatherv		(const T* sendBuffer, int sendCount, T* recvBuffer,
+									 const int* counts, const int* displs) {
+		allGatherv (sendBuffer, sendCount, recvBuffer, counts, displs, MPIType<T>::type());
+	}
+	template <class T>
+	void			allToAll		(const T* sendBuffer, T* recvBuffer, int count) {
+		allToAll (sendBuffer, recvBuffer, count, MPIType<T>::type());
+	}
+	template <class T>
+	void			iBcast			(MPIRequest& request, T* buffer, int count, int root) {
+		iBcast (request, buffer, count, MPIType<T>::type(), root);
+	}
+	template <class T>
+	void			iAllReduce		(MPIRequest& request, const T* sendBuffer, T* recvBuffer, int count,
+									 const MPI_Op& op) {
+		iAllReduce (request, sendBuffer, recvBuffer, count, MPIType<T>::type(), op);
+	}
+	template <class T>
+	void			iAllGather		(MPIRequest& request, const T* sendBuffer, T* recvBuffer, int count) {
+		iAllGather (request, sendBuffer, recvBuffer, count, MPIType<T>::type());
+	}
+	template <class T>
+	void			allToAllv		(const T* sendBuffer, const int* sendCounts, const int* sendDispls,
+									 T* recvBuffer, const int* recvCounts, const int* recvDispls) {
+		allToAllv (sendBuffer, sendCounts, sendDispls, recvBuffer, recvCounts, recvDispls, MPIType<T>::type());
+	}
+
+	/** Splits the processes to new communicators by the color, ordered
+	 *  by the key within a color. Collective.
+	 *
+	 *  Returns a new communicator, owned by the caller, or NULL if the
+	 *  color is MPI_UNDEFINED.
+	 **/
+	MPIComm*		split			(int color, int key=0);
+
+	/** Splits the processes to new communicators by the nodes that
+	 *  share memory. Collective. Returns a new communicator, owned by
+	 *  the caller.
+	 **/
+	MPIComm*		splitShared		(int key=0);
+
+	/** Returns the communicator of the processes in the same node as
+	 *  this process. It and leaderComm() are created collectively at
+	 *  the first call of any of the node-aware methods.
+	 **/
+	MPIComm&		nodeComm		();
+
+	/** Returns the communicator of the node leaders, the lowest
+	 *  ranking process of every node, or NULL if this process is not
+	 *  a leader.
+	 **/
+	MPIComm*		leaderComm		();
+
+	/** Returns the number of nodes. */
+	int				nodes			();
+
+	/** Like allReduce(), but reduces first within each node, then
+	 *  between the node leaders only, and finally broadcasts the
+	 *  result within each node. Only one message per node crosses the
+	 *  network.
+	 *
+	 *  Falls back to a plain allReduce() if there is only one node or
+	 *  one process per node, or if the operation is not commutative.
+	 *
+	 *  The send buffer must not be MPI_IN_PLACE: the processes other
+	 *  than the node leader take part in the reduction within the
+	 *  node as non-root processes, which MPI does not allow to reduce
+	 *  in place.
+	 **/
+	void			hierarchicalAllReduce (const void* sendBuffer, void* recvBuffer, int count,
+										   const MPI_Datatype& datatype, const MPI_Op& op);
+
+	/** Like bcast(), but broadcasts first within the node of the
+	 *  root, then between the node leaders, and finally within the
+	 *  other nodes.
+	 **/
+	void			hierarchicalBcast (void* buffer, int count, const MPI_Datatype& datatype, int root);
 	
 	/** Returns the MPI process rank of the current process. */
 	int				getRank			() const;
@@ -207,9 +918,109 @@ class MPIComm : public Object {
 	/** Returns the (well, singleton) MPI object. */
 	MPIInstance&	mpi				() {return mMPI;}
 
+	/** Returns a message tag that has not been allocated before in
+	 *  this communicator. The tags are allocated in sequence, so all
+	 *  processes get the same tags if they allocate them in the same
+	 *  order.
+	 **/
+	int				allocateTag		();
+
   protected:
 	MPIInstance&	mMPI;
 	MPITAGTYPE		mCommTag;
+	int				mNextTag;
+	MPIMutex		mTagMutex;
+	bool			mOwned;
+
+	// Node hierarchy, created by makeHierarchy()
+	MPIComm*		mpNode;
+	MPIComm*		mpLeaders;
+	int				mNodes;
+	PackArray<int>	mLeaderOf;		// Rank of the node leader of each process in mpLeaders
+	PackArray<int>	mNodeRankOf;	// Rank of each process in its mpNode
+
+	/** Creates the node and leader communicators. Collective. */
+	void			makeHierarchy	();
+
+	/** A message found by probeMatched(). */
+	struct Matched {
+		MPI_Status*		status;
+#if MPI_VERSION >= 3
+		MPI_Message		message;
+#endif
+	};
+
+	/** Waits for a message from the source, and returns its length in
+	 *  items of the datatype. The message is reserved so that
+	 *  recvMatched() receives exactly it, even if other messages
+	 *  arrive in between, or other threads receive at the same time.
+	 **/
+	int				probeMatched	(int source, int tag, MPI_Datatype datatype, Matched& match);
+
+	/** Receives the message found by probeMatched(). */
+	void			recvMatched		(void* buffer, int len, MPI_Datatype datatype, Matched& match);
+
+  private:
+	/** Not copyable: a copy would free an owned communicator and the
+	 *  node hierarchy a second time. Not defined.
+	 **/
+					MPIComm			(const MPIComm& other);
+	MPIComm&		operator=		(const MPIComm& other);
+};
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//            |   | ----  ---  ___  |                              |        //
+//            |\ /| |   )  |  /   \ |       ___    _     _    ___  |        //
+//            | V | |---   |  |     |/\   ___| |/ \  |/ \  /   ) |          //
+//            | | | |      |  |     |  | (   | |   | |   | |---  |          //
+//            |   | |     _|_ \___/ |  |  \__| |   | |   |  \__  |          //
+//////////////////////////////////////////////////////////////////////////////
+
+/** A logical stream of messages in a communicator, with a tag of
+ *  its own.
+ *
+ *  Messages of different channels are matched independently, so a
+ *  process can receive them in any order, or have receives pending in
+ *  several channels at the same time, without one stream blocking
+ *  another. The channels must be created in the same order in all
+ *  processes that communicate through them, so that they get the
+ *  same tags.
+ **/
+class MPIChannel {
+  public:
+	/** Creates a channel with a newly allocated tag. */
+					MPIChannel		(MPIComm& comm)
+							: mComm (comm), mTag (comm.allocateTag()) {}
+
+	/** Creates a channel for a known tag. */
+					MPIChannel		(MPIComm& comm, int tag)
+							: mComm (comm), mTag (tag) {}
+
+	int				tag				() const {return mTag;}
+	MPIComm&		comm			() {return mComm;}
+
+	void			send			(void* buffer, int len, MPI_Datatype datatype, int receiver) {mComm.send (buffer, len, datatype, receiver, mTag);}
+	void			send			(const String& buffer, int receiver) {mComm.send (buffer, receiver, mTag);}
+	void			send			(const MPIBuffer& buffer, int receiver) {mComm.send (buffer, receiver, mTag);}
+	void			nbSend			(void* buffer, int len, MPI_Datatype datatype, int receiver) {mComm.nbSend (buffer, len, datatype, receiver, mTag);}
+	void			nbSend			(const String& buffer, int receiver) {mComm.nbSend (buffer, receiver, mTag);}
+	int				recv			(void* buffer, int maxlen, MPI_Datatype datatype, int source, MPI_Status* status=NULL) {return mComm.recv (buffer, maxlen, datatype, source, mTag, status);}
+	void			recv			(String& buffer, int maxlen, int source, MPI_Status* status=NULL) {mComm.recv (buffer, maxlen, source, mTag, status);}
+	int				recv			(MPIBuffer& buffer, int source, MPI_Status* status=NULL) {return mComm.recv (buffer, source, mTag, status);}
+	MPIRequest*		nbRecv			(String& buffer, int maxlen, int source) {return mComm.nbRecv (buffer, maxlen, source, mTag);}
+	void			nbRecv			(MPIRequest& request, void* buffer, int maxlen, MPI_Datatype datatype, int source) {mComm.nbRecv (request, buffer, maxlen, datatype, source, mTag);}
+	int				sendRecv		(const void* sendBuffer, int sendCount, int receiver,
+									 void* recvBuffer, int maxlen, int source, MPI_Datatype datatype,
+									 MPI_Status* status=NULL) {
+		return mComm.sendRecv (sendBuffer, sendCount, receiver, recvBuffer, maxlen, source, datatype, mTag, status);
+	}
+	bool			iprobe			(int source, MPI_Status* status=NULL) {return mComm.iprobe (source, mTag, status);}
+
+  protected:
+	MPIComm&		mComm;
+	int				mTag;
 };
 
 
@@ -242,4 +1053,70 @@ class MPIVector : public MPIDatatype {
   private:
 };
 
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//               |   | ----  --- -----  o |                                 //
+//               |\ /| |   )  |  |        |  ___                            //
+//               | V | |---   |  |---  |  | /   )                           //
+//               | | | |      |  |     |  | |---                            //
+//               |   | |     _|_ |     |  |  \__                            //
+//////////////////////////////////////////////////////////////////////////////
+
+/** A file accessed in parallel with MPI-IO by all processes in a
+ *  communicator.
+ *
+ *  The file is opened and closed collectively. The collective
+ *  read/write methods must be called by all processes of the
+ *  communicator, although some of them may transfer zero items.
+ **/
+class MPIFile : public Object {
+  public:
+	/** Opens the file collectively.
+	 *
+	 *  @param amode Access mode as MPI_MODE_* flags, for example
+	 *  MPI_MODE_CREATE|MPI_MODE_WRONLY.
+	 **/
+					MPIFile			(MPIComm& comm, const char* filename, int amode);
+					~MPIFile		();
+
+	/** Closes the file. Collective. Called automatically by the
+	 *  destructor if not called explicitly.
+	 **/
+	void			close			();
+
+	/** Writes data at the given byte offset. Not collective. */
+	void			writeAt			(MPI_Offset offset, const void* buffer, int count, MPI_Datatype datatype);
+
+	/** Writes data at the given byte offset. Collective. */
+	void			writeAtAll		(MPI_Offset offset, const void* buffer, int count, MPI_Datatype datatype);
+
+	/** Reads data from the given byte offset. Not collective.
+	 *
+	 *  Returns the number of items actually read.
+	 **/
+	int				readAt			(MPI_Offset offset, void* buffer, int count, MPI_Datatype datatype);
+
+	/** Reads data from the given byte offset. Collective.
+	 *
+	 *  Returns the number of items actually read.
+	 **/
+	int				readAtAll		(MPI_Offset offset, void* buffer, int count, MPI_Datatype datatype);
+
+	/** Returns the current size of the file in bytes. */
+	MPI_Offset		size			() const;
+
+	/** Truncates or expands the file to the given size. Collective. */
+	void			setSize			(MPI_Offset size);
+
+	/** Flushes written data to the storage device. Collective. */
+	void			sync			();
+
+  protected:
+	MPIComm&		mComm;
+	MPI_File		mFile;
+	bool			mOpen;
+};
+
 #endif
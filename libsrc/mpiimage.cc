@@ -0,0 +1,129 @@
+#include "mpiimage.h"
+#include <stdio.h>
+
+//////////////////////////////////////////////////////////////////////////////
+//           |   | ----  --- ---                                            //
+//           |\ /| |   )  |   |  |/|/|   ___   ___   ___                    //
+//           | V | |---   |   |  | | |   ___| (   \ /   )                   //
+//           | | | |      |   |  | | |  (   |  ---/ |---                    //
+//           |   | |     _|_ _|_ | | |   \__|  __/   \__                    //
+//////////////////////////////////////////////////////////////////////////////
+
+MPIImage::MPIImage (MPIComm& comm, int width, int height)
+		: mComm (comm), mWidth (width), mHeight (height),
+		  mPixels (width*height), mDirty (width*height), mDirtyFirst (height), mDirtyEnd (height) {
+	memset (mPixels.data, 0, width*height);
+
+	// Clear all the marks
+	for (int y=0; y<height; y++) {
+		mDirtyFirst[y] = 0;
+		mDirtyEnd[y] = width;
+	}
+	clean ();
+}
+
+void MPIImage::setSpan (int x, int y, int n, const unsigned char* values) {
+	memcpy (mPixels.data+y*mWidth+x, values, n);
+	memset (mDirty.data+y*mWidth+x, 1, n);
+	if (x < mDirtyFirst[y])
+		mDirtyFirst[y] = x;
+	if (x+n > mDirtyEnd[y])
+		mDirtyEnd[y] = x+n;
+}
+
+void MPIImage::gather (int root) {
+	bool isRoot = mComm.getRank() == root;
+
+	// Pack the runs of drawn pixels as (row, first column, length)
+	// followed by the pixels. The first pass only counts the length.
+	// The root already has its own pixels.
+	PackArray<char> packed;
+	int len = 0;
+	for (int pass=0; pass<2 && !isRoot; pass++) {
+		char* p = packed.data;
+		for (int y=0; y<mHeight; y++) {
+			const unsigned char* dirty = mDirty.data+y*mWidth;
+			for (int x=mDirtyFirst[y]; x<mDirtyEnd[y]; ) {
+				if (!dirty[x]) {
+					x++;
+					continue;
+				}
+				int run = 1;
+				while (x+run<mDirtyEnd[y] && dirty[x+run])
+					run++;
+				if (pass == 0)
+					len += 3*sizeof(int) + run;
+				else {
+					int span[3] = {y, x, run};
+					memcpy (p, span, sizeof(span));
+					memcpy (p+sizeof(span), mPixels.data+y*mWidth+x, run);
+					p += sizeof(span)+run;
+				}
+				x += run;
+			}
+		}
+		if (pass == 0)
+			packed.make (len);
+	}
+
+	// Collect the packed spans to the root
+	int size = mComm.size ();
+	PackArray<int> counts, displs;
+	if (isRoot) {
+		counts.make (size);
+		displs.make (size);
+	}
+	mComm.gather (&len, counts.data, 1, MPI_INT, root);
+
+	PackArray<char> received;
+	if (isRoot) {
+		int total = 0;
+		for (int i=0; i<size; i++) {
+			displs[i] = total;
+			total += counts[i];
+		}
+		received.make (total);
+	}
+	mComm.gatherv (packed.data, len, received.data, counts.data, displs.data, MPI_CHAR, root);
+
+	// Unpack the spans of the other processes
+	if (isRoot)
+		for (int i=0; i<size; i++) {
+			const char* q = received.data+displs[i];
+			const char* end = q+counts[i];
+			while (q < end) {
+				int span[3];
+				memcpy (span, q, sizeof(span));
+				memcpy (mPixels.data+span[0]*mWidth+span[1], q+sizeof(span), span[2]);
+				q += sizeof(span)+span[2];
+			}
+		}
+
+	clean ();
+}
+
+void MPIImage::writePPM (const char* filename, const unsigned char* palette) const {
+	FILE* out = fopen (filename, "wb");
+	if (!out)
+		throw mpi_error (format ("Could not open '%s' for writing in MPIImage::writePPM()",
+								 filename));
+	fprintf (out, "P6\n%d %d\n255\n", mWidth, mHeight);
+
+	// Convert a row at a time
+	PackArray<unsigned char> rgb (3*mWidth);
+	for (int y=0; y<mHeight; y++) {
+		for (int x=0; x<mWidth; x++)
+			memcpy (rgb.data+3*x, palette+3*mPixels.data[y*mWidth+x], 3);
+		fwrite (rgb.data, 3, mWidth, out);
+	}
+	fclose (out);
+}
+
+void MPIImage::clean () {
+	for (int y=0; y<mHeight; y++) {
+		if (mDirtyEnd[y] > mDirtyFirst[y])
+			memset (mDirty.data+y*mWidth+mDirtyFirst[y], 0, mDirtyEnd[y]-mDirtyFirst[y]);
+		mDirtyFirst[y] = mWidth;
+		mDirtyEnd[y] = 0;
+	}
+}
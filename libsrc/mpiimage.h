@@ -0,0 +1,83 @@
+#ifndef __MPIIMAGE_H__
+#define __MPIIMAGE_H__
+
+#include "mpi++.h"
+#include <magic/packarray.h>
+
+//////////////////////////////////////////////////////////////////////////////
+//           |   | ----  --- ---                                            //
+//           |\ /| |   )  |   |  |/|/|   ___   ___   ___                    //
+//           | V | |---   |   |  | | |   ___| (   \ /   )                   //
+//           | | | |      |   |  | | |  (   |  ---/ |---                    //
+//           |   | |     _|_ _|_ | | |   \__|  __/   \__                    //
+//////////////////////////////////////////////////////////////////////////////
+
+/** A distributed frame buffer of palette-indexed pixels.
+ *
+ *  Every process has a full-size copy of the image, and draws its own
+ *  part of it locally with set(). The pixels drawn since the previous
+ *  gather are then collected to one process with a single gather(),
+ *  which can display the whole frame at once, for example with
+ *  MPEWindow::drawImage(), or write it to a file.
+ *
+ *  Each drawn pixel is marked, so that tiles drawn apart in the same
+ *  rows are transferred without the pixels between them. The span of
+ *  the marks is kept for each row only to skip the undrawn rows and
+ *  columns quickly.
+ **/
+class MPIImage : public Object {
+  public:
+					MPIImage		(MPIComm& comm, int width, int height);
+
+	int				width			() const {return mWidth;}
+	int				height			() const {return mHeight;}
+
+	/** Sets a pixel to the given palette index. */
+	void			set				(int x, int y, unsigned char value) {
+		mPixels[y*mWidth+x] = value;
+		mDirty[y*mWidth+x] = 1;
+		if (x < mDirtyFirst[y])
+			mDirtyFirst[y] = x;
+		if (x >= mDirtyEnd[y])
+			mDirtyEnd[y] = x+1;
+	}
+
+	/** Sets n pixels of row y starting from column x. */
+	void			setSpan			(int x, int y, int n, const unsigned char* values);
+
+	/** Returns the palette index of a pixel. */
+	unsigned char	get				(int x, int y) const {return mPixels.data[y*mWidth+x];}
+
+	/** Returns the pixel data, row by row. */
+	const unsigned char*	pixels	() const {return mPixels.data;}
+
+	/** Collects the pixels drawn in all processes since the previous
+	 *  gather into the image of the root process. Collective.
+	 **/
+	void			gather			(int root=0);
+
+	/** Writes the image as a binary PPM file.
+	 *
+	 *  @param palette RGB values of the palette indices, three bytes
+	 *  per index.
+	 **/
+	void			writePPM		(const char* filename, const unsigned char* palette) const;
+
+  private:
+	/** Marks all rows as clean. */
+	void			clean			();
+
+	MPIComm&					mComm;
+	int							mWidth;
+	int							mHeight;
+	PackArray<unsigned char>	mPixels;
+
+	/** Pixels drawn since the previous gather, and their span in
+	 *  each row.
+	 **/
+	PackArray<unsigned char>	mDirty;
+	PackArray<int>				mDirtyFirst;
+	PackArray<int>				mDirtyEnd;
+};
+
+#endif
@@ -0,0 +1,1046 @@
+#include "mpiprof.h"
+
+#ifdef ENABLE_MPIPROF
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <dlfcn.h>
+#include <cxxabi.h>
+
+// The send buffers and counts are const since MPI-3
+#if MPI_VERSION >= 3
+#define MPIPROF_CONST const
+#else
+#define MPIPROF_CONST
+#endif
+
+/** The profiled operations. */
+enum {cSend, cIsend, cRecv, cIrecv, cSendrecv, cMrecv, cProbe, cMprobe, cIprobe,
+	  cWait, cWaitall, cWaitany, cWaitsome, cTest, cTestsome, cStart,
+	  cBarrier, cBcast, cReduce, cAllreduce, cGather, cGatherv, cScatter, cScatterv,
+	  cAllgather, cAllgatherv, cAlltoall, cAlltoallv, cReduceScatter, cScan,
+	  cIbarrier, cIbcast, cIallreduce, cIallgather,
+	  cPut, cGet, cAccumulate, cFence, cPost, cWinStart, cComplete, cWinWait,
+	  cLock, cUnlock, cLockAll, cUnlockAll, cFlush, cSync,
+	  cOps};
+
+static const char* opNames [cOps] = {
+	"send", "isend", "recv", "irecv", "sendrecv", "mrecv", "probe", "mprobe", "iprobe",
+	"wait", "waitall", "waitany", "waitsome", "test", "testsome", "start",
+	"barrier", "bcast", "reduce", "allreduce", "gather", "gatherv", "scatter", "scatterv",
+	"allgather", "allgatherv", "alltoall", "alltoallv", "reduce_scatter", "scan",
+	"ibarrier", "ibcast", "iallreduce", "iallgather",
+	"put", "get", "accumulate", "win_fence", "win_post", "win_start", "win_complete", "win_wait",
+	"win_lock", "win_unlock", "win_lock_all", "win_unlock_all", "win_flush", "win_sync"};
+
+enum {cBuckets		= 32,	// Time histogram buckets: <1us, then powers of two
+	  cSites		= 1024,	// Call sites of a process; the rest are not told apart
+	  cLabelLen		= 120,	// Call site labels of the report
+	  cMatrixMax	= 16,	// The largest matrix printed whole
+	  cTopDefault	= 10};
+
+/** Statistics of an operation. All doubles, cOpStatsLen of them, so
+ *  that they reduce as an array.
+ **/
+struct OpStats {
+	double			count;
+	double			bytes;
+	double			time;
+	double			hist [cBuckets];
+};
+
+enum {cOpStatsLen = 3+cBuckets};
+
+/** Statistics of an operation called from a site. */
+struct SiteStats {
+	void*			site;
+	int				op;
+	double			count;
+	double			bytes;
+	double			time;
+	double			hist [cBuckets];
+};
+
+/** A call site with a label that means the same in all processes. */
+struct SiteRecord {
+	char			label [cLabelLen];
+	int				op;
+	int				procs;
+	double			count;
+	double			bytes;
+	double			time;
+	double			hist [cBuckets];
+};
+
+/** Where the bytes of a call with a peer go in the communication
+ *  matrix. The bytes received are not counted, as the sender counts
+ *  them.
+ **/
+enum {cUncounted, cSentTo, cGotFrom};
+
+static MPIMutex		sMutex;
+static bool			sEnabled	= false;
+static double		sStart		= 0.0;
+static int			sSize		= 0;
+static OpStats		sOps [cOps];
+static SiteStats	sSites [cSites];
+static int			sSiteCount	= 0;
+static double*		spSentTo	= NULL;	// Bytes sent or put to each process
+static double*		spGotFrom	= NULL;	// Bytes got from each process
+static double*		spPeerTime	= NULL;	// Time of the calls with each process
+static double*		spPeerHist	= NULL;	// Time histograms of the calls with each process
+static int			sCommKey	= MPI_KEYVAL_INVALID;	// Cached world ranks of communicators
+static int			sWinKey		= MPI_KEYVAL_INVALID;	// Cached world ranks of windows
+static __thread void* tSite		= NULL;
+
+MPIProfileSite::MPIProfileSite (void* caller) {
+	mOuter = (tSite == NULL);
+	if (mOuter)
+		tSite = caller;
+}
+
+MPIProfileSite::~MPIProfileSite () {
+	if (mOuter)
+		tSite = NULL;
+}
+
+static int freeCommRanks (MPI_Comm comm, int key, void* ranks, void* extra) {
+	delete [] (int*) ranks;
+	return MPI_SUCCESS;
+}
+
+static int freeWinRanks (MPI_Win win, int key, void* ranks, void* extra) {
+	delete [] (int*) ranks;
+	return MPI_SUCCESS;
+}
+
+/** Starts profiling after MPI has been initialized. */
+static void startProfile () {
+	PMPI_Comm_size (MPI_COMM_WORLD, &sSize);
+	spSentTo = new double [sSize];
+	spGotFrom = new double [sSize];
+	spPeerTime = new double [sSize];
+	spPeerHist = new double [sSize*cBuckets];
+	memset (spSentTo, 0, sSize*sizeof(double));
+	memset (spGotFrom, 0, sSize*sizeof(double));
+	memset (spPeerTime, 0, sSize*sizeof(double));
+	memset (spPeerHist, 0, sSize*cBuckets*sizeof(double));
+	memset (sOps, 0, sizeof(sOps));
+
+	// The world ranks are cached in attributes, which MPI frees with
+	// the communicators and windows
+	PMPI_Comm_create_keyval (MPI_COMM_NULL_COPY_FN, freeCommRanks, &sCommKey, NULL);
+	PMPI_Win_create_keyval (MPI_WIN_NULL_COPY_FN, freeWinRanks, &sWinKey, NULL);
+
+	sStart = PMPI_Wtime ();
+	sEnabled = true;
+}
+
+static double bytesOf (int count, MPI_Datatype datatype) {
+	int size = 0;
+	if (count > 0)
+		PMPI_Type_size (datatype, &size);
+	return double(count)*size;
+}
+
+/** The ranks in the world of all the processes of a group, -1 for
+ *  those outside the world, preceded by the size of the group. Frees
+ *  the group.
+ **/
+static int* worldRanks (MPI_Group group) {
+	MPI_Group world;
+	int size;
+	PMPI_Comm_group (MPI_COMM_WORLD, &world);
+	PMPI_Group_size (group, &size);
+	int* ranks = new int [size+1];
+	int* in = new int [size? size : 1];
+	for (int i=0; i<size; i++)
+		in[i] = i;
+	ranks[0] = size;
+	PMPI_Group_translate_ranks (group, size, in, world, ranks+1);
+	for (int i=1; i<=size; i++)
+		if (ranks[i] == MPI_UNDEFINED)
+			ranks[i] = -1;
+	delete [] in;
+	PMPI_Group_free (&world);
+	PMPI_Group_free (&group);
+	return ranks;
+}
+
+/** The rank in the world of a process of a communicator, or -1 for
+ *  no process or any process. The rank is in the remote group of an
+ *  inter-communicator. The ranks are translated at the first call
+ *  with the communicator.
+ **/
+static int worldRank (MPI_Comm comm, int rank) {
+	if (rank < 0)
+		return -1;
+	if (comm == MPI_COMM_WORLD)
+		return rank;
+
+	MPILock lock (sMutex);
+	int* ranks;
+	int found;
+	PMPI_Comm_get_attr (comm, sCommKey, &ranks, &found);
+	if (!found) {
+		MPI_Group group;
+		int inter;
+		PMPI_Comm_test_inter (comm, &inter);
+		if (inter)
+			PMPI_Comm_remote_group (comm, &group);
+		else
+			PMPI_Comm_group (comm, &group);
+		ranks = worldRanks (group);
+		PMPI_Comm_set_attr (comm, sCommKey, ranks);
+	}
+	return (rank < ranks[0])? ranks[rank+1] : -1;
+}
+
+/** The rank in the world of a process of a window. */
+static int worldRank (MPI_Win win, int rank) {
+	if (rank < 0)
+		return -1;
+
+	MPILock lock (sMutex);
+	int* ranks;
+	int found;
+	PMPI_Win_get_attr (win, sWinKey, &ranks, &found);
+	if (!found) {
+		MPI_Group group;
+		PMPI_Win_get_group (win, &group);
+		ranks = worldRanks (group);
+		PMPI_Win_set_attr (win, sWinKey, ranks);
+	}
+	return (rank < ranks[0])? ranks[rank+1] : -1;
+}
+
+/** The entry of the site and operation, claiming a free entry if
+ *  allowed.
+ **/
+static SiteStats* findSite (void* site, int op, bool claim) {
+	unsigned long key = ((unsigned long) site >> 2)*31 + op;
+	for (int probe=0; probe<cSites; probe++) {
+		SiteStats& entry = sSites[(key+probe)%cSites];
+		if (entry.count == 0) {
+			if (!claim)
+				return NULL;
+			entry.site = site;
+			entry.op = op;
+			sSiteCount++;
+			return &entry;
+		}
+		if (entry.site == site && entry.op == op)
+			return &entry;
+	}
+	return NULL;
+}
+
+/** Records a call in the statistics. */
+static void record (int op, void* site, double time, double bytes, int peer, int transfer) {
+	MPILock lock (sMutex);
+	if (!sEnabled)
+		return;
+
+	int bucket = 0;
+	for (double us=time*1E6; us>=1.0 && bucket<cBuckets-1; us/=2)
+		bucket++;
+
+	OpStats& stats = sOps[op];
+	stats.count++;
+	stats.bytes += bytes;
+	stats.time += time;
+	stats.hist[bucket]++;
+
+	if (peer >= 0 && peer < sSize) {
+		spPeerTime[peer] += time;
+		spPeerHist[peer*cBuckets+bucket]++;
+		if (transfer == cSentTo)
+			spSentTo[peer] += bytes;
+		else if (transfer == cGotFrom)
+			spGotFrom[peer] += bytes;
+	}
+
+	// When the table is full, the calls from new sites go to the
+	// unknown site of the operation, which always has room
+	SiteStats* entry = findSite (site, op, sSiteCount < cSites-cOps);
+	if (!entry)
+		entry = findSite (NULL, op, true);
+	entry->count++;
+	entry->bytes += bytes;
+	entry->time += time;
+	entry->hist[bucket]++;
+}
+
+/** Times an MPI call made from a site. */
+class ProfileCall {
+  public:
+					ProfileCall		(int op, void* caller)
+							: mOp (op), mSite (tSite? tSite : caller), mStart (PMPI_Wtime ()) {}
+
+	/** Records the call that transferred the bytes, with a peer
+	 *  process of a communicator.
+	 **/
+	void			done			(double bytes=0.0, MPI_Comm comm=MPI_COMM_NULL, int peer=-1,
+									 int transfer=cSentTo) {
+		double time = PMPI_Wtime()-mStart;
+		int world = (comm==MPI_COMM_NULL || !sEnabled)? -1 : worldRank (comm, peer);
+		record (mOp, mSite, time, bytes, world, transfer);
+	}
+
+	/** Records a one-sided call; the bytes of a get come from the
+	 *  target.
+	 **/
+	void			done			(double bytes, MPI_Win win, int target, bool fetched) {
+		double time = PMPI_Wtime()-mStart;
+		int world = sEnabled? worldRank (win, target) : -1;
+		record (mOp, mSite, time, bytes, world, fetched? cGotFrom : cSentTo);
+	}
+
+  private:
+	int				mOp;
+	void*			mSite;
+	double			mStart;
+};
+
+#define CALLER __builtin_return_address (0)
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Initialization
+
+extern "C" int MPI_Init (int* argc, char*** argv) {
+	int result = PMPI_Init (argc, argv);
+	startProfile ();
+	return result;
+}
+
+extern "C" int MPI_Init_thread (int* argc, char*** argv, int required, int* provided) {
+	int result = PMPI_Init_thread (argc, argv, required, provided);
+	startProfile ();
+	return result;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Point-to-point
+
+extern "C" int MPI_Send (MPIPROF_CONST void* buf, int count, MPI_Datatype datatype,
+						 int dest, int tag, MPI_Comm comm) {
+	ProfileCall call (cSend, CALLER);
+	int result = PMPI_Send (buf, count, datatype, dest, tag, comm);
+	call.done (bytesOf (count, datatype), comm, dest);
+	return result;
+}
+
+extern "C" int MPI_Isend (MPIPROF_CONST void* buf, int count, MPI_Datatype datatype,
+						  int dest, int tag, MPI_Comm comm, MPI_Request* request) {
+	ProfileCall call (cIsend, CALLER);
+	int result = PMPI_Isend (buf, count, datatype, dest, tag, comm, request);
+	call.done (bytesOf (count, datatype), comm, dest);
+	return result;
+}
+
+extern "C" int MPI_Recv (void* buf, int count, MPI_Datatype datatype, int source,
+						 int tag, MPI_Comm comm, MPI_Status* status) {
+	ProfileCall call (cRecv, CALLER);
+
+	// The status tells the size and the source of the message, even
+	// if the caller ignores it
+	MPI_Status own;
+	if (status == MPI_STATUS_IGNORE)
+		status = &own;
+	int result = PMPI_Recv (buf, count, datatype, source, tag, comm, status);
+	source = -1;
+	if (result == MPI_SUCCESS) {
+		PMPI_Get_count (status, datatype, &count);
+		source = status->MPI_SOURCE;
+	}
+	call.done (bytesOf (count, datatype), comm, source, cUncounted);
+	return result;
+}
+
+extern "C" int MPI_Irecv (void* buf, int count, MPI_Datatype datatype, int source,
+						  int tag, MPI_Comm comm, MPI_Request* request) {
+	ProfileCall call (cIrecv, CALLER);
+	int result = PMPI_Irecv (buf, count, datatype, source, tag, comm, request);
+	call.done ();
+	return result;
+}
+
+extern "C" int MPI_Sendrecv (MPIPROF_CONST void* sendbuf, int sendcount, MPI_Datatype sendtype,
+							 int dest, int sendtag, void* recvbuf, int recvcount,
+							 MPI_Datatype recvtype, int source, int recvtag,
+							 MPI_Comm comm, MPI_Status* status) {
+	ProfileCall call (cSendrecv, CALLER);
+	int result = PMPI_Sendrecv (sendbuf, sendcount, sendtype, dest, sendtag,
+								recvbuf, recvcount, recvtype, source, recvtag, comm, status);
+	call.done (bytesOf (sendcount, sendtype), comm, dest);
+	return result;
+}
+
+extern "C" int MPI_Probe (int source, int tag, MPI_Comm comm, MPI_Status* status) {
+	ProfileCall call (cProbe, CALLER);
+	int result = PMPI_Probe (source, tag, comm, status);
+	call.done ();
+	return result;
+}
+
+extern "C" int MPI_Iprobe (int source, int tag, MPI_Comm comm, int* flag, MPI_Status* status) {
+	ProfileCall call (cIprobe, CALLER);
+	int result = PMPI_Iprobe (source, tag, comm, flag, status);
+	call.done ();
+	return result;
+}
+
+#if MPI_VERSION >= 3
+extern "C" int MPI_Mprobe (int source, int tag, MPI_Comm comm, MPI_Message* message,
+						   MPI_Status* status) {
+	ProfileCall call (cMprobe, CALLER);
+	int result = PMPI_Mprobe (source, tag, comm, message, status);
+	call.done ();
+	return result;
+}
+
+extern "C" int MPI_Mrecv (void* buf, int count, MPI_Datatype datatype, MPI_Message* message,
+						  MPI_Status* status) {
+	ProfileCall call (cMrecv, CALLER);
+
+	// The message does not tell its communicator, so the source is
+	// not known in the world
+	MPI_Status own;
+	if (status == MPI_STATUS_IGNORE)
+		status = &own;
+	int result = PMPI_Mrecv (buf, count, datatype, message, status);
+	if (result == MPI_SUCCESS)
+		PMPI_Get_count (status, datatype, &count);
+	call.done (bytesOf (count, datatype));
+	return result;
+}
+#endif
+
+extern "C" int MPI_Wait (MPI_Request* request, MPI_Status* status) {
+	ProfileCall call (cWait, CALLER);
+	int result = PMPI_Wait (request, status);
+	call.done ();
+	return result;
+}
+
+extern "C" int MPI_Waitall (int count, MPI_Request requests[], MPI_Status statuses[]) {
+	ProfileCall call (cWaitall, CALLER);
+	int result = PMPI_Waitall (count, requests, statuses);
+	call.done ();
+	return result;
+}
+
+extern "C" int MPI_Waitany (int count, MPI_Request requests[], int* index, MPI_Status* status) {
+	ProfileCall call (cWaitany, CALLER);
+	int result = PMPI_Waitany (count, requests, index, status);
+	call.done ();
+	return result;
+}
+
+extern "C" int MPI_Waitsome (int incount, MPI_Request requests[], int* outcount,
+							 int indices[], MPI_Status statuses[]) {
+	ProfileCall call (cWaitsome, CALLER);
+	int result = PMPI_Waitsome (incount, requests, outcount, indices, statuses);
+	call.done ();
+	return result;
+}
+
+extern "C" int MPI_Test (MPI_Request* request, int* flag, MPI_Status* status) {
+	ProfileCall call (cTest, CALLER);
+	int result = PMPI_Test (request, flag, status);
+	call.done ();
+	return result;
+}
+
+extern "C" int MPI_Testsome (int incount, MPI_Request requests[], int* outcount,
+							 int indices[], MPI_Status statuses[]) {
+	ProfileCall call (cTestsome, CALLER);
+	int result = PMPI_Testsome (incount, requests, outcount, indices, statuses);
+	call.done ();
+	return result;
+}
+
+extern "C" int MPI_Start (MPI_Request* request) {
+	ProfileCall call (cStart, CALLER);
+	int result = PMPI_Start (request);
+	call.done ();
+	return result;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Collectives; the bytes are those the process contributes
+
+extern "C" int MPI_Barrier (MPI_Comm comm) {
+	ProfileCall call (cBarrier, CALLER);
+	int result = PMPI_Barrier (comm);
+	call.done ();
+	return result;
+}
+
+extern "C" int MPI_Bcast (void* buffer, int count, MPI_Datatype datatype, int root, MPI_Comm comm) {
+	ProfileCall call (cBcast, CALLER);
+	int result = PMPI_Bcast (buffer, count, datatype, root, comm);
+	call.done (bytesOf (count, datatype));
+	return result;
+}
+
+extern "C" int MPI_Reduce (MPIPROF_CONST void* sendbuf, void* recvbuf, int count,
+						   MPI_Datatype datatype, MPI_Op op, int root, MPI_Comm comm) {
+	ProfileCall call (cReduce, CALLER);
+	int result = PMPI_Reduce (sendbuf, recvbuf, count, datatype, op, root, comm);
+	call.done (bytesOf (count, datatype));
+	return result;
+}
+
+extern "C" int MPI_Allreduce (MPIPROF_CONST void* sendbuf, void* recvbuf, int count,
+							  MPI_Datatype datatype, MPI_Op op, MPI_Comm comm) {
+	ProfileCall call (cAllreduce, CALLER);
+	int result = PMPI_Allreduce (sendbuf, recvbuf, count, datatype, op, comm);
+	call.done (bytesOf (count, datatype));
+	return result;
+}
+
+extern "C" int MPI_Gather (MPIPROF_CONST void* sendbuf, int sendcount, MPI_Datatype sendtype,
+						   void* recvbuf, int recvcount, MPI_Datatype recvtype,
+						   int root, MPI_Comm comm) {
+	ProfileCall call (cGather, CALLER);
+	int result = PMPI_Gather (sendbuf, sendcount, sendtype, recvbuf, recvcount, recvtype,
+							  root, comm);
+	call.done (bytesOf (sendcount, sendtype));
+	return result;
+}
+
+extern "C" int MPI_Gatherv (MPIPROF_CONST void* sendbuf, int sendcount, MPI_Datatype sendtype,
+							void* recvbuf, MPIPROF_CONST int recvcounts[],
+							MPIPROF_CONST int displs[], MPI_Datatype recvtype,
+							int root, MPI_Comm comm) {
+	ProfileCall call (cGatherv, CALLER);
+	int result = PMPI_Gatherv (sendbuf, sendcount, sendtype, recvbuf, recvcounts, displs,
+							   recvtype, root, comm);
+	call.done (bytesOf (sendcount, sendtype));
+	return result;
+}
+
+extern "C" int MPI_Scatter (MPIPROF_CONST void* sendbuf, int sendcount, MPI_Datatype sendtype,
+							void* recvbuf, int recvcount, MPI_Datatype recvtype,
+							int root, MPI_Comm comm) {
+	ProfileCall call (cScatter, CALLER);
+	int result = PMPI_Scatter (sendbuf, sendcount, sendtype, recvbuf, recvcount, recvtype,
+							   root, comm);
+	call.done (bytesOf (recvcount, recvtype));
+	return result;
+}
+
+extern "C" int MPI_Scatterv (MPIPROF_CONST void* sendbuf, MPIPROF_CONST int sendcounts[],
+							 MPIPROF_CONST int displs[], MPI_Datatype sendtype,
+							 void* recvbuf, int recvcount, MPI_Datatype recvtype,
+							 int root, MPI_Comm comm) {
+	ProfileCall call (cScatterv, CALLER);
+	int result = PMPI_Scatterv (sendbuf, sendcounts, displs, sendtype, recvbuf, recvcount,
+								recvtype, root, comm);
+	call.done (bytesOf (recvcount, recvtype));
+	return result;
+}
+
+extern "C" int MPI_Allgather (MPIPROF_CONST void* sendbuf, int sendcount, MPI_Datatype sendtype,
+							  void* recvbuf, int recvcount, MPI_Datatype recvtype,
+							  MPI_Comm comm) {
+	ProfileCall call (cAllgather, CALLER);
+	int result = PMPI_Allgather (sendbuf, sendcount, sendtype, recvbuf, recvcount, recvtype, comm);
+	call.done (bytesOf (sendcount, sendtype));
+	return result;
+}
+
+extern "C" int MPI_Allgatherv (MPIPROF_CONST void* sendbuf, int sendcount, MPI_Datatype sendtype,
+							   void* recvbuf, MPIPROF_CONST int recvcounts[],
+							   MPIPROF_CONST int displs[], MPI_Datatype recvtype,
+							   MPI_Comm comm) {
+	ProfileCall call (cAllgatherv, CALLER);
+	int result = PMPI_Allgatherv (sendbuf, sendcount, sendtype, recvbuf, recvcounts, displs,
+								  recvtype, comm);
+	call.done (bytesOf (sendcount, sendtype));
+	return result;
+}
+
+extern "C" int MPI_Alltoall (MPIPROF_CONST void* sendbuf, int sendcount, MPI_Datatype sendtype,
+							 void* recvbuf, int recvcount, MPI_Datatype recvtype,
+							 MPI_Comm comm) {
+	ProfileCall call (cAlltoall, CALLER);
+	int result = PMPI_Alltoall (sendbuf, sendcount, sendtype, recvbuf, recvcount, recvtype, comm);
+	int size;
+	PMPI_Comm_size (comm, &size);
+	call.done (size*bytesOf (sendcount, sendtype));
+	return result;
+}
+
+extern "C" int MPI_Alltoallv (MPIPROF_CONST void* sendbuf, MPIPROF_CONST int sendcounts[],
+							  MPIPROF_CONST int sdispls[], MPI_Datatype sendtype,
+							  void* recvbuf, MPIPROF_CONST int recvcounts[],
+							  MPIPROF_CONST int rdispls[], MPI_Datatype recvtype,
+							  MPI_Comm comm) {
+	ProfileCall call (cAlltoallv, CALLER);
+	int result = PMPI_Alltoallv (sendbuf, sendcounts, sdispls, sendtype,
+								 recvbuf, recvcounts, rdispls, recvtype, comm);
+	int size, count = 0;
+	PMPI_Comm_size (comm, &size);
+	for (int i=0; i<size; i++)
+		count += sendcounts[i];
+	call.done (bytesOf (count, sendtype));
+	return result;
+}
+
+extern "C" int MPI_Reduce_scatter (MPIPROF_CONST void* sendbuf, void* recvbuf,
+								   MPIPROF_CONST int recvcounts[], MPI_Datatype datatype,
+								   MPI_Op op, MPI_Comm comm) {
+	ProfileCall call (cReduceScatter, CALLER);
+	int result = PMPI_Reduce_scatter (sendbuf, recvbuf, recvcounts, datatype, op, comm);
+	int size, count = 0;
+	PMPI_Comm_size (comm, &size);
+	for (int i=0; i<size; i++)
+		count += recvcounts[i];
+	call.done (bytesOf (count, datatype));
+	return result;
+}
+
+extern "C" int MPI_Scan (MPIPROF_CONST void* sendbuf, void* recvbuf, int count,
+						 MPI_Datatype datatype, MPI_Op op, MPI_Comm comm) {
+	ProfileCall call (cScan, CALLER);
+	int result = PMPI_Scan (sendbuf, recvbuf, count, datatype, op, comm);
+	call.done (bytesOf (count, datatype));
+	return result;
+}
+
+#if MPI_VERSION >= 3
+extern "C" int MPI_Ibarrier (MPI_Comm comm, MPI_Request* request) {
+	ProfileCall call (cIbarrier, CALLER);
+	int result = PMPI_Ibarrier (comm, request);
+	call.done ();
+	return result;
+}
+
+extern "C" int MPI_Ibcast (void* buffer, int count, MPI_Datatype datatype, int root,
+						   MPI_Comm comm, MPI_Request* request) {
+	ProfileCall call (cIbcast, CALLER);
+	int result = PMPI_Ibcast (buffer, count, datatype, root, comm, request);
+	call.done (bytesOf (count, datatype));
+	return result;
+}
+
+extern "C" int MPI_Iallreduce (const void* sendbuf, void* recvbuf, int count,
+							   MPI_Datatype datatype, MPI_Op op, MPI_Comm comm,
+							   MPI_Request* request) {
+	ProfileCall call (cIallreduce, CALLER);
+	int result = PMPI_Iallreduce (sendbuf, recvbuf, count, datatype, op, comm, request);
+	call.done (bytesOf (count, datatype));
+	return result;
+}
+
+extern "C" int MPI_Iallgather (const void* sendbuf, int sendcount, MPI_Datatype sendtype,
+							   void* recvbuf, int recvcount, MPI_Datatype recvtype,
+							   MPI_Comm comm, MPI_Request* request) {
+	ProfileCall call (cIallgather, CALLER);
+	int result = PMPI_Iallgather (sendbuf, sendcount, sendtype, recvbuf, recvcount, recvtype,
+								  comm, request);
+	call.done (bytesOf (sendcount, sendtype));
+	return result;
+}
+#endif
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// One-sided
+
+#if MPI_VERSION >= 2
+extern "C" int MPI_Put (MPIPROF_CONST void* origin, int count, MPI_Datatype datatype,
+						int target, MPI_Aint disp, int targetCount, MPI_Datatype targetType,
+						MPI_Win win) {
+	ProfileCall call (cPut, CALLER);
+	int result = PMPI_Put (origin, count, datatype, target, disp, targetCount, targetType, win);
+	call.done (bytesOf (count, datatype), win, target, false);
+	return result;
+}
+
+extern "C" int MPI_Get (void* origin, int count, MPI_Datatype datatype,
+						int target, MPI_Aint disp, int targetCount, MPI_Datatype targetType,
+						MPI_Win win) {
+	ProfileCall call (cGet, CALLER);
+	int result = PMPI_Get (origin, count, datatype, target, disp, targetCount, targetType, win);
+	call.done (bytesOf (count, datatype), win, target, true);
+	return result;
+}
+
+extern "C" int MPI_Accumulate (MPIPROF_CONST void* origin, int count, MPI_Datatype datatype,
+							   int target, MPI_Aint disp, int targetCount,
+							   MPI_Datatype targetType, MPI_Op op, MPI_Win win) {
+	ProfileCall call (cAccumulate, CALLER);
+	int result = PMPI_Accumulate (origin, count, datatype, target, disp, targetCount,
+								  targetType, op, win);
+	call.done (bytesOf (count, datatype), win, target, false);
+	return result;
+}
+
+extern "C" int MPI_Win_fence (int assertion, MPI_Win win) {
+	ProfileCall call (cFence, CALLER);
+	int result = PMPI_Win_fence (assertion, win);
+	call.done ();
+	return result;
+}
+
+extern "C" int MPI_Win_post (MPI_Group group, int assertion, MPI_Win win) {
+	ProfileCall call (cPost, CALLER);
+	int result = PMPI_Win_post (group, assertion, win);
+	call.done ();
+	return result;
+}
+
+extern "C" int MPI_Win_start (MPI_Group group, int assertion, MPI_Win win) {
+	ProfileCall call (cWinStart, CALLER);
+	int result = PMPI_Win_start (group, assertion, win);
+	call.done ();
+	return result;
+}
+
+extern "C" int MPI_Win_complete (MPI_Win win) {
+	ProfileCall call (cComplete, CALLER);
+	int result = PMPI_Win_complete (win);
+	call.done ();
+	return result;
+}
+
+extern "C" int MPI_Win_wait (MPI_Win win) {
+	ProfileCall call (cWinWait, CALLER);
+	int result = PMPI_Win_wait (win);
+	call.done ();
+	return result;
+}
+
+extern "C" int MPI_Win_lock (int lockType, int rank, int assertion, MPI_Win win) {
+	ProfileCall call (cLock, CALLER);
+	int result = PMPI_Win_lock (lockType, rank, assertion, win);
+	call.done ();
+	return result;
+}
+
+extern "C" int MPI_Win_unlock (int rank, MPI_Win win) {
+	ProfileCall call (cUnlock, CALLER);
+	int result = PMPI_Win_unlock (rank, win);
+	call.done ();
+	return result;
+}
+#endif
+
+#if MPI_VERSION >= 3
+extern "C" int MPI_Win_lock_all (int assertion, MPI_Win win) {
+	ProfileCall call (cLockAll, CALLER);
+	int result = PMPI_Win_lock_all (assertion, win);
+	call.done ();
+	return result;
+}
+
+extern "C" int MPI_Win_unlock_all (MPI_Win win) {
+	ProfileCall call (cUnlockAll, CALLER);
+	int result = PMPI_Win_unlock_all (win);
+	call.done ();
+	return result;
+}
+
+extern "C" int MPI_Win_flush (int rank, MPI_Win win) {
+	ProfileCall call (cFlush, CALLER);
+	int result = PMPI_Win_flush (rank, win);
+	call.done ();
+	return result;
+}
+
+extern "C" int MPI_Win_sync (MPI_Win win) {
+	ProfileCall call (cSync, CALLER);
+	int result = PMPI_Win_sync (win);
+	call.done ();
+	return result;
+}
+#endif
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//   |   | ----  --- ----             _  o |                                //
+//   |\ /| |   )  |  |   )           /     |                                //
+//   | V | |---   |  |---  |/\  __  -+-  | |  ___   |/\                     //
+//   | | | |      |  |     |   /  \  |   | | /   )  |                       //
+//   |   | |     _|_ |     |   \__/  |   | | |---   |                       //
+//                                            \__                           //
+//////////////////////////////////////////////////////////////////////////////
+
+/** A label of a call site that is the same in all processes running
+ *  the same program: the function and offset if the symbol is known,
+ *  and otherwise the offset in the program or library, which does not
+ *  depend on where it was loaded.
+ **/
+static void siteLabel (void* site, char* label) {
+	Dl_info info;
+	if (!site) {
+		strcpy (label, "(other sites)");
+	} else if (dladdr (site, &info) && info.dli_fname) {
+		if (info.dli_sname) {
+			int status;
+			char* name = abi::__cxa_demangle (info.dli_sname, NULL, NULL, &status);
+			snprintf (label, cLabelLen, "%s+0x%lx", status==0? name : info.dli_sname,
+					  (unsigned long) ((char*) site - (char*) info.dli_saddr));
+			free (name);
+		} else {
+			const char* file = strrchr (info.dli_fname, '/');
+			snprintf (label, cLabelLen, "%s+0x%lx", file? file+1 : info.dli_fname,
+					  (unsigned long) ((char*) site - (char*) info.dli_fbase));
+		}
+	} else
+		snprintf (label, cLabelLen, "%p", site);
+}
+
+static int compareSiteLabels (const void* a, const void* b) {
+	const SiteRecord* x = (const SiteRecord*) a;
+	const SiteRecord* y = (const SiteRecord*) b;
+	int order = strcmp (x->label, y->label);
+	return order? order : x->op - y->op;
+}
+
+static int compareSiteTimes (const void* a, const void* b) {
+	double x = ((const SiteRecord*) a)->time, y = ((const SiteRecord*) b)->time;
+	return (x>y)? -1 : (x<y)? 1 : 0;
+}
+
+/** Prints a time histogram on the line, in powers of two of
+ *  microseconds; a bucket includes its lower bound.
+ **/
+static void printHistogram (FILE* out, const double* hist) {
+	for (int b=0; b<cBuckets; b++)
+		if (hist[b] > 0) {
+			if (b == 0)
+				fprintf (out, " <1:%.0f", hist[b]);
+			else
+				fprintf (out, " %.0f-%.0f:%.0f", ldexp (1.0, b-1), ldexp (1.0, b), hist[b]);
+		}
+	fprintf (out, "\n");
+}
+
+/** Bytes with a binary unit, in a static buffer. */
+static const char* humanBytes (double bytes) {
+	static char buffer [16];
+	const char* units = " KMGTP";
+	int unit = 0;
+	while (bytes >= 1024.0 && unit < 5) {
+		bytes /= 1024.0;
+		unit++;
+	}
+	if (unit == 0)
+		snprintf (buffer, 16, "%.0f", bytes);
+	else
+		snprintf (buffer, 16, "%.1f%c", bytes, units[unit]);
+	return buffer;
+}
+
+void MPIProfiler::report () {
+	if (!sEnabled)
+		return;
+	{
+		MPILock lock (sMutex);
+		sEnabled = false;
+	}
+
+	int rank, size = sSize;
+	PMPI_Comm_rank (MPI_COMM_WORLD, &rank);
+	bool master = (rank == 0);
+
+	// Operations, summed and the slowest process
+	double elapsed = PMPI_Wtime() - sStart;
+	double localTimes [cOps+2];
+	for (int op=0; op<cOps; op++)
+		localTimes[op] = sOps[op].time;
+	localTimes[cOps] = 0.0;
+	for (int op=0; op<cOps; op++)
+		localTimes[cOps] += sOps[op].time;
+	localTimes[cOps+1] = elapsed;
+	OpStats totals [cOps];
+	double maxTimes [cOps+2], sumTimes [cOps+2];
+	PMPI_Reduce (sOps, totals, cOps*cOpStatsLen, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+	PMPI_Reduce (localTimes, maxTimes, cOps+2, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+	PMPI_Reduce (localTimes, sumTimes, cOps+2, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+
+	// The matrix rows of the bytes each process sent, and the columns
+	// of the bytes it got
+	double* sent = master? new double [size*size] : NULL;
+	double* got = master? new double [size*size] : NULL;
+	PMPI_Gather (spSentTo, size, MPI_DOUBLE, sent, size, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+	PMPI_Gather (spGotFrom, size, MPI_DOUBLE, got, size, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+
+	// The calls with each peer, summed over the processes
+	double* peerTime = master? new double [size] : NULL;
+	double* peerHist = master? new double [size*cBuckets] : NULL;
+	PMPI_Reduce (spPeerTime, peerTime, size, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+	PMPI_Reduce (spPeerHist, peerHist, size*cBuckets, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+
+	// The call sites with their labels
+	int count = 0;
+	SiteRecord* local = new SiteRecord [cSites];
+	for (int i=0; i<cSites; i++)
+		if (sSites[i].count > 0) {
+			SiteRecord& record = local[count++];
+			siteLabel (sSites[i].site, record.label);
+			record.op = sSites[i].op;
+			record.procs = 1;
+			record.count = sSites[i].count;
+			record.bytes = sSites[i].bytes;
+			record.time = sSites[i].time;
+			memcpy (record.hist, sSites[i].hist, sizeof(record.hist));
+		}
+	int bytes = count*sizeof(SiteRecord);
+	int* counts = master? new int [size] : NULL;
+	int* displs = master? new int [size] : NULL;
+	PMPI_Gather (&bytes, 1, MPI_INT, counts, 1, MPI_INT, 0, MPI_COMM_WORLD);
+	SiteRecord* sites = NULL;
+	int nsites = 0;
+	if (master) {
+		for (int i=0; i<size; i++) {
+			displs[i] = nsites*sizeof(SiteRecord);
+			nsites += counts[i]/sizeof(SiteRecord);
+		}
+		sites = new SiteRecord [nsites? nsites : 1];
+	}
+	PMPI_Gatherv (local, bytes, MPI_BYTE, sites, counts, displs, MPI_BYTE, 0, MPI_COMM_WORLD);
+	delete [] local;
+
+	if (master) {
+		FILE* out = stderr;
+		const char* file = getenv ("MPIPROF_FILE");
+		if (file && *file && !(out = fopen (file, "w"))) {
+			fprintf (stderr, "Can't open '%s' for writing, profiling to stderr\n", file);
+			out = stderr;
+		}
+		const char* top = getenv ("MPIPROF_TOP");
+		int ntop = top? atoi (top) : cTopDefault;
+		double mpiTime = sumTimes[cOps];
+
+		fprintf (out, "\nMPI profile of %d processes: %.3f s elapsed, %.3f s in MPI (%.1f%%)\n",
+				 size, maxTimes[cOps+1], mpiTime/size,
+				 sumTimes[cOps+1]>0? 100*mpiTime/sumTimes[cOps+1] : 0.0);
+
+		// Operations
+		fprintf (out, "\n%-14s %10s %10s %10s %10s %10s %6s\n",
+				 "operation", "calls", "bytes", "time(s)", "mean(us)", "max(s)", "%mpi");
+		for (int op=0; op<cOps; op++)
+			if (totals[op].count > 0)
+				fprintf (out, "%-14s %10.0f %10s %10.3f %10.2f %10.3f %6.1f\n",
+						 opNames[op], totals[op].count, humanBytes (totals[op].bytes),
+						 totals[op].time, 1E6*totals[op].time/totals[op].count,
+						 maxTimes[op], mpiTime>0? 100*totals[op].time/mpiTime : 0.0);
+
+		// Time histograms
+		fprintf (out, "\nCalls by duration (us)\n");
+		for (int op=0; op<cOps; op++) {
+			if (totals[op].count == 0)
+				continue;
+			fprintf (out, "%-14s", opNames[op]);
+			printHistogram (out, totals[op].hist);
+		}
+
+		// The same by peer; the peers with the most time in big worlds
+		fprintf (out, "\nCalls with a peer by duration (us)\n%6s %10s\n", "peer", "time(s)");
+		for (int n=0; n<size && (size<=cMatrixMax || n<ntop); n++) {
+			int peer = n;
+			if (size > cMatrixMax) {
+				peer = 0;
+				for (int k=1; k<size; k++)
+					if (peerTime[k] > peerTime[peer])
+						peer = k;
+				if (peerTime[peer] <= 0)
+					break;
+			}
+			double calls = 0;
+			for (int b=0; b<cBuckets; b++)
+				calls += peerHist[peer*cBuckets+b];
+			if (calls > 0) {
+				fprintf (out, "%6d %10.3f", peer, peerTime[peer]);
+				printHistogram (out, peerHist+peer*cBuckets);
+			}
+			peerTime[peer] = -1;
+		}
+
+		// Communication matrix; the largest pairs in big worlds
+		for (int i=0; i<size; i++)
+			for (int j=0; j<size; j++)
+				sent[i*size+j] += got[j*size+i];
+		if (size <= cMatrixMax) {
+			fprintf (out, "\nBytes sent from row to column\n%6s", "");
+			for (int j=0; j<size; j++)
+				fprintf (out, " %8d", j);
+			fprintf (out, "\n");
+			for (int i=0; i<size; i++) {
+				fprintf (out, "%6d", i);
+				for (int j=0; j<size; j++)
+					fprintf (out, " %8s", humanBytes (sent[i*size+j]));
+				fprintf (out, "\n");
+			}
+		} else {
+			fprintf (out, "\nLargest transfers\n%6s %6s %10s\n", "from", "to", "bytes");
+			for (int n=0; n<ntop; n++) {
+				int best = 0;
+				for (int k=1; k<size*size; k++)
+					if (sent[k] > sent[best])
+						best = k;
+				if (sent[best] <= 0)
+					break;
+				fprintf (out, "%6d %6d %10s\n", best/size, best%size, humanBytes (sent[best]));
+				sent[best] = -1;
+			}
+		}
+
+		// Hotspots; the same site of different processes is merged
+		qsort (sites, nsites, sizeof(SiteRecord), compareSiteLabels);
+		int merged = 0;
+		for (int i=0; i<nsites; i++) {
+			if (merged > 0 && compareSiteLabels (&sites[merged-1], &sites[i]) == 0) {
+				SiteRecord& site = sites[merged-1];
+				site.procs++;
+				site.count += sites[i].count;
+				site.bytes += sites[i].bytes;
+				site.time += sites[i].time;
+				for (int b=0; b<cBuckets; b++)
+					site.hist[b] += sites[i].hist[b];
+			} else
+				sites[merged++] = sites[i];
+		}
+		qsort (sites, merged, sizeof(SiteRecord), compareSiteTimes);
+		fprintf (out, "\nTop %d call sites by time\n%10s %6s %10s %10s %6s %-14s %s\n", ntop,
+				 "time(s)", "%mpi", "calls", "bytes", "procs", "operation", "site");
+		for (int i=0; i<merged && i<ntop; i++) {
+			fprintf (out, "%10.3f %6.1f %10.0f %10s %6d %-14s %s\n",
+					 sites[i].time, mpiTime>0? 100*sites[i].time/mpiTime : 0.0, sites[i].count,
+					 humanBytes (sites[i].bytes), sites[i].procs, opNames[sites[i].op],
+					 sites[i].label);
+
+			// The durations of the calls, in us, below the site
+			fprintf (out, "%10s", "");
+			printHistogram (out, sites[i].hist);
+		}
+		fprintf (out, "\n");
+
+		if (out != stderr)
+			fclose (out);
+		delete [] sent;
+		delete [] got;
+		delete [] peerTime;
+		delete [] peerHist;
+		delete [] counts;
+		delete [] displs;
+		delete [] sites;
+	}
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef __MPIPROF_H__
+#define __MPIPROF_H__
+
+#include "../config.h"
+
+#ifdef ENABLE_MPIPROF
+
+#include "mpi++.h"
+
+/** The communication profiler.
+ *
+ *  When the library is built with ENABLE_MPIPROF, defined in config.h
+ *  or with "make MPIPROF=-DENABLE_MPIPROF" in libsrc, it defines the
+ *  MPI functions through the PMPI profiling interface. Every MPI call
+ *  of the program, whether made through MPIComm or directly, is then
+ *  counted with its bytes and time for the operation, for the peer
+ *  process and for the call site. The MPIInstance aggregates the
+ *  statistics of all processes when it shuts down, and the first
+ *  process prints a report of the operations, the peers and the
+ *  hotspots with their time histograms, and of the communication
+ *  matrix.
+ *
+ *  The call site of an MPI call made by a method of the library is
+ *  the code that called the method, and otherwise the code that
+ *  called the MPI function. The sites are shown as function+offset
+ *  when the program is linked with -rdynamic, and otherwise as
+ *  program+offset, which addr2line can resolve.
+ *
+ *  The report goes to the standard error, or to the file named by
+ *  the MPIPROF_FILE environment variable. MPIPROF_TOP sets the number
+ *  of hotspots to show (10 by default).
+ **/
+class MPIProfiler {
+  public:
+	/** Aggregates the statistics of all processes of the world, and
+	 *  prints the report in the first process. Called by all
+	 *  processes before finalizing MPI; the calls made after it are
+	 *  not recorded.
+	 **/
+	static void		report			();
+};
+
+/** Makes the caller of the enclosing method the call site of the MPI
+ *  calls it makes, unless an outer method already set the site.
+ **/
+class MPIProfileSite {
+  public:
+					MPIProfileSite	(void* caller);
+					~MPIProfileSite	();
+
+  private:
+	bool			mOuter;
+};
+
+#define MPIPROF_SITE MPIProfileSite mpiprofSite (__builtin_return_address (0))
+
+#else
+
+#define MPIPROF_SITE
+
+#endif
+
+#endif
@@ -0,0 +1,242 @@
+#include "mpitaskfarm.h"
+#include <unistd.h>
+
+//////////////////////////////////////////////////////////////////////////////
+//   |   | ----  --- -----              |    -----                          //
+//   |\ /| |   )  |    |    ___   ____  | /  |      ___  |/\  |/|/|          //
+//   | V | |---   |    |    ___| (      |/   |---   ___| |    | | |          //
+//   | | | |      |    |   (   |  \__   | \  |     (   | |    | | |          //
+//   |   | |     _|_   |    \__| ____)  |  \ |      \__| |    | | |          //
+//////////////////////////////////////////////////////////////////////////////
+
+MPITaskFarm::MPITaskFarm (MPIComm& comm, int chunk, int prefetch, bool stealing)
+		: mComm (comm), mChannel (comm), mChunk (chunk>0? chunk:1), mPrefetch (prefetch>0? prefetch:1),
+		  mStealing (stealing), mPollInterval (0), mEpoch (0), mInJob (false), mEnding (false), mAcked (false),
+		  mFinished (false), mPendingSteal (false), mFailedSteals (0), mVictim (0),
+		  mFirst (0), mEnd (0) {
+}
+
+int MPITaskFarm::farm (int ntasks, const void* params, int paramlen) {
+	int workers = mComm.size()-1;
+	mEpoch++;
+
+	// Announce the job to the workers
+	for (int w=1; w<=workers; w++) {
+		post (w, cJob, ntasks, paramlen);
+		if (paramlen)
+			mChannel.send (const_cast<void*>(params), paramlen, MPI_BYTE, w);
+	}
+	ntasks = beginJob (params, paramlen, ntasks);
+
+	int done = 0;
+	if (!workers) {
+		// Nobody to farm the tasks to; do them ourselves
+		for (int first=0; first<ntasks; first+=mChunk) {
+			if (mPollInterval && cancelled ())
+				break;
+			int count = (ntasks-first<mChunk)? ntasks-first : mChunk;
+			process (first, count);
+			done += count;
+		}
+	} else {
+		int next = 0; // Next task to hand out in the central mode
+
+		// Give every worker a few chunks in advance, so that they
+		// never have to wait for us.
+		if (!mStealing)
+			for (int p=0; p<mPrefetch; p++)
+				for (int w=1; w<=workers && next<ntasks; w++) {
+					int count = (ntasks-next<mChunk)? ntasks-next : mChunk;
+					post (w, cTask, next, count);
+					next += count;
+				}
+
+		// Collect the completion reports and keep the workers busy
+		int msg[4];
+		MPI_Status status;
+		while (done < ntasks) {
+			// Check for cancellation while there is nothing to receive
+			if (mPollInterval && !mChannel.iprobe (MPI_ANY_SOURCE, &status)) {
+				if (cancelled ())
+					break;
+				usleep (mPollInterval);
+				continue;
+			}
+
+			int source = receive (msg);
+			if (msg[0] != cDone || msg[1] != mEpoch)
+				continue;
+			done += msg[3];
+
+			if (!mStealing && next<ntasks) {
+				int count = (ntasks-next<mChunk)? ntasks-next : mChunk;
+				post (source, cTask, next, count);
+				next += count;
+			}
+		}
+
+		// End the job. The workers acknowledge only when they have no
+		// steal requests pending, so after all acknowledgements
+		// nobody waits for anybody. If the job was cancelled, the
+		// workers still finish the chunks they have received before
+		// the end; their reports are ignored.
+		for (int w=1; w<=workers; w++)
+			post (w, cEndJob);
+		for (int acks=0; acks<workers; ) {
+			receive (msg);
+			if (msg[0] == cAck && msg[1] == mEpoch)
+				acks++;
+		}
+		for (int w=1; w<=workers; w++)
+			post (w, cCloseJob);
+	}
+
+	endJob ();
+	return done;
+}
+
+void MPITaskFarm::finish () {
+	for (int w=1; w<mComm.size(); w++)
+		post (w, cFinish);
+}
+
+void MPITaskFarm::serve () {
+	int msg[4];
+	MPI_Status status;
+	mFinished = false;
+	while (!mFinished) {
+		if (mStealing && mInJob && !mEnding) {
+			// Answer any steal requests between the chunks
+			while (!mEnding && mChannel.iprobe (MPI_ANY_SOURCE, &status)) {
+				int source = receive (msg);
+				handle (msg, source);
+			}
+
+			// Work on our own tasks as long as there are any
+			if (!mEnding && mFirst<mEnd) {
+				int count = (mEnd-mFirst<mChunk)? mEnd-mFirst : mChunk;
+				mFirst += count;
+				work (mFirst-count, count);
+				continue;
+			}
+
+			// Out of tasks; try to steal some
+			if (!mEnding && !mPendingSteal)
+				steal ();
+		}
+
+		// Wait for the next message
+		int source = receive (msg);
+		handle (msg, source);
+	}
+}
+
+void MPITaskFarm::post (int target, int type, int a, int b) {
+	int msg[4] = {type, mEpoch, a, b};
+	mChannel.send (msg, 4, MPI_INT, target);
+}
+
+int MPITaskFarm::receive (int msg[4]) {
+	MPI_Status status;
+	mChannel.recv (msg, 4, MPI_INT, MPI_ANY_SOURCE, &status);
+	return status.MPI_SOURCE;
+}
+
+void MPITaskFarm::handle (const int msg[4], int source) {
+	switch (msg[0]) {
+	  case cJob: {
+		  mEpoch			= msg[1];
+		  mInJob			= true;
+		  mEnding			= false;
+		  mAcked			= false;
+		  mPendingSteal		= false;
+		  mFailedSteals		= 0;
+
+		  // The job parameters follow the job message
+		  int paramlen = msg[3];
+		  if (paramlen) {
+			  mParams.ensure (paramlen+1);
+			  mChannel.recv (mParams.getbuffer(), paramlen, MPI_BYTE, 0);
+		  }
+		  int ntasks = beginJob (paramlen? mParams.getbuffer() : NULL, paramlen, msg[2]);
+
+		  // In the stealing mode, we start with an even share of the
+		  // tasks, and steal first from the next worker.
+		  mFirst = mEnd = 0;
+		  if (mStealing) {
+			  int workers = mComm.size()-1;
+			  int w = mComm.getRank()-1;
+			  mFirst	= int (double(ntasks)*w/workers);
+			  mEnd		= int (double(ntasks)*(w+1)/workers);
+			  mVictim	= (w+1)%workers + 1;
+		  }
+	  } break;
+
+	  case cTask:
+		  work (msg[2], msg[3]);
+		  break;
+
+	  case cSteal: {
+		  // Give away the latter half of the remaining tasks, if there
+		  // is more than one chunk left.
+		  int give = 0;
+		  if (mInJob && !mEnding && msg[1]==mEpoch && mEnd-mFirst>mChunk)
+			  give = (mEnd-mFirst)/2;
+		  mEnd -= give;
+		  post (source, cStealReply, mEnd, give);
+	  } break;
+
+	  case cStealReply:
+		  mPendingSteal = false;
+		  if (msg[3]>0 && mInJob && !mEnding) {
+			  mFirst = msg[2];
+			  mEnd = msg[2]+msg[3];
+			  mFailedSteals = 0;
+		  } else
+			  mFailedSteals++;
+		  break;
+
+	  case cEndJob:
+		  mEnding = true;
+		  mFirst = mEnd = 0;
+		  break;
+
+	  case cCloseJob:
+		  mInJob = false;
+		  endJob ();
+		  break;
+
+	  case cFinish:
+		  mFinished = true;
+		  break;
+	}
+
+	// Acknowledge the end of the job once we no longer wait for a
+	// reply from anybody.
+	if (mEnding && !mAcked && !mPendingSteal) {
+		post (0, cAck);
+		mAcked = true;
+	}
+}
+
+void MPITaskFarm::work (int first, int count) {
+	process (first, count);
+	post (0, cDone, first, count);
+}
+
+void MPITaskFarm::steal () {
+	int workers = mComm.size()-1;
+
+	// Give up when all the other workers have been tried in vain;
+	// they are then about to finish their last chunks anyway.
+	if (workers<2 || mFailedSteals>=workers-1)
+		return;
+
+	post (mVictim, cSteal);
+	mPendingSteal = true;
+
+	// Next victim, skipping ourselves
+	mVictim = mVictim%workers + 1;
+	if (mVictim == mComm.getRank())
+		mVictim = mVictim%workers + 1;
+}
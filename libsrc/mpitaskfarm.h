@@ -0,0 +1,162 @@
+#ifndef __MPITASKFARM_H__
+#define __MPITASKFARM_H__
+
+#include "mpi++.h"
+
+//////////////////////////////////////////////////////////////////////////////
+//   |   | ----  --- -----              |    -----                          //
+//   |\ /| |   )  |    |    ___   ____  | /  |      ___  |/\  |/|/|          //
+//   | V | |---   |    |    ___| (      |/   |---   ___| |    | | |          //
+//   | | | |      |    |   (   |  \__   | \  |     (   | |    | | |          //
+//   |   | |     _|_   |    \__| ____)  |  \ |      \__| |    | | |          //
+//////////////////////////////////////////////////////////////////////////////
+
+/** A dynamically load-balanced farm of tasks.
+ *
+ *  The process with rank 0 is the master, and the other processes are
+ *  workers. The master farms out jobs with farm(); the workers serve
+ *  them in serve() until the master calls finish(). A job consists of
+ *  tasks numbered 0...ntasks-1, and a block of job parameters, which
+ *  is delivered to all workers as such. The workers process the tasks
+ *  in chunks of consecutive tasks by calling process().
+ *
+ *  There are two scheduling modes:
+ *
+ *  In the central mode, the master hands out the chunks one by one,
+ *  keeping prefetch chunks outstanding for every worker so that the
+ *  workers never wait for the master.
+ *
+ *  In the stealing mode, the tasks are initially divided evenly among
+ *  the workers. A worker that runs out of tasks steals half of the
+ *  remaining tasks of another worker. The master only keeps count of
+ *  the completed tasks.
+ *
+ *  All control messages are small binary descriptors. They travel in
+ *  a channel of their own, so the farm must be created in the same
+ *  order with respect to the other channels in all processes.
+ *
+ *  Design Patterns: Template Method.
+ **/
+class MPITaskFarm : public Object {
+  public:
+	/** Creates the farm.
+	 *
+	 *  @param chunk Number of consecutive tasks processed at a time.
+	 *  @param prefetch Number of chunks outstanding for a worker in
+	 *  the central mode.
+	 *  @param stealing Use the stealing mode instead of the central
+	 *  mode.
+	 **/
+					MPITaskFarm		(MPIComm& comm, int chunk=1, int prefetch=2, bool stealing=false);
+
+	/** Farms out a job and waits until all its tasks have been
+	 *  processed, or until the job is cancelled. Called by the
+	 *  master.
+	 *
+	 *  If there are no workers, the master processes the tasks
+	 *  itself.
+	 *
+	 *  Returns the number of tasks processed; less than ntasks if the
+	 *  job was cancelled.
+	 **/
+	int				farm			(int ntasks, const void* params=NULL, int paramlen=0);
+
+	/** Terminates the workers. Called by the master. */
+	void			finish			();
+
+	/** Makes the master poll cancelled() every interval microseconds
+	 *  while it waits for the workers. Zero (default) disables the
+	 *  polling.
+	 **/
+	void			pollCancel		(int interval) {mPollInterval = interval;}
+
+	/** Serves jobs until the master calls finish(). Called by the
+	 *  workers.
+	 **/
+	void			serve			();
+
+	/** Returns true in the master process. */
+	bool			isMaster		() const {return mComm.getRank()==0;}
+
+	MPIComm&		comm			() {return mComm;}
+	MPIChannel&		channel			() {return mChannel;}
+
+  protected:
+	/** Called in all processes when a job begins, before any tasks
+	 *  are processed, with the parameters given to farm(). May return
+	 *  a different number of tasks than given, but the number must
+	 *  then be the same in all processes.
+	 *
+	 *  All processes call this, so the method may use collective
+	 *  operations.
+	 **/
+	virtual int		beginJob		(const void*, int, int ntasks) {return ntasks;}
+
+	/** Processes the tasks first...first+count-1. Must be
+	 *  implemented.
+	 **/
+	virtual void	process			(int first, int count)=0;
+
+	/** Called in all processes after all tasks of a job have been
+	 *  processed. All processes call this, so the method may use
+	 *  collective operations.
+	 **/
+	virtual void	endJob			() {}
+
+	/** Polled by the master during a job, if enabled with
+	 *  pollCancel(). Returning true cancels the job: no more tasks
+	 *  are handed out, and the job ends when the workers have
+	 *  finished the chunks they already have. endJob() is called
+	 *  normally.
+	 **/
+	virtual bool	cancelled		() {return false;}
+
+  private:
+	/** Control message types. */
+	enum {cJob, cTask, cDone, cEndJob, cAck, cCloseJob, cSteal, cStealReply, cFinish};
+
+	/** Sends a control message. */
+	void			post			(int target, int type, int a=0, int b=0);
+
+	/** Receives a control message from any process. Returns the
+	 *  sender.
+	 **/
+	int				receive			(int msg[4]);
+
+	/** Handles a control message in a worker. */
+	void			handle			(const int msg[4], int source);
+
+	/** Processes a chunk of tasks and reports it to the master. */
+	void			work			(int first, int count);
+
+	/** Sends a steal request to the next victim, if there is any
+	 *  point in it.
+	 **/
+	void			steal			();
+
+	MPIComm&		mComm;
+	MPIChannel		mChannel;		// Control messages and job parameters
+	int				mChunk;
+	int				mPrefetch;
+	bool			mStealing;
+	int				mPollInterval;
+
+	/** Current job number. Messages of earlier jobs are recognized by
+	 *  it.
+	 **/
+	int				mEpoch;
+
+	// Worker state
+	bool			mInJob;			// Between cJob and cCloseJob
+	bool			mEnding;		// Master has ended the job
+	bool			mAcked;			// End of job acknowledged
+	bool			mFinished;		// Master has terminated the farm
+	bool			mPendingSteal;	// Waiting for a steal reply
+	int				mFailedSteals;	// Unsuccessful steals in a row
+	int				mVictim;		// Next worker to steal from
+	int				mFirst;			// First unprocessed own task
+	int				mEnd;			// End of own tasks
+	String			mParams;		// Parameters of the current job
+};
+
+#endif
@@ -0,0 +1,196 @@
+#include "mpiwindow.h"
+#include "mpiprof.h"
+
+#if MPI_VERSION >= 2
+
+MPIGroup::MPIGroup (MPIComm& comm, const int* ranks, int count) : mSize (count) {
+	MPI_Group all;
+	int errcode;
+	MPI_Comm_group (comm.getCommTag(), &all);
+	errcode = MPI_Group_incl (all, count, (int*) ranks, &mGroup);
+	MPI_Group_free (&all);
+	if (errcode != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIGroup::MPIGroup(): %s\n",
+								 (CONSTR) comm.mpi().error(errcode)));
+}
+
+MPIGroup::~MPIGroup () {
+	MPI_Group_free (&mGroup);
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//   |   | ----  --- |   | o           |                                    //
+//   |\ /| |   )  |  |   |             |                                    //
+//   | V | |---   |  | | | | |/ \    __|  __  |   |                         //
+//   | | | |      |  | | | | |   |  (  | /  \ | | |                         //
+//   |   | |     _|_  V V  | |   |   --| \__/  V V                          //
+//////////////////////////////////////////////////////////////////////////////
+
+MPIWindow::MPIWindow (MPIComm& comm, void* base, int bytes, int dispUnit)
+		: mComm (comm), mpBase (base) {
+	int errcode;
+	if ((errcode=MPI_Win_create (base, bytes, dispUnit, MPI_INFO_NULL, comm.getCommTag(),
+								 &mWin)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIWindow::MPIWindow(): %s\n",
+								 (CONSTR) comm.mpi().error(errcode)));
+}
+
+MPIWindow::~MPIWindow () {
+	if (mWin != MPI_WIN_NULL)
+		MPI_Win_free (&mWin);
+}
+
+void MPIWindow::put (const void* origin, int count, MPI_Datatype datatype,
+					 int target, MPI_Aint disp, MPI_Datatype targetType) {
+	MPIPROF_SITE;
+	if (targetType == MPI_DATATYPE_NULL)
+		targetType = datatype;
+	int errcode;
+	if ((errcode=MPI_Put ((void*) origin, count, datatype, target, disp, count, targetType,
+						  mWin)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIWindow::put(): %s\n",
+								 (CONSTR) mComm.mpi().error(errcode)));
+}
+
+void MPIWindow::get (void* origin, int count, MPI_Datatype datatype,
+					 int target, MPI_Aint disp, MPI_Datatype targetType) {
+	MPIPROF_SITE;
+	if (targetType == MPI_DATATYPE_NULL)
+		targetType = datatype;
+	int errcode;
+	if ((errcode=MPI_Get (origin, count, datatype, target, disp, count, targetType,
+						  mWin)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIWindow::get(): %s\n",
+								 (CONSTR) mComm.mpi().error(errcode)));
+}
+
+void MPIWindow::accumulate (const void* origin, int count, MPI_Datatype datatype,
+							int target, MPI_Aint disp, MPI_Op op, MPI_Datatype targetType) {
+	MPIPROF_SITE;
+	if (targetType == MPI_DATATYPE_NULL)
+		targetType = datatype;
+	int errcode;
+	if ((errcode=MPI_Accumulate ((void*) origin, count, datatype, target, disp, count, targetType,
+								 op, mWin)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIWindow::accumulate(): %s\n",
+								 (CONSTR) mComm.mpi().error(errcode)));
+}
+
+void MPIWindow::fence (int assertion) {
+	MPIPROF_SITE;
+	int errcode;
+	if ((errcode=MPI_Win_fence (assertion, mWin)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIWindow::fence(): %s\n",
+								 (CONSTR) mComm.mpi().error(errcode)));
+}
+
+void MPIWindow::post (const MPIGroup& origins, int assertion) {
+	MPIPROF_SITE;
+	int errcode;
+	if ((errcode=MPI_Win_post (origins.getGroup(), assertion, mWin)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIWindow::post(): %s\n",
+								 (CONSTR) mComm.mpi().error(errcode)));
+}
+
+void MPIWindow::start (const MPIGroup& targets, int assertion) {
+	MPIPROF_SITE;
+	int errcode;
+	if ((errcode=MPI_Win_start (targets.getGroup(), assertion, mWin)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIWindow::start(): %s\n",
+								 (CONSTR) mComm.mpi().error(errcode)));
+}
+
+void MPIWindow::complete () {
+	MPIPROF_SITE;
+	int errcode;
+	if ((errcode=MPI_Win_complete (mWin)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIWindow::complete(): %s\n",
+								 (CONSTR) mComm.mpi().error(errcode)));
+}
+
+void MPIWindow::wait () {
+	MPIPROF_SITE;
+	int errcode;
+	if ((errcode=MPI_Win_wait (mWin)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIWindow::wait(): %s\n",
+								 (CONSTR) mComm.mpi().error(errcode)));
+}
+
+void MPIWindow::lock (int target, bool exclusive) {
+	MPIPROF_SITE;
+	int errcode;
+	if ((errcode=MPI_Win_lock (exclusive? MPI_LOCK_EXCLUSIVE : MPI_LOCK_SHARED,
+							   target, 0, mWin)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIWindow::lock(): %s\n",
+								 (CONSTR) mComm.mpi().error(errcode)));
+}
+
+void MPIWindow::unlock (int target) {
+	MPIPROF_SITE;
+	int errcode;
+	if ((errcode=MPI_Win_unlock (target, mWin)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIWindow::unlock(): %s\n",
+								 (CONSTR) mComm.mpi().error(errcode)));
+}
+
+#if MPI_VERSION >= 3
+
+void MPIWindow::lockAll () {
+	MPIPROF_SITE;
+	int errcode;
+	if ((errcode=MPI_Win_lock_all (0, mWin)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIWindow::lockAll(): %s\n",
+								 (CONSTR) mComm.mpi().error(errcode)));
+}
+
+void MPIWindow::unlockAll () {
+	MPIPROF_SITE;
+	int errcode;
+	if ((errcode=MPI_Win_unlock_all (mWin)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIWindow::unlockAll(): %s\n",
+								 (CONSTR) mComm.mpi().error(errcode)));
+}
+
+void MPIWindow::flush (int target) {
+	MPIPROF_SITE;
+	int errcode;
+	if ((errcode=MPI_Win_flush (target, mWin)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPIWindow::flush(): %s\n",
+								 (CONSTR) mComm.mpi().error(errcode)));
+}
+
+void MPIWindow::sync () {
+	MPIPROF_SITE;
+	MPI_Win_sync (mWin);
+}
+
+#endif
+
+#endif
+
+#if MPI_VERSION >= 3
+
+MPISharedWindow::MPISharedWindow (MPIComm& comm, int bytes) : MPIWindow (comm) {
+	int errcode;
+	if ((errcode=MPI_Win_allocate_shared (bytes, 1, MPI_INFO_NULL, comm.getCommTag(),
+										  &mpBase, &mWin)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPISharedWindow::MPISharedWindow(): %s\n",
+								 (CONSTR) comm.mpi().error(errcode)));
+}
+
+void* MPISharedWindow::segment (int rank, int* bytes) {
+	MPI_Aint size;
+	int dispUnit;
+	void* result;
+	int errcode;
+	if ((errcode=MPI_Win_shared_query (mWin, rank, &size, &dispUnit, &result)) != MPI_SUCCESS)
+		throw mpi_error (format ("Error in MPISharedWindow::segment(): %s\n",
+								 (CONSTR) mComm.mpi().error(errcode)));
+	if (bytes)
+		*bytes = size;
+	return result;
+}
+
+#endif
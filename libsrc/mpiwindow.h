@@ -0,0 +1,221 @@
+#ifndef __MPIWINDOW_H__
+#define __MPIWINDOW_H__
+
+#include "mpi++.h"
+
+#if MPI_VERSION >= 2
+
+/** A group of processes of a communicator, such as the neighbours
+ *  a process exchanges data with.
+ **/
+class MPIGroup : public Object {
+  public:
+	/** Creates the group of the given ranks of the communicator. */
+					MPIGroup		(MPIComm& comm, const int* ranks, int count);
+					~MPIGroup		();
+
+	const MPI_Group&	getGroup	() const {return mGroup;}
+	int				size			() const {return mSize;}
+
+  protected:
+	MPI_Group		mGroup;
+	int				mSize;
+
+  private:
+	/** Not copyable: a copy would free the group a second time. Not
+	 *  defined.
+	 **/
+					MPIGroup		(const MPIGroup& other);
+	MPIGroup&		operator=		(const MPIGroup& other);
+};
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//   |   | ----  --- |   | o           |                                    //
+//   |\ /| |   )  |  |   |             |                                    //
+//   | V | |---   |  | | | | |/ \    __|  __  |   |                         //
+//   | | | |      |  | | | | |   |  (  | /  \ | | |                         //
+//   |   | |     _|_  V V  | |   |   --| \__/  V V                          //
+//////////////////////////////////////////////////////////////////////////////
+
+/** A window of memory that the other processes of a communicator
+ *  can access with one-sided put(), get() and accumulate() calls,
+ *  without the target process taking part in the transfer.
+ *
+ *  The transfers take place in access epochs, which are opened and
+ *  closed in one of three ways:
+ *
+ *  @li fence() by all processes of the communicator, which ends the
+ *  previous epoch and begins the next one.
+ *
+ *  @li post() and wait() by the target, and start() and complete()
+ *  by the origin, which synchronize only the processes that
+ *  communicate with each other.
+ *
+ *  @li lock() and unlock() by the origin alone, without any action
+ *  of the target.
+ *
+ *  A transfer is complete only at the end of its epoch; the origin
+ *  buffer may not be reused, nor the target memory read, before
+ *  that.
+ *
+ *  The displacements are in units of the dispUnit given when the
+ *  window was created.
+ **/
+class MPIWindow : public Object {
+  public:
+	/** Exposes the given memory of this process in the window.
+	 *  Collective.
+	 *
+	 *  @param bytes Size of the exposed memory; the processes may
+	 *  expose memory areas of different sizes.
+	 *
+	 *  @param dispUnit Unit of the displacements at which the other
+	 *  processes access the memory, usually the size of its elements.
+	 **/
+					MPIWindow		(MPIComm& comm, void* base, int bytes, int dispUnit=1);
+	virtual			~MPIWindow		();
+
+	/** Returns the memory of this process in the window. */
+	void*			base			() {return mpBase;}
+
+	/** Writes count items from the origin buffer to the memory of
+	 *  the target process, starting at displacement disp.
+	 *
+	 *  @param targetType Datatype of the items in the target memory,
+	 *  if it has a different layout than the origin buffer, such as
+	 *  a vector with a different stride.
+	 **/
+	void			put				(const void* origin, int count, MPI_Datatype datatype,
+									 int target, MPI_Aint disp,
+									 MPI_Datatype targetType=MPI_DATATYPE_NULL);
+
+	/** Reads count items from the memory of the target process to
+	 *  the origin buffer.
+	 **/
+	void			get				(void* origin, int count, MPI_Datatype datatype,
+									 int target, MPI_Aint disp,
+									 MPI_Datatype targetType=MPI_DATATYPE_NULL);
+
+	/** Combines count items from the origin buffer with the memory of
+	 *  the target process with the given operation. The accumulates
+	 *  of several processes to the same location within an epoch do
+	 *  not conflict, as long as they use the same operation.
+	 **/
+	void			accumulate		(const void* origin, int count, MPI_Datatype datatype,
+									 int target, MPI_Aint disp, MPI_Op op=MPI_SUM,
+									 MPI_Datatype targetType=MPI_DATATYPE_NULL);
+
+	/** Completes all the transfers of the epoch, and begins a new
+	 *  one. Collective.
+	 *
+	 *  @param assertion MPI_MODE_* hints, such as MPI_MODE_NOPRECEDE
+	 *  or MPI_MODE_NOSUCCEED.
+	 **/
+	void			fence			(int assertion=0);
+
+	/** Exposes the memory of this process to the origin processes
+	 *  until wait(). The origins must call start() with a group that
+	 *  contains this process.
+	 **/
+	void			post			(const MPIGroup& origins, int assertion=0);
+
+	/** Begins an epoch for accessing the memory of the target
+	 *  processes, which must call post() with a group that contains
+	 *  this process.
+	 **/
+	void			start			(const MPIGroup& targets, int assertion=0);
+
+	/** Completes the transfers begun after start(). */
+	void			complete		();
+
+	/** Waits until the origins have completed their transfers to the
+	 *  memory of this process.
+	 **/
+	void			wait			();
+
+	/** Begins a passive-target epoch for accessing the memory of the
+	 *  target process. An exclusive lock also excludes the other
+	 *  origins.
+	 **/
+	void			lock			(int target, bool exclusive=false);
+
+	/** Completes the transfers to the target, and ends the epoch
+	 *  begun with lock().
+	 **/
+	void			unlock			(int target);
+
+#if MPI_VERSION >= 3
+	/** Begins a passive-target epoch to all the processes. */
+	void			lockAll			();
+
+	/** Ends the epoch begun with lockAll(). */
+	void			unlockAll		();
+
+	/** Completes the transfers to the target within a passive-target
+	 *  epoch, without ending the epoch.
+	 **/
+	void			flush			(int target);
+
+	/** Synchronizes the public and private copies of the memory of
+	 *  this process within a passive-target epoch.
+	 **/
+	void			sync			();
+#endif
+
+	MPIComm&		comm			() {return mComm;}
+
+  protected:
+	/** For subclasses that let MPI allocate the memory. */
+					MPIWindow		(MPIComm& comm)
+							: mComm (comm), mWin (MPI_WIN_NULL), mpBase (NULL) {}
+
+	MPIComm&		mComm;
+	MPI_Win			mWin;
+	void*			mpBase;
+
+  private:
+	/** Not copyable: a copy would free the window a second time. Not
+	 *  defined.
+	 **/
+					MPIWindow		(const MPIWindow& other);
+	MPIWindow&		operator=		(const MPIWindow& other);
+};
+
+#endif
+
+#if MPI_VERSION >= 3
+
+/** Memory shared by the processes of a node.
+ *
+ *  Every process contributes a segment to the window, and can access
+ *  the segments of the other processes directly through the pointers
+ *  returned by segment(), without any messages. The communicator must
+ *  contain only processes that share memory, such as the one from
+ *  MPIComm::nodeComm().
+ *
+ *  The loads and stores must be synchronized like the transfers:
+ *  either collectively with fence(), which separates the phases of a
+ *  computation, or with lockAll() and sync() for finer-grained
+ *  protocols.
+ **/
+class MPISharedWindow : public MPIWindow {
+  public:
+	/** Allocates the segment of this process. Collective.
+	 *
+	 *  @param bytes Size of the segment of this process; the
+	 *  processes may have segments of different sizes.
+	 **/
+					MPISharedWindow	(MPIComm& comm, int bytes);
+
+	/** Returns the segment of the given process in the communicator,
+	 *  mapped to this process. The size of the segment is stored in
+	 *  bytes, unless it is NULL.
+	 **/
+	void*			segment			(int rank, int* bytes=NULL);
+};
+
+#endif
+
+#endif